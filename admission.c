@@ -0,0 +1,139 @@
+#include "csapp.h"
+#include "admission.h"
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+struct admission_stats
+{
+	atomic_long clients, misses; // in flight
+	atomic_ulong clients_max, misses_max;
+	atomic_ulong rejected_clients, shed_misses, shed_wait;
+};
+
+static struct admission_config config;
+static struct admission_stats stats;
+static char response[128]; // prebuilt 503, sent without formatting anything under overload
+static size_t response_len;
+
+/**
+ * @brief apply limits, fill in defaults and build the 503 response
+ *
+ * @param cfg admission configuration, copied
+ */
+void admission_init(const struct admission_config *cfg)
+{
+	struct rlimit rl;
+
+	config = *cfg;
+	if (config.max_clients <= 0)
+	{
+		config.max_clients = 512;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > 128)
+			config.max_clients = (rl.rlim_cur - 64) / 2; // keep some fds for listen sockets, epoll and logs
+	}
+	if (config.max_misses <= 0)
+		config.max_misses = ADMISSION_DEFAULT_MAX_MISSES;
+	response_len = snprintf(response, sizeof(response),
+							"HTTP/1.0 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+							config.retry_after);
+}
+
+static void admission_max(atomic_ulong *obj, unsigned long val)
+{
+	unsigned long cur = atomic_load_explicit(obj, memory_order_relaxed);
+	while (cur < val && !atomic_compare_exchange_weak_explicit(obj, &cur, val, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/**
+ * @brief reserve a client slot for a connection just accepted, released by admission_release
+ *
+ * @return bool - false if the connection must be rejected with admission_reject
+ */
+bool admission_accept(void)
+{
+	long n = atomic_fetch_add(&stats.clients, 1) + 1;
+
+	if (n > config.max_clients)
+	{
+		atomic_fetch_sub(&stats.clients, 1);
+		atomic_fetch_add_explicit(&stats.rejected_clients, 1, memory_order_relaxed);
+		return false;
+	}
+	admission_max(&stats.clients_max, n);
+	return true;
+}
+
+void admission_release(void)
+{
+	atomic_fetch_sub(&stats.clients, 1);
+}
+
+/**
+ * @brief decide whether a cache miss may go to the origin, released by admission_miss_end
+ *
+ * @return bool - false if the request must be answered with admission_response
+ */
+bool admission_miss_begin(void)
+{
+	long n;
+
+	if (config.max_queue_wait_ms && config.queue_wait_ns && config.queue_wait_ns() > config.max_queue_wait_ms * 1000000)
+	{
+		atomic_fetch_add_explicit(&stats.shed_wait, 1, memory_order_relaxed);
+		return false;
+	}
+	if ((n = atomic_fetch_add(&stats.misses, 1) + 1) > config.max_misses)
+	{
+		atomic_fetch_sub(&stats.misses, 1);
+		atomic_fetch_add_explicit(&stats.shed_misses, 1, memory_order_relaxed);
+		return false;
+	}
+	admission_max(&stats.misses_max, n);
+	return true;
+}
+
+void admission_miss_end(void)
+{
+	atomic_fetch_sub(&stats.misses, 1);
+}
+
+/**
+ * @brief return the prebuilt 503 response
+ *
+ * @param len set to its length
+ * @return const char* - response, valid for the life of the process
+ */
+const char *admission_response(size_t *len)
+{
+	*len = response_len;
+	return response;
+}
+
+/**
+ * @brief send the 503 response without ever blocking, then the caller closes fd
+ *
+ * @param fd client fd
+ */
+void admission_reject(int fd)
+{
+	send(fd, response, response_len, MSG_DONTWAIT | MSG_NOSIGNAL); // a fresh socket has room, else the client gets a reset
+}
+
+/**
+ * @brief dump admission counters
+ *
+ * @param fp output stream
+ */
+void admission_print_stats(FILE *fp)
+{
+	fprintf(fp, "admission: clients %ld (max %lu, limit %d), rejected %lu\n",
+			atomic_load(&stats.clients), atomic_load(&stats.clients_max), config.max_clients,
+			atomic_load(&stats.rejected_clients));
+	fprintf(fp, "admission: misses in flight %ld (max %lu, limit %d), shed %lu by limit, %lu by queue wait",
+			atomic_load(&stats.misses), atomic_load(&stats.misses_max), config.max_misses,
+			atomic_load(&stats.shed_misses), atomic_load(&stats.shed_wait));
+	if (config.queue_wait_ns)
+		fprintf(fp, " (now %.1f ms, limit %lu ms)", config.queue_wait_ns() / 1e6, config.max_queue_wait_ms);
+	fprintf(fp, "\n");
+}
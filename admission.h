@@ -0,0 +1,38 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Overload protection. Connections beyond max_clients are answered with a
+ * prebuilt 503 right after accept. Requests that miss the cache are shed the
+ * same way when max_misses origin fetches are in flight or connections wait
+ * longer than max_queue_wait_ms for a worker, while cache hits are still
+ * served from the connections we did accept.
+ */
+
+#define ADMISSION_DEFAULT_MAX_MISSES 512
+#define ADMISSION_DEFAULT_MAX_QUEUE_WAIT 500 // ms
+#define ADMISSION_DEFAULT_RETRY_AFTER 1		 // seconds
+
+struct admission_config
+{
+	int max_clients;			   // 0 picks half of RLIMIT_NOFILE, a miss needs a second fd
+	int max_misses;
+	unsigned long max_queue_wait_ms; // 0 disables the queue wait limit
+	int retry_after;			   // seconds, sent in Retry-After
+	unsigned long (*queue_wait_ns)(void); // recent queue wait, NULL if connections are not queued
+};
+
+void admission_init(const struct admission_config *);
+bool admission_accept(void);
+void admission_release(void);
+bool admission_miss_begin(void);
+void admission_miss_end(void);
+const char *admission_response(size_t *len);
+void admission_reject(int fd);
+void admission_print_stats(FILE *);
+
+#endif /* __ADMISSION_H__ */
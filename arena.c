@@ -0,0 +1,162 @@
+#include "csapp.h"
+#include "arena.h"
+#include <stdatomic.h>
+
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t size; // of data, ARENA_CHUNK_SIZE unless made for one large allocation
+	_Alignas(ARENA_ALIGN) char data[];
+};
+struct arena_stats
+{
+	atomic_ulong resets, requests, allocs, bytes, bytes_max, mallocs, large;
+};
+
+static __thread struct arena_chunk *t_free; // chunk cache of the calling thread
+static __thread int t_nfree;
+static struct arena_stats stats;
+
+/**
+ * @brief take a chunk of at least n bytes, from the thread cache if it is a regular one
+ *
+ * @param a arena, counts the mallocs
+ * @param n bytes needed
+ * @return struct arena_chunk*
+ */
+static struct arena_chunk *chunk_get(struct arena *a, size_t n)
+{
+	struct arena_chunk *chunk;
+	size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+
+	if (size == ARENA_CHUNK_SIZE && (chunk = t_free) != NULL)
+	{
+		t_free = chunk->next;
+		t_nfree--;
+		return chunk;
+	}
+	chunk = Malloc(sizeof(*chunk) + size);
+	chunk->size = size;
+	a->mallocs++;
+	if (size > ARENA_CHUNK_SIZE)
+		atomic_fetch_add_explicit(&stats.large, 1, memory_order_relaxed);
+	return chunk;
+}
+
+static void chunk_put(struct arena_chunk *chunk)
+{
+	if (chunk->size != ARENA_CHUNK_SIZE || t_nfree == ARENA_CACHE_CHUNKS)
+	{
+		free(chunk);
+		return;
+	}
+	chunk->next = t_free;
+	t_free = chunk;
+	t_nfree++;
+}
+
+/**
+ * @brief make an empty arena, it takes no memory until the first allocation
+ *
+ * @param a arena
+ */
+void arena_init(struct arena *a)
+{
+	a->chunks = NULL;
+	a->used = 0;
+	a->allocs = a->bytes = a->mallocs = 0;
+}
+
+/**
+ * @brief allocate n bytes aligned to ARENA_ALIGN, released by arena_reset
+ *
+ * @param a arena
+ * @param n size
+ * @return void* - never NULL
+ */
+void *arena_alloc(struct arena *a, size_t n)
+{
+	struct arena_chunk *chunk;
+	size_t start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	a->allocs++;
+	a->bytes += n;
+	if (a->chunks == NULL || start + n > a->chunks->size)
+	{
+		chunk = chunk_get(a, n);
+		if (a->chunks && n > ARENA_CHUNK_SIZE) // keep carving the current chunk, the large one is used up
+		{
+			chunk->next = a->chunks->next;
+			a->chunks->next = chunk;
+			return chunk->data;
+		}
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		start = 0;
+	}
+	a->used = start + n;
+	return a->chunks->data + start;
+}
+
+/**
+ * @brief copy n bytes of s and a terminating NUL into the arena
+ *
+ * @param a arena
+ * @param s string
+ * @param n length to copy
+ * @return char*
+ */
+char *arena_strndup(struct arena *a, const char *s, size_t n)
+{
+	char *p = arena_alloc(a, n + 1);
+
+	memcpy(p, s, n);
+	p[n] = '\0';
+	return p;
+}
+
+/**
+ * @brief release everything allocated from a, its chunks go back to the thread cache
+ *
+ * @param a arena
+ * @param requests number of requests served from it since the last reset, for the statistics
+ */
+void arena_reset(struct arena *a, int requests)
+{
+	struct arena_chunk *chunk;
+	unsigned long max;
+
+	if (a->allocs)
+	{
+		atomic_fetch_add_explicit(&stats.resets, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&stats.requests, requests, memory_order_relaxed);
+		atomic_fetch_add_explicit(&stats.allocs, a->allocs, memory_order_relaxed);
+		atomic_fetch_add_explicit(&stats.bytes, a->bytes, memory_order_relaxed);
+		atomic_fetch_add_explicit(&stats.mallocs, a->mallocs, memory_order_relaxed);
+		max = atomic_load_explicit(&stats.bytes_max, memory_order_relaxed);
+		while (a->bytes > max && !atomic_compare_exchange_weak_explicit(&stats.bytes_max, &max, a->bytes, memory_order_relaxed, memory_order_relaxed))
+			;
+	}
+	while ((chunk = a->chunks) != NULL)
+	{
+		a->chunks = chunk->next;
+		chunk_put(chunk);
+	}
+	arena_init(a);
+}
+
+/**
+ * @brief dump allocation counters of all arenas
+ *
+ * @param fp output stream
+ */
+void arena_print_stats(FILE *fp)
+{
+	unsigned long requests = atomic_load(&stats.requests), n = requests ? requests : 1;
+
+	fprintf(fp, "arena: %lu requests in %lu resets, %.1f allocations and %.0f bytes per request (max %lu per reset)\n",
+			requests, atomic_load(&stats.resets), (double)atomic_load(&stats.allocs) / n,
+			(double)atomic_load(&stats.bytes) / n, atomic_load(&stats.bytes_max));
+	fprintf(fp, "arena: %lu chunks malloc'ed (%.3f per request), %lu of them for allocations over %d KB\n",
+			atomic_load(&stats.mallocs), (double)atomic_load(&stats.mallocs) / n, atomic_load(&stats.large), ARENA_CHUNK_SIZE / 1024);
+}
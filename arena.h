@@ -0,0 +1,39 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Bump allocator for everything a request needs until its response is
+ * written: header arrays, the server side request, response heads, cache
+ * hit copies. Nothing is freed on its own; arena_reset releases it all at
+ * once when the request (or pipelined batch) is done.
+ *
+ * Memory comes in ARENA_CHUNK_SIZE chunks from a cache of the calling
+ * thread, so once a thread has served a few requests it no longer calls
+ * malloc for them. An arena must stay on the thread that created it, which
+ * holds for serve() and for the connections of a loop.
+ */
+
+#define ARENA_CHUNK_SIZE (32 * 1024)
+#define ARENA_CACHE_CHUNKS 8 // free chunks a thread keeps
+#define ARENA_ALIGN 16
+
+struct arena_chunk;
+struct arena
+{
+	struct arena_chunk *chunks; // newest first, allocations come from the first one
+	size_t used;				// bytes taken from the first chunk
+	unsigned long allocs;		// since the last reset
+	size_t bytes;
+	unsigned long mallocs; // chunks that did not come from the thread cache
+};
+
+void arena_init(struct arena *);
+void *arena_alloc(struct arena *, size_t n);
+char *arena_strndup(struct arena *, const char *s, size_t n);
+void arena_reset(struct arena *, int requests);
+void arena_print_stats(FILE *);
+
+#endif /* __ARENA_H__ */
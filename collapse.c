@@ -0,0 +1,340 @@
+#include "collapse.h"
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+enum collapse_state
+{
+	FILL_HEAD,	 // waiting for a response that can be shared
+	FILL_BODY,	 // its body is arriving
+	FILL_DONE,	 // it is complete
+	FILL_ABORTED // the leader gave up, or the response cannot be shared
+};
+struct collapse_fill
+{
+	struct collapse_fill *next; // in its bucket, until it ends
+	char *key;					// request as the cache tells requests apart
+	sem_t mutex;
+	int refs; // leader and followers
+	enum collapse_state state;
+	char *type;	 // Content-Type, from FILL_BODY on
+	char *data;	 // Malloc'ed body of length bytes, len of which arrived
+	size_t len, length;
+	struct collapse_follower *followers;
+	bool followed; // some request followed it, even if it left since
+};
+struct collapse_shard
+{
+	sem_t sem;
+	struct collapse_fill *buckets[COLLAPSE_BUCKETS];
+};
+struct collapse_stats
+{
+	atomic_ulong fills, followers, done, shared; // shared: done with followers
+	atomic_ulong fallbacks, cut;				 // followers that fetched on their own, or whose response was cut short
+};
+
+static struct collapse_config config;
+static struct collapse_shard shards[COLLAPSE_SHARDS];
+static struct collapse_stats stats;
+
+/**
+ * @brief apply the configuration
+ *
+ * @param cfg configuration, copied
+ */
+void collapse_init(const struct collapse_config *cfg)
+{
+	config = *cfg;
+	for (int i = 0; i < COLLAPSE_SHARDS; i++)
+		Sem_init(&shards[i].sem, 0, 1);
+}
+
+/**
+ * @brief build the key of a request, the fields is_request_info_equal compares
+ *
+ * @param req request line
+ * @return char* - Malloc'ed key
+ */
+static char *collapse_key(struct request_info req)
+{
+	size_t len = strlen(req.method) + strlen(req.host) + strlen(req.port) + strlen(req.abs_path) + strlen(req.http_version) + 4;
+	char *key = Malloc(len);
+
+	snprintf(key, len, "%s %s:%s%s %s", req.method, req.host, req.port, req.abs_path, req.http_version);
+	return key;
+}
+
+/**
+ * @brief hash key to its shard and bucket
+ *
+ * @param key request key
+ * @param bucket set to the bucket of key in the returned shard
+ * @return struct collapse_shard*
+ */
+static struct collapse_shard *collapse_shard(const char *key, struct collapse_fill ***bucket)
+{
+	unsigned long hash = 2166136261UL; // FNV-1a
+	struct collapse_shard *shard;
+
+	for (const char *s = key; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619UL;
+	shard = &shards[hash % COLLAPSE_SHARDS];
+	*bucket = &shard->buckets[hash / COLLAPSE_SHARDS % COLLAPSE_BUCKETS];
+	return shard;
+}
+
+/**
+ * @brief drop a reference to fill, freeing it with the last one
+ *
+ * @param fill fill out of the table
+ */
+static void collapse_put(struct collapse_fill *fill)
+{
+	bool last;
+
+	P(&fill->mutex);
+	last = --fill->refs == 0;
+	V(&fill->mutex);
+	if (!last)
+		return;
+	free(fill->data);
+	free(fill->type);
+	free(fill->key);
+	free(fill);
+}
+
+/**
+ * @brief wake up every follower of fill
+ *
+ * @param fill fill, locked
+ */
+static void collapse_notify(struct collapse_fill *fill)
+{
+	for (struct collapse_follower *f = fill->followers; f; f = f->next)
+		eventfd_write(f->efd, 1);
+}
+
+/**
+ * @brief follow the fill of a request already in flight, or start one
+ *
+ * @param req cache miss, cacheable
+ * @param keep_alive whether the client connection persists after the response, for a follower
+ * @param lead whether the caller may lead a fill: it reads the response as soon as it is sent, waiting on no other fill
+ * @param fill set to the new fill of a leader, which ends it with collapse_end
+ * @param f initialized for a follower, which reads with collapse_read and leaves with collapse_leave
+ * @return enum collapse_role
+ */
+enum collapse_role collapse_join(struct request_info req, bool keep_alive, bool lead, struct collapse_fill **fill, struct collapse_follower *f)
+{
+	struct collapse_fill **bucket, *p;
+	struct collapse_shard *shard;
+	enum collapse_role role = COLLAPSE_NONE;
+	char *key;
+
+	*fill = NULL;
+	f->fill = NULL;
+	if (!config.enabled)
+		return COLLAPSE_NONE;
+	key = collapse_key(req);
+	shard = collapse_shard(key, &bucket);
+	P(&shard->sem);
+	for (p = *bucket; p && strcmp(p->key, key) != 0; p = p->next)
+		;
+	if (p)
+	{
+		P(&p->mutex);
+		if (p->state != FILL_ABORTED && (f->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0)
+		{
+			*f = (struct collapse_follower){.next = p->followers, .fill = p, .efd = f->efd, .keep_alive = keep_alive};
+			p->followers = f;
+			p->refs++;
+			p->followed = true;
+			role = COLLAPSE_FOLLOWER;
+		}
+		V(&p->mutex);
+	}
+	else if (lead)
+	{
+		p = Calloc(1, sizeof(*p));
+		p->key = key;
+		key = NULL;
+		Sem_init(&p->mutex, 0, 1);
+		p->refs = 1;
+		p->state = FILL_HEAD;
+		p->next = *bucket;
+		*bucket = p;
+		*fill = p;
+		role = COLLAPSE_LEADER;
+	}
+	V(&shard->sem);
+	free(key);
+	if (role != COLLAPSE_NONE)
+		atomic_fetch_add_explicit(role == COLLAPSE_LEADER ? &stats.fills : &stats.followers, 1, memory_order_relaxed);
+	return role;
+}
+
+/**
+ * @brief share the response of a fill: its head is cacheable, its body length bytes
+ *
+ * @param fill fill led by the caller
+ * @param type Content-Type, copied
+ * @param length body length, at most MAX_OBJECT_SIZE
+ */
+void collapse_begin(struct collapse_fill *fill, const char *type, size_t length)
+{
+	P(&fill->mutex);
+	fill->type = strdup(type);
+	fill->data = Malloc(length ? length : 1);
+	fill->length = length;
+	fill->state = FILL_BODY;
+	collapse_notify(fill);
+	V(&fill->mutex);
+}
+
+/**
+ * @brief add the next bytes of the body to a fill
+ *
+ * @param fill fill led by the caller, begun
+ * @param buf body bytes
+ * @param n length of buf
+ */
+void collapse_append(struct collapse_fill *fill, const char *buf, size_t n)
+{
+	P(&fill->mutex);
+	if (fill->state == FILL_BODY && n <= fill->length - fill->len)
+	{
+		memcpy(fill->data + fill->len, buf, n);
+		fill->len += n;
+		collapse_notify(fill);
+	}
+	V(&fill->mutex);
+}
+
+/**
+ * @brief end a fill, once its response is in the cache or known not to go there
+ *
+ * The fill leaves the table, later misses fetch again. Followers read what
+ * it has until they leave.
+ *
+ * @param fill fill led by the caller, which must not use it any more
+ * @param complete whether the whole body was appended
+ */
+void collapse_end(struct collapse_fill *fill, bool complete)
+{
+	struct collapse_fill **bucket, **link;
+	struct collapse_shard *shard = collapse_shard(fill->key, &bucket);
+	bool shared;
+
+	P(&fill->mutex);
+	fill->state = complete && fill->state == FILL_BODY && fill->len == fill->length ? FILL_DONE : FILL_ABORTED;
+	shared = fill->followed;
+	collapse_notify(fill);
+	V(&fill->mutex);
+	if (fill->state == FILL_DONE)
+	{
+		atomic_fetch_add_explicit(&stats.done, 1, memory_order_relaxed);
+		if (shared)
+			atomic_fetch_add_explicit(&stats.shared, 1, memory_order_relaxed);
+	}
+	P(&shard->sem);
+	for (link = bucket; *link != fill; link = &(*link)->next)
+		;
+	*link = fill->next;
+	V(&shard->sem);
+	collapse_put(fill);
+}
+
+/**
+ * @brief read the next bytes of the response of a fill: the head, as served from cache, then the body
+ *
+ * @param f follower
+ * @param buf filled with response bytes
+ * @param len size of buf
+ * @return ssize_t - bytes read, 0 at the end of the response, COLLAPSE_PENDING until the fill has more,
+ * COLLAPSE_FALLBACK if it ended before the follower read anything, -1 if it ended after
+ */
+ssize_t collapse_read(struct collapse_follower *f, char *buf, size_t len)
+{
+	struct collapse_fill *fill = f->fill;
+	eventfd_t wakeups;
+	size_t n = 0, take;
+	ssize_t rc;
+	int head_len;
+
+	eventfd_read(f->efd, &wakeups); // reset it before looking, so no progress after this goes unnoticed
+	P(&fill->mutex);
+	if (fill->state == FILL_HEAD)
+		rc = COLLAPSE_PENDING;
+	else if (fill->state == FILL_ABORTED && !f->started)
+		rc = COLLAPSE_FALLBACK;
+	else
+	{
+		if (f->head == NULL)
+		{
+			head_len = cache_response_head(NULL, 0, fill->length, fill->type, f->keep_alive);
+			f->head = Malloc(head_len + 1);
+			f->head_len = cache_response_head(f->head, head_len + 1, fill->length, fill->type, f->keep_alive);
+		}
+		take = f->head_len - f->head_off < len ? f->head_len - f->head_off : len;
+		memcpy(buf, f->head + f->head_off, take);
+		f->head_off += take;
+		n += take;
+		take = fill->len - f->off < len - n ? fill->len - f->off : len - n;
+		memcpy(buf + n, fill->data + f->off, take);
+		f->off += take;
+		n += take;
+		if (n > 0)
+			rc = n;
+		else if (f->off == fill->length)
+			rc = 0;
+		else
+			rc = fill->state == FILL_ABORTED ? -1 : COLLAPSE_PENDING;
+	}
+	V(&fill->mutex);
+	if (rc > 0)
+		f->started = true;
+	else if (rc == COLLAPSE_FALLBACK || rc == -1)
+		atomic_fetch_add_explicit(rc == -1 ? &stats.cut : &stats.fallbacks, 1, memory_order_relaxed);
+	return rc;
+}
+
+/**
+ * @brief stop following a fill, nothing if f is not following any
+ *
+ * @param f follower
+ */
+void collapse_leave(struct collapse_follower *f)
+{
+	struct collapse_fill *fill = f->fill;
+	struct collapse_follower **link;
+
+	if (fill == NULL)
+		return;
+	P(&fill->mutex);
+	for (link = &fill->followers; *link != f; link = &(*link)->next)
+		;
+	*link = f->next;
+	V(&fill->mutex);
+	close(f->efd);
+	free(f->head);
+	f->head = NULL;
+	f->fill = NULL;
+	collapse_put(fill);
+}
+
+/**
+ * @brief dump collapsed forwarding counters
+ *
+ * @param fp output stream
+ */
+void collapse_print_stats(FILE *fp)
+{
+	if (!config.enabled)
+	{
+		fprintf(fp, "collapse: off\n");
+		return;
+	}
+	fprintf(fp, "collapse: %lu fills, %lu done (%lu shared), %lu requests followed one, %lu fell back, %lu cut short\n",
+			atomic_load(&stats.fills), atomic_load(&stats.done), atomic_load(&stats.shared), atomic_load(&stats.followers),
+			atomic_load(&stats.fallbacks), atomic_load(&stats.cut));
+}
@@ -0,0 +1,60 @@
+#ifndef __COLLAPSE_H__
+#define __COLLAPSE_H__
+
+#include "proxy.h"
+
+/*
+ * Collapsed forwarding: concurrent cache misses for the same request share
+ * one fetch from the server. The first miss leads a fill, the requests that
+ * miss while it is in flight follow it and get the response from the fill
+ * instead of the server, and the cache gets it from the leader as before.
+ *
+ * A fill does not know whether the response can be shared until its head is
+ * in. A cacheable Content-Length body then streams to the followers as it
+ * arrives; a chunked one only once it is complete and known to fit in
+ * MAX_OBJECT_SIZE. A response that cannot be cached ends the fill, and its
+ * followers that got nothing yet fetch the request themselves.
+ *
+ * Each follower has an eventfd of its own, which the leader signals when
+ * the fill makes progress, so a follower waits like for a socket: with
+ * rio_poll() in serve(), or as CONN_OP_POLL in the event engines.
+ */
+
+#define COLLAPSE_SHARDS 16
+#define COLLAPSE_BUCKETS 64		// hash buckets of a shard
+#define COLLAPSE_PENDING -2		// from collapse_read: poll efd, then read again
+#define COLLAPSE_FALLBACK -3	// from collapse_read: the fill ended without a response to share, fetch it
+
+enum collapse_role
+{
+	COLLAPSE_NONE,	   // fetch the request alone
+	COLLAPSE_LEADER,   // fetch it and feed the fill
+	COLLAPSE_FOLLOWER  // read the response from the fill
+};
+struct collapse_config
+{
+	bool enabled;
+};
+struct collapse_fill;
+struct collapse_follower
+{
+	struct collapse_follower *next; // of the same fill
+	struct collapse_fill *fill;		// NULL once left
+	int efd;						// eventfd, readable after the fill made progress
+	bool keep_alive;				// of the client connection, for the response head
+	char *head;						// response head, Malloc'ed once the fill has one
+	size_t head_len, head_off;
+	size_t off;	  // body bytes read
+	bool started; // a byte was read, it is too late to fall back
+};
+
+void collapse_init(const struct collapse_config *);
+enum collapse_role collapse_join(struct request_info, bool keep_alive, bool lead, struct collapse_fill **fill, struct collapse_follower *);
+void collapse_begin(struct collapse_fill *, const char *type, size_t length);
+void collapse_append(struct collapse_fill *, const char *buf, size_t n);
+void collapse_end(struct collapse_fill *, bool complete);
+ssize_t collapse_read(struct collapse_follower *, char *buf, size_t len);
+void collapse_leave(struct collapse_follower *);
+void collapse_print_stats(FILE *);
+
+#endif /* __COLLAPSE_H__ */
@@ -0,0 +1,1066 @@
+#define _GNU_SOURCE
+#include "conn.h"
+#include "engine.h"
+#include "admission.h"
+#include "upstream.h"
+
+struct conn_stats
+{
+	atomic_ulong accepted, closed, hits, misses, errors, timeouts;
+	atomic_ulong reused; // requests after the first of a persistent connection
+	atomic_ulong upstream_requests, upstream_writes; // write operations that sent request heads to servers
+}; // one per loop, written only by its loop
+
+static void conn_next_request(struct conn *);
+
+static struct conn_stats *all_stats[ENGINE_MAX_LOOPS];
+static atomic_int nstats;
+static __thread struct conn_stats *t_stats;
+
+/**
+ * @brief give the calling loop its own counters
+ *
+ */
+void conn_stats_register(void)
+{
+	int index = atomic_fetch_add(&nstats, 1);
+
+	t_stats = Calloc(1, sizeof(*t_stats));
+	if (index < ENGINE_MAX_LOOPS)
+		all_stats[index] = t_stats;
+}
+
+/**
+ * @brief arm the timer of c for deadline_ms, or disarm it if 0
+ *
+ * @param c connection
+ * @param deadline_ms CLOCK_MONOTONIC ms
+ */
+static void conn_set_deadline(struct conn *c, uint64_t deadline_ms)
+{
+	if (deadline_ms)
+		timer_add(c->timers, &c->timer, deadline_ms);
+	else
+		timer_del(c->timers, &c->timer);
+}
+
+/**
+ * @brief create a connection in CONN_REQUEST state
+ *
+ * @param clientfd non-blocking client fd, owned by the connection along with its admission_accept slot
+ * @param in engine supplied request buffer of CONN_REQUEST_MAX bytes, or NULL
+ * @param relay engine supplied relay buffer of CONN_RELAY_SIZE bytes, or NULL if in is NULL
+ * @param timers timer wheel of the calling loop
+ * @param dns dns queue of the calling loop
+ * @return struct conn*
+ */
+struct conn *conn_new(int clientfd, char *in, char *relay, struct timer_wheel *timers, struct dns_queue *dns)
+{
+	struct conn *c = Calloc(1, sizeof(*c));
+
+	c->timers = timers;
+	c->dns.queue = dns;
+	c->dns.data = c;
+	c->start_ms = timer_now_ms();
+	conn_set_deadline(c, timer_min(timer_after(c->start_ms, header_timeout_ms), timer_after(c->start_ms, request_timeout_ms)));
+	c->state = CONN_REQUEST;
+	c->clientfd = clientfd;
+	c->serverfd = -1;
+	c->race.epfd = -1;
+	c->own_buffers = in == NULL;
+	c->in = in ? in : Malloc(CONN_REQUEST_MAX);
+	c->relay = relay;
+	http_request_init(&c->http);
+	arena_init(&c->arena);
+	STAT_ADD(t_stats->accepted, 1);
+	return c;
+}
+
+/**
+ * @brief end the fill c leads, if any
+ *
+ * @param c connection
+ * @param complete whether the fill got the whole body
+ */
+static void conn_unlead(struct conn *c, bool complete)
+{
+	if (c->fill)
+	{
+		collapse_end(c->fill, complete);
+		c->fill = NULL;
+	}
+}
+
+/**
+ * @brief drop the body captured so far, the fill c leads ends without it
+ *
+ * @param c connection
+ */
+static void capture_reset(struct conn *c)
+{
+	conn_unlead(c, false);
+	free(c->capture_buf);
+	free(c->resp_chunked.data);
+	c->capture_buf = NULL;
+	c->resp_chunked.data = NULL;
+	c->capture = false;
+}
+
+/**
+ * @brief close both fds and release the connection and its admission slots
+ *
+ * @param c connection
+ */
+void conn_free(struct conn *c)
+{
+	if (c->clientfd >= 0)
+		close(c->clientfd);
+	if (c->serverfd >= 0)
+		close(c->serverfd);
+	race_cancel(&c->race);
+	if (c->addrs)
+		dns_freeaddrinfo(c->addrs);
+	timer_del(c->timers, &c->timer);
+	capture_reset(c);
+	collapse_leave(&c->follower);
+	if (c->own_buffers)
+	{
+		free(c->in);
+		free(c->relay);
+	}
+	arena_reset(&c->arena, 1);
+	if (c->miss_admitted)
+		admission_miss_end();
+	free(c);
+	admission_release();
+	STAT_ADD(t_stats->closed, 1);
+}
+
+/**
+ * @brief describe the operation the connection is waiting for
+ *
+ * @param c connection
+ * @param io filled with the operation
+ */
+void conn_next(struct conn *c, struct conn_io *io)
+{
+	io->fd = -1;
+	io->buf = NULL;
+	io->len = 0;
+	switch (c->state)
+	{
+	case CONN_REQUEST:
+		io->op = CONN_OP_READ_CLIENT;
+		io->fd = c->clientfd;
+		io->buf = c->in + c->in_len;
+		io->len = CONN_REQUEST_MAX - c->in_len;
+		break;
+
+	case CONN_REPLY:
+	case CONN_CONTINUE:
+		io->op = CONN_OP_WRITE_CLIENT;
+		io->fd = c->clientfd;
+		io->buf = c->out + c->out_off;
+		io->len = c->out_len - c->out_off;
+		break;
+
+	case CONN_RESOLVE:
+		io->op = CONN_OP_WAIT;
+		break;
+
+	case CONN_CONNECT:
+		io->op = CONN_OP_POLL;
+		io->fd = c->race.epfd;
+		break;
+
+	case CONN_SEND:
+	case CONN_BODY_WRITE:
+		io->op = CONN_OP_WRITE_SERVER;
+		io->fd = c->serverfd;
+		io->buf = c->out + c->out_off;
+		io->len = c->out_len - c->out_off;
+		break;
+
+	case CONN_BODY_READ:
+		io->op = CONN_OP_READ_CLIENT;
+		io->fd = c->clientfd;
+		io->buf = c->relay;
+		io->len = !c->body_chunked && c->body_left < CONN_RELAY_SIZE ? c->body_left : CONN_RELAY_SIZE;
+		break;
+
+	case CONN_RELAY_READ:
+		io->op = CONN_OP_READ_SERVER;
+		io->fd = c->serverfd;
+		io->buf = c->relay;
+		io->len = CONN_RELAY_SIZE;
+		break;
+
+	case CONN_FOLLOW:
+		io->op = CONN_OP_POLL;
+		io->fd = c->follower.efd;
+		break;
+
+	case CONN_RELAY_HEAD:
+		io->op = CONN_OP_WRITE_CLIENT;
+		io->fd = c->clientfd;
+		io->buf = c->head_out + c->head_out_off;
+		io->len = c->head_out_len - c->head_out_off;
+		break;
+
+	case CONN_RELAY_WRITE:
+	case CONN_FOLLOW_WRITE:
+		io->op = CONN_OP_WRITE_CLIENT;
+		io->fd = c->clientfd;
+		io->buf = c->relay + c->relay_off;
+		io->len = c->relay_len - c->relay_off;
+		break;
+
+	case CONN_DONE:
+	default:
+		io->op = CONN_OP_CLOSE;
+		break;
+	}
+}
+
+/**
+ * @brief queue a complete response for client, the connection closes after it is written
+ *
+ * @param c connection
+ * @param buf response, static or in the arena of c
+ * @param len length of buf
+ */
+static void conn_reply(struct conn *c, const char *buf, size_t len)
+{
+	conn_unlead(c, false); // the followers need not wait for this to be written
+	c->out = (char *)buf;
+	c->out_len = len;
+	c->out_off = 0;
+	c->state = CONN_REPLY;
+}
+
+static void conn_reply_error(struct conn *c, enum client_error_type err_type)
+{
+	STAT_ADD(t_stats->errors, 1);
+	c->keep_alive = false; // the request may not have been read to its end
+	conn_reply(c, client_error_message(err_type), strlen(client_error_message(err_type)));
+}
+
+/**
+ * @brief go on from a step of the connect race, sending the request once it is won
+ *
+ * @param c connection in CONN_CONNECT state
+ * @param fd result of race_start or race_step, with errno set if -1
+ */
+static void conn_connect_step(struct conn *c, int fd)
+{
+	if (fd == RACE_PENDING)
+		return;
+	dns_freeaddrinfo(c->addrs);
+	c->addrs = NULL;
+	if (fd < 0 && errno == ETIMEDOUT)
+	{
+		upstream_timed_out(c->req.host, c->req.port, UPSTREAM_CONNECT);
+		conn_reply_error(c, CLIENT_ERR_504);
+		return;
+	}
+	if (fd < 0)
+	{
+		conn_reply_error(c, CLIENT_ERR_502);
+		return;
+	}
+	c->serverfd = fd;
+	c->state = CONN_SEND;
+}
+
+/**
+ * @brief start racing to the addresses of the server once it is resolved, or fail with 502
+ *
+ * A connection that expired while its name was resolved is given up now.
+ *
+ * @param c connection in CONN_RESOLVE state whose waiter was answered
+ */
+void conn_resolved(struct conn *c)
+{
+	c->state = CONN_CONNECT;
+	if (c->expired)
+	{
+		c->expired = false;
+		if (c->dns.error == 0)
+			dns_freeaddrinfo(c->dns.res);
+		conn_expire(c);
+		return;
+	}
+	if (c->dns.error != 0)
+	{
+		conn_reply_error(c, CLIENT_ERR_502);
+		return;
+	}
+	c->addrs = c->dns.res;
+	conn_connect_step(c, race_start(&c->race, c->addrs));
+}
+
+/**
+ * @brief resolve the server of the request, connecting at once if its addresses are cached
+ *
+ * @param c connection whose request is in out
+ */
+static void conn_connect_start(struct conn *c)
+{
+	c->state = CONN_RESOLVE;
+	if (dns_lookup(c->req.host, c->req.port, &c->dns))
+		conn_resolved(c);
+}
+
+/**
+ * @brief send the request again on a fresh connection, the pooled one failed before any byte of the response
+ *
+ * @param c connection with server_retry set
+ */
+static void conn_retry(struct conn *c)
+{
+	upstream_discard(c->serverfd);
+	conn_set_deadline(c, 0); // the fresh connection has a connect timeout of its own
+	c->serverfd = -1;
+	c->server_retry = false;
+	c->out_off = 0;
+	conn_connect_start(c);
+}
+
+/**
+ * @brief send a cache miss to its server, over a pooled connection if there is one
+ *
+ * @param c connection
+ * @param client_hdr_info headers of the request
+ */
+static void conn_fetch(struct conn *c, struct header_info client_hdr_info)
+{
+	struct request_info server_req_info;
+	size_t buf_len;
+
+	if (!(c->miss_admitted = admission_miss_begin())) // overloaded, only cache hits are served
+	{
+		c->keep_alive = false;
+		conn_reply(c, admission_response(&buf_len), buf_len);
+		return;
+	}
+
+	server_req_info = convert_client_to_server_request(c->req);
+	c->out = format_request(server_req_info, client_hdr_info, &c->arena, &c->out_len);
+	c->out_off = 0;
+	c->expect_continue = client_hdr_info.expect_continue && strcasecmp(c->req.http_version, "HTTP/1.1") == 0;
+	c->body_chunked = client_hdr_info.chunked;
+	c->body_left = client_hdr_info.has_entity_body && !client_hdr_info.chunked ? client_hdr_info.content_length : 0;
+	http_chunked_init(&c->chunked);
+
+	if (!client_hdr_info.has_entity_body && (c->serverfd = upstream_take(c->req.host, c->req.port)) >= 0) // a body could not be sent again
+	{
+		c->server_retry = true;
+		c->state = CONN_SEND;
+		return;
+	}
+	conn_connect_start(c);
+}
+
+/**
+ * @brief write what the fill followed by c has next, or fetch the request if the fill has nothing to share
+ *
+ * @param c connection following a fill
+ */
+static void conn_follow(struct conn *c)
+{
+	ssize_t n;
+
+	if (c->relay == NULL)
+		c->relay = Malloc(CONN_RELAY_SIZE);
+	if ((n = collapse_read(&c->follower, c->relay, CONN_RELAY_SIZE)) == COLLAPSE_PENDING)
+	{
+		c->state = CONN_FOLLOW;
+		return;
+	}
+	if (n > 0)
+	{
+		c->relay_len = n;
+		c->relay_off = 0;
+		c->state = CONN_FOLLOW_WRITE;
+		return;
+	}
+	collapse_leave(&c->follower);
+	if (n == COLLAPSE_FALLBACK) // parsed before, it parses again
+		conn_fetch(c, parse_header(&c->http, c->in));
+	else if (n == 0 && c->keep_alive)
+		conn_next_request(c);
+	else
+		c->state = CONN_DONE;
+}
+
+/**
+ * @brief decide how to answer a request head http_parse is done with
+ *
+ * @param c connection
+ */
+static void conn_handle_request(struct conn *c)
+{
+	struct header_info client_hdr_info;
+	char *buf;
+	size_t buf_len;
+
+	conn_set_deadline(c, timer_after(c->start_ms, request_timeout_ms)); // the head is in, the body may follow
+	c->in_used = c->http.head_len;
+	c->req = parse_request(&c->http, c->in);
+	if (c->req.err_type != REQ_OK)
+	{
+		conn_reply_error(c, c->req.err_type == REQ_UNIMPLEMENTED ? CLIENT_ERR_501 : CLIENT_ERR_400);
+		return;
+	}
+	client_hdr_info = parse_header(&c->http, c->in);
+	if (client_hdr_info.err_type != HDR_OK)
+	{
+		conn_reply_error(c, client_hdr_info.err_type == HDR_UNIMPLEMENTED ? CLIENT_ERR_501 : CLIENT_ERR_400);
+		return;
+	}
+	if (strcmp(c->req.method, "CONNECT") == 0) // a tunnel waits on both sockets at once, the threads and coro engines serve it
+	{
+		conn_reply_error(c, CLIENT_ERR_501);
+		return;
+	}
+
+	c->keep_alive = client_keep_alive(c->req, client_hdr_info);
+	c->cacheable = is_request_cacheable(c->req, client_hdr_info);
+	if (c->cacheable && (buf = cache_build_response(c->req, c->keep_alive, &c->arena, &buf_len)) != NULL) // cache hit
+	{
+		STAT_ADD(t_stats->hits, 1);
+		conn_reply(c, buf, buf_len);
+		return;
+	}
+	STAT_ADD(t_stats->misses, 1);
+	if (c->cacheable && collapse_join(c->req, c->keep_alive, true, &c->fill, &c->follower) == COLLAPSE_FOLLOWER)
+	{
+		conn_set_deadline(c, 0); // the leader has the deadlines of the server
+		conn_follow(c);
+		return;
+	}
+	conn_fetch(c, client_hdr_info);
+}
+
+/**
+ * @brief answer the head in in once it is complete or malformed, or keep reading it
+ *
+ * @param c connection in CONN_REQUEST
+ */
+static void conn_request_parse(struct conn *c)
+{
+	c->state = CONN_REQUEST;
+	if (http_parse(&c->http, c->in, c->in_len) != HTTP_PARSE_AGAIN) // done or malformed
+		conn_handle_request(c);
+	else if (c->in_len == CONN_REQUEST_MAX) // header block does not fit
+		conn_reply_error(c, CLIENT_ERR_400);
+}
+
+/**
+ * @brief make a connection whose response is written wait for its next request, starting with the bytes pipelined after the last one
+ *
+ * @param c persistent connection, done with its server
+ */
+static void conn_next_request(struct conn *c)
+{
+	if (c->serverfd >= 0) // not pooled
+	{
+		close(c->serverfd);
+		c->serverfd = -1;
+	}
+	if (c->miss_admitted)
+		admission_miss_end();
+	capture_reset(c);
+	arena_reset(&c->arena, 1);
+	c->resp_head = c->head_out = NULL;
+	memmove(c->in, c->in + c->in_used, c->in_len - c->in_used);
+	c->in_len -= c->in_used;
+	c->in_used = 0;
+	http_request_init(&c->http);
+	c->keep_alive = c->cacheable = c->expect_continue = c->body_chunked = c->miss_admitted = false;
+	c->server_retry = c->server_dirty = c->answered = c->as_chunks = c->chunk_open = false;
+	c->body_left = 0;
+	c->out_len = c->out_off = c->relay_len = c->relay_off = c->head_out_len = c->head_out_off = 0;
+	c->idle = c->in_len == 0;
+	c->start_ms = timer_now_ms();
+	if (c->idle)
+	{
+		conn_set_deadline(c, timer_after(c->start_ms, keepalive_ms));
+		c->state = CONN_REQUEST;
+		return;
+	}
+	STAT_ADD(t_stats->reused, 1); // pipelined
+	conn_set_deadline(c, timer_min(timer_after(c->start_ms, header_timeout_ms), timer_after(c->start_ms, request_timeout_ms)));
+	conn_request_parse(c);
+}
+
+/**
+ * @brief start reading the response of server
+ *
+ * @param c connection whose request is sent
+ */
+static void conn_relay_start(struct conn *c)
+{
+	conn_set_deadline(c, timer_after(timer_now_ms(), first_byte_timeout_ms)); // the client is done, the server has a deadline of its own
+	c->answered = false;
+	if (c->resp_head == NULL)
+	{
+		c->resp_head = arena_alloc(&c->arena, MAXLINE + 1);
+		c->head_out = arena_alloc(&c->arena, CONN_HEAD_OUT_SIZE);
+	}
+	c->resp_head_len = 0;
+	c->frame = FRAME_HEAD;
+	c->state = CONN_RELAY_READ;
+}
+
+/**
+ * @brief queue the request body bytes of buf for server, checking chunked framing on the way
+ *
+ * Bytes in in past the end of the body are the next request. Bytes read
+ * past it into relay are dropped, the connection closes after the
+ * response.
+ *
+ * @param c connection
+ * @param buf bytes read from client, in in or relay
+ * @param n length of buf
+ */
+static void conn_body_write(struct conn *c, char *buf, size_t n)
+{
+	ssize_t take;
+
+	if (!c->body_chunked)
+	{
+		take = (size_t)c->body_left < n ? c->body_left : (long)n;
+		c->body_left -= take;
+	}
+	else if ((take = http_chunked_parse(&c->chunked, buf, n)) < 0)
+	{
+		conn_reply_error(c, CLIENT_ERR_400);
+		return;
+	}
+	if (buf >= c->in && buf < c->in + CONN_REQUEST_MAX)
+		c->in_used = buf + take - c->in;
+	else if ((size_t)take < n)
+		c->keep_alive = false;
+	c->out = buf;
+	c->out_len = take;
+	c->out_off = 0;
+	c->state = CONN_BODY_WRITE;
+	if (take == 0) // nothing to write, read more or relay
+		conn_complete(c, 0);
+}
+
+/**
+ * @brief decide how the body of a final response head is framed, and whether it is captured
+ *
+ * @param c connection whose resp was just parsed
+ */
+static void conn_frame_body(struct conn *c)
+{
+	bool no_body = strcasecmp(c->req.method, "HEAD") == 0 || c->resp.status == 204 || c->resp.status == 304;
+
+	c->capture = c->cacheable && is_response_cacheable(&c->resp);
+	if (c->resp.status == 101 || (!no_body && !c->resp.chunked && c->resp.content_length < 0))
+		c->frame = FRAME_CLOSE;
+	else if (no_body || (!c->resp.chunked && c->resp.content_length == 0))
+		c->frame = FRAME_DONE;
+	else
+		c->frame = FRAME_BODY;
+	if (c->frame == FRAME_BODY && c->resp.chunked)
+		chunked_body_init(&c->resp_chunked, c->capture);
+	else if (c->frame == FRAME_BODY)
+		c->resp_left = c->resp.content_length;
+	if (c->capture && !c->resp.chunked)
+		c->capture_buf = Malloc(c->resp.content_length ? c->resp.content_length : 1);
+	c->capture_len = 0;
+	if (c->fill && c->capture && !c->resp.chunked)
+		collapse_begin(c->fill, c->resp.type, c->resp.content_length);
+	else if (!c->capture) // the followers fetch it themselves
+		conn_unlead(c, false);
+}
+
+/**
+ * @brief parse the complete response head in resp_head into resp, and put what client gets of it in head_out
+ *
+ * Headers about the connection to the server are dropped and the client is
+ * told whether its connection persists, which takes a framed body. An
+ * interim 1xx head is dropped whole, the client got its 100 from us. From a
+ * line that does not parse on, the head goes out as it came.
+ *
+ * @param c connection
+ * @param head_len length of the head, including the blank line
+ * @return int - 0 on success, -1 if the head does not parse
+ */
+static int conn_head_rebuild(struct conn *c, size_t head_len)
+{
+	char *line, *eol, *blank = c->resp_head + head_len - 2;
+	size_t len = 0;
+
+	c->resp = (struct response_info){.content_length = -1};
+	for (line = c->resp_head; line < blank; line = eol + 2) // status line, then one header per line
+	{
+		eol = strstr(line, "\r\n");
+		*eol = '\0';
+		if ((line == c->resp_head ? parse_response_line(line, &c->resp) : parse_response_header(line, &c->resp, &c->arena)) != 0)
+		{
+			*eol = '\r';
+			memcpy(c->head_out + len, line, c->resp_head + head_len - line);
+			c->head_out_len = len + (c->resp_head + head_len - line);
+			return -1;
+		}
+		*eol = '\r';
+		if (line == c->resp_head || !is_hop_by_hop_header(line, eol + 2 - line))
+		{
+			memcpy(c->head_out + len, line, eol + 2 - line);
+			len += eol + 2 - line;
+		}
+	}
+	if (c->resp.status / 100 == 1 && c->resp.status != 101)
+		return 0;
+	conn_frame_body(c);
+	if (c->frame == FRAME_CLOSE && c->resp.status != 101 && c->keep_alive && strcasecmp(c->req.http_version, "HTTP/1.1") == 0)
+	{
+		c->as_chunks = true;
+		memcpy(c->head_out + 5, "1.1", 3); // chunks need an HTTP/1.1 status line
+		len += sprintf(c->head_out + len, "Transfer-Encoding: chunked\r\n");
+	}
+	else if (c->frame == FRAME_CLOSE)
+		c->keep_alive = false;
+	c->head_out_len = len + sprintf(c->head_out + len, c->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+	return 0;
+}
+
+/**
+ * @brief take the bytes of data that belong to the response head, and frame the body once the head is complete
+ *
+ * What the client gets of the head is left in head_out. A head that does
+ * not fit in MAXLINE or does not parse goes out as it came and leaves the
+ * response to end when the server closes.
+ *
+ * @param c connection in FRAME_HEAD
+ * @param data response bytes
+ * @param n length of data
+ * @return size_t - bytes of data that were part of a head
+ */
+static size_t conn_frame_head(struct conn *c, const char *data, size_t n)
+{
+	size_t used = 0, take, head_len;
+	char *end;
+
+	while (c->frame == FRAME_HEAD && used < n)
+	{
+		take = n - used < MAXLINE - c->resp_head_len ? n - used : MAXLINE - c->resp_head_len;
+		memcpy(c->resp_head + c->resp_head_len, data + used, take);
+		c->resp_head_len += take;
+		c->resp_head[c->resp_head_len] = '\0';
+		if ((end = strstr(c->resp_head, "\r\n\r\n")) == NULL)
+		{
+			if (c->resp_head_len == MAXLINE) // too long to be inspected
+			{
+				memcpy(c->head_out, c->resp_head, MAXLINE);
+				c->head_out_len = MAXLINE;
+				c->frame = FRAME_CLOSE;
+				c->keep_alive = false;
+			}
+			return used + take;
+		}
+		head_len = end + 4 - c->resp_head;
+		used += take - (c->resp_head_len - head_len); // the rest of this take is body or the next head
+		c->resp_head_len = 0;
+		if (conn_head_rebuild(c, head_len) != 0)
+		{
+			c->frame = FRAME_CLOSE;
+			c->keep_alive = false;
+			return used;
+		}
+	}
+	return used;
+}
+
+/**
+ * @brief follow the framing of the response over bytes read from server, capturing the body for the cache on the way
+ *
+ * @param c connection relaying a response that is not complete yet
+ * @param data response bytes
+ * @param n length of data
+ * @return size_t - bytes of data that belong to the response, the others came after its end
+ */
+static size_t conn_frame(struct conn *c, const char *data, size_t n)
+{
+	size_t used = 0, take;
+	ssize_t fed;
+
+	if (c->frame == FRAME_BODY && c->resp.chunked)
+	{
+		if ((fed = chunked_body_feed(&c->resp_chunked, data + used, n - used)) < 0) // relayed as it is until the server closes
+		{
+			capture_reset(c);
+			c->frame = FRAME_CLOSE;
+			return n;
+		}
+		if (c->resp_chunked.data == NULL) // over MAX_OBJECT_SIZE, or not kept
+		{
+			c->capture = false;
+			conn_unlead(c, false);
+		}
+		used += fed;
+		if (c->resp_chunked.framing.state == HTTP_CHUNK_DONE)
+			c->frame = FRAME_DONE;
+	}
+	else if (c->frame == FRAME_BODY)
+	{
+		take = n - used < (size_t)c->resp_left ? n - used : (size_t)c->resp_left;
+		if (c->capture)
+		{
+			memcpy(c->capture_buf + c->capture_len, data + used, take);
+			c->capture_len += take;
+		}
+		if (c->fill)
+			collapse_append(c->fill, data + used, take);
+		c->resp_left -= take;
+		used += take;
+		if (c->resp_left == 0)
+			c->frame = FRAME_DONE;
+	}
+	return c->frame == FRAME_CLOSE ? n : used;
+}
+
+/**
+ * @brief hand a captured body to the cache and the fill c leads if the response is complete, drop it otherwise
+ *
+ * @param c connection
+ */
+static void conn_capture_finish(struct conn *c)
+{
+	bool complete = c->capture && c->frame == FRAME_DONE;
+
+	if (c->fill && complete && c->resp.chunked) // shared only now that its length is known
+	{
+		collapse_begin(c->fill, c->resp.type, c->resp_chunked.len);
+		collapse_append(c->fill, c->resp_chunked.data, c->resp_chunked.len);
+	}
+	if (complete && c->resp.chunked)
+	{
+		cache_insert(c->req, c->resp.type, c->resp_chunked.data, c->resp_chunked.len);
+		c->resp_chunked.data = NULL;
+	}
+	else if (complete)
+	{
+		cache_insert(c->req, c->resp.type, c->capture_buf, c->capture_len);
+		c->capture_buf = NULL;
+	}
+	conn_unlead(c, complete);
+	capture_reset(c);
+}
+
+/**
+ * @brief finish a response relayed to the end of its framing, the server connection goes back to the pool if the server keeps it
+ *
+ * The client connection goes on with its next request if it persists.
+ *
+ * @param c connection in FRAME_DONE
+ */
+static void conn_relay_done(struct conn *c)
+{
+	conn_capture_finish(c);
+	if (c->resp.keep_alive && !c->server_dirty)
+	{
+		upstream_put(c->req.host, c->req.port, c->serverfd);
+		c->serverfd = -1;
+	}
+	if (c->keep_alive)
+		conn_next_request(c);
+	else
+		c->state = CONN_DONE;
+}
+
+/**
+ * @brief write what is left of the response bytes just read, or go on once they are written
+ *
+ * @param c connection relaying a response, head_out and relay_off..relay_len left to write
+ */
+static void conn_relay_flush(struct conn *c)
+{
+	if (c->head_out_off < c->head_out_len)
+		c->state = CONN_RELAY_HEAD;
+	else if (c->relay_off < c->relay_len)
+		c->state = CONN_RELAY_WRITE;
+	else if (c->frame == FRAME_DONE)
+		conn_relay_done(c);
+	else
+	{
+		conn_set_deadline(c, timer_after(timer_now_ms(), read_timeout_ms));
+		c->state = CONN_RELAY_READ;
+	}
+}
+
+/**
+ * @brief advance the connection with the result of the operation returned by conn_next
+ *
+ * @param c connection
+ * @param res bytes transferred, 0 for a completed connect or EOF, -errno on failure
+ */
+void conn_complete(struct conn *c, ssize_t res)
+{
+	switch (c->state)
+	{
+	case CONN_REQUEST:
+		if (res <= 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		if (c->idle) // the deadlines of the request start with its first byte
+		{
+			STAT_ADD(t_stats->reused, 1);
+			c->idle = false;
+			c->start_ms = timer_now_ms();
+			conn_set_deadline(c, timer_min(timer_after(c->start_ms, header_timeout_ms), timer_after(c->start_ms, request_timeout_ms)));
+		}
+		c->in_len += res;
+		conn_request_parse(c);
+		break;
+
+	case CONN_REPLY:
+		if (res < 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		if ((c->out_off += res) < c->out_len)
+			break;
+		if (c->keep_alive)
+			conn_next_request(c);
+		else
+			c->state = CONN_DONE;
+		break;
+
+	case CONN_CONNECT:
+		if (res < 0) // the engine could not poll, give up on the race
+		{
+			race_cancel(&c->race);
+			errno = -res;
+			conn_connect_step(c, -1);
+			break;
+		}
+		conn_connect_step(c, race_step(&c->race));
+		break;
+
+	case CONN_SEND:
+		STAT_ADD(t_stats->upstream_writes, 1);
+		if (res < 0 && c->server_retry) // the server closed the pooled connection
+		{
+			conn_retry(c);
+			break;
+		}
+		if (res < 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		if ((c->out_off += res) == c->out_len)
+		{
+			STAT_ADD(t_stats->upstream_requests, 1);
+			if (c->relay == NULL)
+				c->relay = Malloc(CONN_RELAY_SIZE);
+			if (!c->body_chunked && c->body_left == 0)
+				conn_relay_start(c);
+			else if (c->expect_continue)
+			{
+				conn_reply(c, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+				c->state = CONN_CONTINUE;
+			}
+			else
+				conn_body_write(c, c->in + c->http.head_len, c->in_len - c->http.head_len);
+		}
+		break;
+
+	case CONN_CONTINUE:
+		if (res < 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		if ((c->out_off += res) == c->out_len)
+			conn_body_write(c, c->in + c->http.head_len, c->in_len - c->http.head_len);
+		break;
+
+	case CONN_BODY_READ:
+		if (res <= 0) // client gone before the end of the body
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		conn_body_write(c, c->relay, res);
+		break;
+
+	case CONN_BODY_WRITE:
+		if (res < 0) // server stopped reading, it may have answered already
+		{
+			c->server_dirty = true;
+			conn_relay_start(c);
+			break;
+		}
+		if ((c->out_off += res) < c->out_len)
+			break;
+		if (c->body_chunked ? c->chunked.state == HTTP_CHUNK_DONE : c->body_left == 0)
+			conn_relay_start(c);
+		else
+			c->state = CONN_BODY_READ;
+		break;
+
+	case CONN_RELAY_READ:
+		if (res <= 0 && c->server_retry) // the server closed the pooled connection before answering
+		{
+			conn_retry(c);
+			break;
+		}
+		if (res == 0 && c->as_chunks) // the end of the body, and of its chunks
+		{
+			c->head_out_len = sprintf(c->head_out, "%s0\r\n\r\n", c->chunk_open ? "\r\n" : "");
+			c->head_out_off = c->relay_off = c->relay_len = 0;
+			c->frame = FRAME_DONE;
+			c->server_dirty = true; // closed
+			conn_relay_flush(c);
+			break;
+		}
+		if (res <= 0) // server closed, the end of a FRAME_CLOSE body or a truncated response
+		{
+			conn_capture_finish(c);
+			c->state = CONN_DONE;
+			break;
+		}
+		c->server_retry = false;
+		conn_set_deadline(c, 0); // a slow client is not the server missing its deadline
+		c->head_out_len = c->head_out_off = 0;
+		c->relay_off = c->frame == FRAME_HEAD ? conn_frame_head(c, c->relay, res) : 0; // the head goes out rebuilt
+		if ((c->relay_len = c->relay_off + conn_frame(c, c->relay + c->relay_off, res - c->relay_off)) < (size_t)res) // more than the response, out of step with us
+			c->server_dirty = true;
+		if (c->as_chunks && c->relay_len > c->relay_off) // the body bytes of this read make a chunk
+		{
+			c->head_out_len += sprintf(c->head_out + c->head_out_len, "%s%zx\r\n", c->chunk_open ? "\r\n" : "", c->relay_len - c->relay_off);
+			c->chunk_open = true;
+		}
+		c->answered = c->frame != FRAME_HEAD; // until then the client got nothing
+		conn_relay_flush(c);
+		break;
+
+	case CONN_RELAY_HEAD:
+		if (res < 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		c->head_out_off += res;
+		conn_relay_flush(c);
+		break;
+
+	case CONN_RELAY_WRITE:
+		if (res < 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		c->relay_off += res;
+		conn_relay_flush(c);
+		break;
+
+	case CONN_FOLLOW:
+		if (res < 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		conn_follow(c);
+		break;
+
+	case CONN_FOLLOW_WRITE:
+		if (res < 0)
+		{
+			c->state = CONN_DONE;
+			break;
+		}
+		if ((c->relay_off += res) == c->relay_len)
+			conn_follow(c);
+		break;
+
+	case CONN_DONE:
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief give up on a client or a server that missed its deadline, the operation in progress is abandoned
+ *
+ * A client still sending its head gets a 408, any other is dropped, as is
+ * a persistent connection that stayed idle for keepalive_ms. A
+ * server that sent nothing gets the client a 504, one whose response
+ * stalled has it cut short; either way its connection is closed first. The engine goes on with conn_next() as after
+ * conn_complete().
+ *
+ * @param c connection whose timer fired
+ */
+void conn_expire(struct conn *c)
+{
+	if (c->state == CONN_RESOLVE) // the lookup cannot be called back, the client is let go now and conn_resolved frees c
+	{
+		close(c->clientfd);
+		c->clientfd = -1;
+		c->expired = true;
+		return;
+	}
+	if (c->state == CONN_RELAY_READ) // the only state with a server deadline
+	{
+		upstream_timed_out(c->req.host, c->req.port, c->answered ? UPSTREAM_READ : UPSTREAM_FIRST_BYTE);
+		capture_reset(c);
+		close(c->serverfd); // abandoned, and an engine must not be left waiting on it while the 504 goes out
+		c->serverfd = -1;
+		if (c->answered)
+			c->state = CONN_DONE;
+		else
+			conn_reply_error(c, CLIENT_ERR_504);
+		return;
+	}
+	conn_set_deadline(c, 0);
+	if (c->idle) // a persistent connection nobody uses any more
+	{
+		c->state = CONN_DONE;
+		return;
+	}
+	STAT_ADD(t_stats->timeouts, 1);
+	if (c->state == CONN_REQUEST)
+		conn_reply_error(c, CLIENT_ERR_408);
+	else
+		c->state = CONN_DONE;
+}
+
+/**
+ * @brief dump connection counters of the event engines
+ *
+ * @param fp output stream
+ */
+void conn_print_stats(FILE *fp)
+{
+	unsigned long accepted = 0, closed = 0, hits = 0, misses = 0, errors = 0, timeouts = 0, reused = 0, upstream_requests = 0, upstream_writes = 0;
+	int n = atomic_load(&nstats);
+
+	for (int i = 0; i < n && i < ENGINE_MAX_LOOPS; i++)
+	{
+		if (all_stats[i] == NULL)
+			continue;
+		accepted += atomic_load_explicit(&all_stats[i]->accepted, memory_order_relaxed);
+		closed += atomic_load_explicit(&all_stats[i]->closed, memory_order_relaxed);
+		hits += atomic_load_explicit(&all_stats[i]->hits, memory_order_relaxed);
+		misses += atomic_load_explicit(&all_stats[i]->misses, memory_order_relaxed);
+		errors += atomic_load_explicit(&all_stats[i]->errors, memory_order_relaxed);
+		timeouts += atomic_load_explicit(&all_stats[i]->timeouts, memory_order_relaxed);
+		reused += atomic_load_explicit(&all_stats[i]->reused, memory_order_relaxed);
+		upstream_requests += atomic_load_explicit(&all_stats[i]->upstream_requests, memory_order_relaxed);
+		upstream_writes += atomic_load_explicit(&all_stats[i]->upstream_writes, memory_order_relaxed);
+	}
+	fprintf(fp, "conn: %d loops, accepted %lu, active %lu, cache hits %lu, misses %lu, errors %lu, client timeouts %lu\n",
+			n, accepted, accepted - closed, hits, misses, errors, timeouts);
+	fprintf(fp, "conn: %lu requests on persistent connections after their first\n", reused);
+	fprintf(fp, "conn: %lu requests sent to servers in %lu write operations\n", upstream_requests, upstream_writes);
+}
@@ -0,0 +1,153 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "proxy.h"
+#include "timer.h"
+#include "dns.h"
+#include "race.h"
+#include "collapse.h"
+
+/*
+ * A client connection driven by an event engine. The connection never does
+ * I/O itself: conn_next() tells the engine which operation to perform next
+ * and conn_complete() feeds back its result, so the same request logic runs
+ * on top of readiness (epoll) and completion (io_uring) based engines.
+ *
+ * The response is followed to the end of its framing, after which the
+ * server connection goes back to the upstream pool if the server keeps it
+ * open, and a persistent client connection goes back to CONN_REQUEST for
+ * its next request, starting with any bytes pipelined after this one. Its
+ * head is rebuilt on the way, without the headers about the connection to
+ * the server, as in serve(). A body that ends when the server closes is
+ * sent as chunks to a persistent HTTP/1.1 client, and closes the connection
+ * of any other, as does a request body read past its end.
+ *
+ * The client has header_timeout_ms to send its head and request_timeout_ms
+ * to send all of the request, from when it was accepted or, on a persistent
+ * connection, from its first byte after keepalive_ms of idle time at most.
+ * Then the server
+ * has first_byte_timeout_ms to start its response and read_timeout_ms for
+ * each read after that. The connection keeps its timer on the wheel of its
+ * loop while one of them runs; the engine calls conn_expire() once it fires.
+ *
+ * Server names are resolved by the resolver threads of dns.c. Meanwhile the
+ * connection asks for CONN_OP_WAIT, and the engine calls conn_resolved() once
+ * the waiter of the connection comes out of the dns queue of its loop. The
+ * connect race to the addresses then runs in race.c, the engine polls its
+ * epoll fd with CONN_OP_POLL.
+ *
+ * A cache miss for a request another connection is fetching follows its
+ * fill (collapse.h) rather than the server: CONN_FOLLOW polls the eventfd of
+ * the follower and CONN_FOLLOW_WRITE writes what the fill has so far. One
+ * that leads a fill feeds it the body it captures for the cache.
+ */
+
+#define CONN_REQUEST_MAX RIO_BUFSIZE // request line and headers must fit in one rio_t buffer
+#define CONN_RELAY_SIZE RIO_BUFSIZE
+#define CONN_HEAD_OUT_SIZE (MAXLINE + 128) // a response head, the headers replacing its own and a chunk size line
+
+enum conn_op
+{
+	CONN_OP_READ_CLIENT,
+	CONN_OP_WRITE_CLIENT,
+	CONN_OP_POLL, // wait until fd is readable, complete with 0
+	CONN_OP_WRITE_SERVER,
+	CONN_OP_READ_SERVER,
+	CONN_OP_WAIT, // nothing to do until conn_resolved()
+	CONN_OP_CLOSE
+};
+enum conn_state
+{
+	CONN_REQUEST,	  // reading request line and headers
+	CONN_REPLY,		  // writing a cached response or an error
+	CONN_RESOLVE,	  // waiting for the addresses of the server
+	CONN_CONNECT,	  // racing to connect to the server addresses
+	CONN_SEND,		  // writing the request to server
+	CONN_CONTINUE,	  // writing 100 Continue to a client waiting for it to send the body
+	CONN_BODY_READ,	  // reading the request body from client
+	CONN_BODY_WRITE,  // writing it to server
+	CONN_RELAY_READ,  // reading the response from server
+	CONN_RELAY_HEAD,  // writing the rebuilt response head to client
+	CONN_RELAY_WRITE, // writing the response to client
+	CONN_FOLLOW,	  // waiting for the fill of the request to make progress
+	CONN_FOLLOW_WRITE, // writing what the fill has to client
+	CONN_DONE
+};
+enum conn_frame_state
+{
+	FRAME_HEAD,	 // reading the status line and fields
+	FRAME_BODY,	 // reading a Content-Length or chunked body
+	FRAME_CLOSE, // the body ends when the server closes, or the response could not be framed
+	FRAME_DONE	 // the response is complete
+}; // how far the response of server has been read
+struct conn_io
+{
+	enum conn_op op;
+	int fd;
+	char *buf;
+	size_t len;
+};
+struct conn
+{
+	enum conn_state state;
+	int clientfd, serverfd;
+	bool in_progress; // set by engines while an operation is outstanding
+	bool expired;	  // set by engines while the operation of a connection past its deadline is cancelled, and by conn_expire while resolving
+	bool own_buffers; // in and relay were allocated here rather than supplied by the engine
+	char *in;		  // request bytes, CONN_REQUEST_MAX
+	size_t in_len;
+	size_t in_used; // bytes of in the request and its body took, the next request starts there
+	struct http_request http; // parsed in place in in as it arrives
+	char *out; // response to client in CONN_REPLY, request to server in CONN_SEND, body bytes in CONN_BODY_WRITE
+	size_t out_len, out_off;
+	char *relay; // CONN_RELAY_SIZE, allocated when relaying starts unless supplied
+	size_t relay_len, relay_off;
+	struct request_info req; // points into in
+	bool keep_alive;		 // the client connection persists after the response
+	bool idle;				 // waiting for the next request of a persistent connection
+	bool cacheable;			 // the response may be captured
+	bool expect_continue;	 // client waits for 100 Continue before sending the body
+	bool body_chunked;
+	long body_left; // Content-Length bytes not read from client yet
+	struct http_chunked chunked;
+	bool miss_admitted; // holds an admission_miss_begin slot
+	struct dns_waiter dns; // of the lookup in CONN_RESOLVE, answered on the dns queue of the loop
+	struct addrinfo *addrs;	 // of the server while racing to connect
+	struct connect_race race; // in CONN_CONNECT
+	bool server_retry;	// serverfd came from upstream_take, the request (without a body) may go out again on a fresh one
+	bool server_dirty;	// the server did not take the whole request or sent more than the response, serverfd is not pooled
+	struct collapse_fill *fill;		   // led until the response shows whether it can be shared
+	struct collapse_follower follower; // of the fill answering the request, if follower.fill is set
+
+	enum conn_frame_state frame;
+	struct response_info resp;
+	char *resp_head; // MAXLINE in arena, the response head while it arrives
+	size_t resp_head_len;
+	char *head_out; // CONN_HEAD_OUT_SIZE in arena, the head as it goes to client, or chunk framing
+	size_t head_out_len, head_out_off;
+	bool as_chunks;	 // a body that ends when the server closes goes to client as chunks, the connection persists
+	bool chunk_open; // a chunk went out without its closing CRLF
+	long resp_left;					  // Content-Length bytes not read from server yet
+	struct chunked_body resp_chunked; // framing of a chunked body, keeping its data if captured
+	bool answered;					  // the response head went to client, it is too late for a 504
+	bool capture;					  // the body is kept for the cache
+	char *capture_buf;				  // Malloc'ed Content-Length body handed to the cache
+	size_t capture_len;
+
+	struct timer_wheel *timers; // of the loop
+	struct timer timer;			// armed while the client or the server has a deadline
+	uint64_t start_ms; // when the client connected, or sent the first byte of the request on a persistent connection
+
+	struct arena arena; // what the request needs until the connection closes
+};
+
+struct conn *conn_new(int clientfd, char *in, char *relay, struct timer_wheel *timers, struct dns_queue *dns);
+void conn_free(struct conn *);
+void conn_next(struct conn *, struct conn_io *);
+void conn_complete(struct conn *, ssize_t res);
+void conn_resolved(struct conn *);
+void conn_expire(struct conn *);
+void conn_stats_register(void);
+void conn_print_stats(FILE *);
+
+#endif /* __CONN_H__ */
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "engine.h"
+#include "admission.h"
+#include "timer.h"
+#include "dns.h"
+#include <sys/epoll.h>
+#include <ucontext.h>
+
+/*
+ * Runs the sequential serve() of every connection on its own coroutine. The
+ * rio functions and open_clientfd of a loop thread yield to the loop through
+ * rio_setwait() when a socket would block, and the loop resumes the coroutine
+ * once epoll reports the socket ready. As in epoll_engine.c a coroutine waits
+ * on at most one fd at a time, armed with EPOLLONESHOT; only rio_poll, used by
+ * tunnels, arms several and removes them all once it is resumed. Several of
+ * them may fire in one epoll_wait, so the events of a coroutine that already
+ * ran in the batch are stale and skipped, and coroutines that finish are
+ * only freed once the batch is drained.
+ *
+ * Stacks are mapped lazily, so only the pages serve() has touched are
+ * resident, and are kept for reuse by the next connection of the loop.
+ *
+ * Coroutines waiting with a timeout, for a keep-alive interval or a client
+ * deadline of serve(), have a timer on the timer wheel of their loop, which
+ * also gives epoll_wait its timeout.
+ *
+ * A coroutine resolving a server name is parked until a resolver thread
+ * hands its waiter back on the dns queue of the loop, whose eventfd sits in
+ * the epoll set next to the sockets.
+ */
+
+struct coro
+{
+	ucontext_t ctx;
+	int fd;
+	bool done;
+	char *stack; // CORO_STACK_SIZE, above a guard page
+	struct coro *next; // free list, or dead list of the loop
+	unsigned long batch; // epoll_wait batch of the loop it last ran in
+
+	int wait_fd; // fd waited for with a timeout
+	bool timed_out;
+	struct timer timer; // armed while waiting with a timeout
+};
+struct coro_stats
+{
+	atomic_ulong accepted, resumes, live, live_max, stacks, timeouts;
+}; // written only by the owning loop
+struct coro_loop
+{
+	const struct engine_config *cfg;
+	int index, epfd, listenfd;
+	ucontext_t sched;
+	struct coro *current; // running coroutine
+	struct coro *free;
+	int nfree;
+	unsigned long batch; // epoll_wait calls so far
+	struct coro *dead;	 // finished in the current batch
+
+	struct timer_wheel timers; // of the coroutines waiting with a timeout
+	struct dns_queue dns;	   // answered lookups of parked coroutines
+	struct coro_stats stats;
+};
+
+static struct coro_loop *loops;
+static int nloops;
+static __thread struct coro_loop *t_loop;
+static size_t guard_size;
+
+/**
+ * @brief switch from the running coroutine back to the loop until fd is ready, the rio_waitfn of the engine
+ *
+ * @param fd fd the coroutine is blocked on
+ * @param writing 0 to wait for readability, otherwise writability
+ * @param timeout_ms give up after this long, < 0 for never
+ * @return int - 0 if fd is ready, -1 on timeout
+ */
+static int coro_wait(int fd, int writing, int timeout_ms)
+{
+	struct coro_loop *loop = t_loop;
+	struct coro *co = loop->current;
+	struct epoll_event ev = {.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT | EPOLLRDHUP, .data.ptr = co};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+	{
+		if (errno != ENOENT || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			unix_error("coro_wait: epoll_ctl error");
+	}
+	co->timed_out = false;
+	if (timeout_ms >= 0)
+	{
+		co->wait_fd = fd;
+		timer_add(&loop->timers, &co->timer, timer_now_ms() + timeout_ms);
+	}
+	if (swapcontext(&co->ctx, &loop->sched) < 0)
+		unix_error("coro_wait: swapcontext error");
+	return co->timed_out ? -1 : 0;
+}
+
+/**
+ * @brief switch from the running coroutine back to the loop until one of fds is ready, the rio_pollfn of the engine
+ *
+ * @param fds descriptors and events, POLLIN and POLLOUT
+ * @param nfds number of fds, each fd at most once
+ * @param timeout_ms give up after this long, < 0 for never
+ * @return int - number of ready fds with revents set, 0 on timeout
+ */
+static int coro_poll(struct pollfd *fds, int nfds, int timeout_ms)
+{
+	struct coro_loop *loop = t_loop;
+	struct coro *co = loop->current;
+	struct epoll_event ev = {.data.ptr = co};
+	uint64_t deadline_ms = timer_now_ms() + timeout_ms;
+	int rc;
+
+	do // until an fd is ready, an event that raced with poll may find it was not
+	{
+		for (int i = 0; i < nfds; i++)
+		{
+			ev.events = (fds[i].events & POLLIN ? EPOLLIN : 0) | (fds[i].events & POLLOUT ? EPOLLOUT : 0) | EPOLLONESHOT | EPOLLRDHUP;
+			if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fds[i].fd, &ev) < 0)
+			{
+				if (errno != ENOENT || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) < 0)
+					unix_error("coro_poll: epoll_ctl error");
+			}
+		}
+		co->timed_out = false;
+		if (timeout_ms >= 0)
+		{
+			co->wait_fd = fds[0].fd;
+			timer_add(&loop->timers, &co->timer, deadline_ms);
+		}
+		if (swapcontext(&co->ctx, &loop->sched) < 0)
+			unix_error("coro_poll: swapcontext error");
+		for (int i = 0; i < nfds; i++) // the others must not resume it while it waits for something else
+			epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+		if (co->timed_out)
+			return 0;
+		while ((rc = poll(fds, nfds, 0)) < 0 && errno == EINTR)
+			;
+	} while (rc == 0);
+	return rc;
+}
+
+/**
+ * @brief switch from the running coroutine back to the loop until w is answered, the dns_parkfn of the engine
+ *
+ * @param w waiter of the running coroutine, handed back on the dns queue of the loop
+ */
+static void coro_dns_park(struct dns_waiter *w)
+{
+	struct coro_loop *loop = t_loop;
+	struct coro *co = loop->current;
+
+	w->data = co;
+	if (swapcontext(&co->ctx, &loop->sched) < 0)
+		unix_error("coro_dns_park: swapcontext error");
+}
+
+static void coro_main(void)
+{
+	struct coro *co = t_loop->current;
+
+	serve(co->fd);
+	Close(co->fd);
+	admission_release();
+	co->done = true; // returning continues at uc_link, the loop
+}
+
+/**
+ * @brief create a coroutine serving fd, reusing a stack of loop if one is free
+ *
+ * @param loop event loop
+ * @param fd client fd
+ * @return struct coro* - coroutine, not started yet
+ */
+static struct coro *coro_new(struct coro_loop *loop, int fd)
+{
+	struct coro *co;
+	char *map;
+
+	if ((co = loop->free) != NULL)
+	{
+		loop->free = co->next;
+		loop->nfree--;
+	}
+	else
+	{
+		co = Malloc(sizeof(*co));
+		map = Mmap(NULL, guard_size + CORO_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (mprotect(map, guard_size, PROT_NONE) < 0) // overflowing the stack faults instead of corrupting the heap
+			unix_error("coro_new: mprotect error");
+		co->stack = map + guard_size;
+		STAT_ADD(loop->stats.stacks, 1);
+	}
+	co->fd = fd;
+	co->done = false;
+	timer_init(&co->timer);
+	if (getcontext(&co->ctx) < 0)
+		unix_error("coro_new: getcontext error");
+	co->ctx.uc_stack.ss_sp = co->stack;
+	co->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+	co->ctx.uc_link = &loop->sched;
+	makecontext(&co->ctx, coro_main, 0);
+	return co;
+}
+
+/**
+ * @brief release a finished coroutine, its stack is kept if fewer than CORO_STACK_CACHE are free
+ *
+ * @param loop event loop
+ * @param co coroutine
+ */
+static void coro_free(struct coro_loop *loop, struct coro *co)
+{
+	if (loop->nfree < CORO_STACK_CACHE)
+	{
+		co->next = loop->free;
+		loop->free = co;
+		loop->nfree++;
+		return;
+	}
+	Munmap(co->stack - guard_size, guard_size + CORO_STACK_SIZE);
+	Free(co);
+	STAT_ADD(loop->stats.stacks, -1);
+}
+
+/**
+ * @brief run co until it waits for an fd or finishes
+ *
+ * @param loop event loop
+ * @param co coroutine
+ */
+static void coro_resume(struct coro_loop *loop, struct coro *co)
+{
+	timer_del(&loop->timers, &co->timer); // woken before its deadline
+	co->batch = loop->batch;
+	loop->current = co;
+	STAT_ADD(loop->stats.resumes, 1);
+	if (swapcontext(&loop->sched, &co->ctx) < 0)
+		unix_error("coro_resume: swapcontext error");
+	loop->current = NULL;
+	if (co->done) // events of the batch may still point to it
+	{
+		STAT_ADD(loop->stats.live, -1);
+		co->next = loop->dead;
+		loop->dead = co;
+	}
+}
+
+/**
+ * @brief free the coroutines that finished in the batch just drained
+ *
+ * @param loop event loop
+ */
+static void coro_reap(struct coro_loop *loop)
+{
+	struct coro *co;
+
+	while ((co = loop->dead) != NULL)
+	{
+		loop->dead = co->next;
+		coro_free(loop, co);
+	}
+}
+
+static void coro_accept(struct coro_loop *loop)
+{
+	unsigned long live;
+	int connfd;
+
+	while ((connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		if (!admission_accept())
+		{
+			admission_reject(connfd);
+			close(connfd);
+			continue;
+		}
+		STAT_ADD(loop->stats.accepted, 1);
+		STAT_ADD(loop->stats.live, 1);
+		live = atomic_load_explicit(&loop->stats.live, memory_order_relaxed);
+		if (live > atomic_load_explicit(&loop->stats.live_max, memory_order_relaxed))
+			atomic_store_explicit(&loop->stats.live_max, live, memory_order_relaxed);
+		coro_resume(loop, coro_new(loop, connfd));
+	}
+}
+
+/**
+ * @brief resume the coroutines whose deadline has passed, and return how long until the next one
+ *
+ * @param loop event loop
+ * @return int - epoll_wait timeout in ms, -1 if no coroutine waits with a timeout
+ */
+static int coro_expire(struct coro_loop *loop)
+{
+	struct timer *t;
+	struct coro *co;
+	uint64_t now = timer_now_ms();
+
+	while ((t = timer_expired(&loop->timers, now)) != NULL)
+	{
+		co = timer_entry(t, struct coro, timer);
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, co->wait_fd, NULL); // its event must not resume it later
+		co->timed_out = true;
+		STAT_ADD(loop->stats.timeouts, 1);
+		coro_resume(loop, co);
+	}
+	return timer_wheel_timeout(&loop->timers, now);
+}
+
+static void coro_dns_resume(struct coro_loop *loop)
+{
+	struct dns_waiter *w, *next;
+
+	for (w = dns_queue_take(&loop->dns); w; w = next)
+	{
+		next = w->next; // w lives on the stack of the coroutine
+		coro_resume(loop, w->data);
+	}
+}
+
+static void *coro_loop_run(void *arg)
+{
+	struct coro_loop *loop = arg;
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	struct coro *co;
+	int n, timeout = -1;
+
+	t_loop = loop;
+	engine_loop_setup(loop->cfg, loop->index);
+	rio_setwait(coro_wait);
+	rio_setpoll(coro_poll);
+	dns_setpark(coro_dns_park, &loop->dns);
+	while (1)
+	{
+		if ((n = epoll_wait(loop->epfd, events, EPOLL_MAX_EVENTS, timeout)) < 0)
+		{
+			if (errno != EINTR)
+				unix_error("coro_loop_run: epoll_wait error");
+			n = 0;
+		}
+		loop->batch++;
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == NULL)
+				coro_accept(loop);
+			else if (events[i].data.ptr == &loop->dns)
+				coro_dns_resume(loop);
+			else if ((co = events[i].data.ptr)->batch != loop->batch) // otherwise left over from the wait it ran after
+				coro_resume(loop, co);
+		}
+		timeout = coro_expire(loop);
+		coro_reap(loop);
+	}
+	return NULL;
+}
+
+/**
+ * @brief serve connections with cfg->nloops coroutine loops, never returns
+ *
+ * @param cfg engine configuration, listen sockets are made non-blocking
+ */
+void coro_engine_run(const struct engine_config *cfg)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL}, dns_ev = {.events = EPOLLIN};
+	pthread_t tid;
+
+	if (!cfg->per_core)
+		ev.events |= EPOLLEXCLUSIVE; // every loop accepts from the shared socket, one is woken per connection
+	guard_size = sysconf(_SC_PAGESIZE);
+	loops = Calloc(cfg->nloops, sizeof(*loops));
+	for (int i = 0; i < cfg->nloops; i++)
+	{
+		loops[i].cfg = cfg;
+		loops[i].index = i;
+		loops[i].listenfd = engine_listenfd(cfg, i);
+		timer_wheel_init(&loops[i].timers, timer_now_ms());
+		fcntl(loops[i].listenfd, F_SETFL, fcntl(loops[i].listenfd, F_GETFL) | O_NONBLOCK);
+		if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			unix_error("coro_engine_run: epoll_create1 error");
+		if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listenfd, &ev) < 0)
+			unix_error("coro_engine_run: epoll_ctl error");
+		dns_queue_init(&loops[i].dns);
+		dns_ev.data.ptr = &loops[i].dns;
+		if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].dns.efd, &dns_ev) < 0)
+			unix_error("coro_engine_run: epoll_ctl error");
+	}
+	nloops = cfg->nloops;
+	for (int i = 1; i < cfg->nloops; i++)
+		Pthread_create(&tid, NULL, coro_loop_run, &loops[i]);
+	coro_loop_run(&loops[0]);
+}
+
+/**
+ * @brief print counters of all coroutine loops
+ *
+ * @param fp output stream
+ */
+void coro_print_stats(FILE *fp)
+{
+	unsigned long accepted = 0, resumes = 0, live = 0, live_max = 0, stacks = 0, timeouts = 0;
+
+	for (int i = 0; i < nloops; i++)
+	{
+		accepted += atomic_load_explicit(&loops[i].stats.accepted, memory_order_relaxed);
+		resumes += atomic_load_explicit(&loops[i].stats.resumes, memory_order_relaxed);
+		live += atomic_load_explicit(&loops[i].stats.live, memory_order_relaxed);
+		live_max += atomic_load_explicit(&loops[i].stats.live_max, memory_order_relaxed);
+		stacks += atomic_load_explicit(&loops[i].stats.stacks, memory_order_relaxed);
+		timeouts += atomic_load_explicit(&loops[i].stats.timeouts, memory_order_relaxed);
+	}
+	fprintf(fp, "coro: %d loops, accepted %lu, live %lu (max %lu), resumes %lu\n", nloops, accepted, live, live_max, resumes);
+	fprintf(fp, "coro: %lu stacks of %d KB mapped, %lu waits timed out\n", stacks, CORO_STACK_SIZE / 1024, timeouts);
+}
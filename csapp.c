@@ -22,6 +22,7 @@
  *   - rio_readnb: removed redundant EINTR check
  */
 /* $begin csapp.c */
+#define _GNU_SOURCE /* splice */
 #include "csapp.h"
 
 /************************** 
@@ -42,7 +43,7 @@ void posix_error(int code, char *msg) /* Posix-style error */
     exit(0);
 }
 
-void gai_error(int code, char *msg) /* Getaddrinfo-style error */
+void getaddrinfo_error(int code, char *msg) /* Getaddrinfo-style error */
 {
     fprintf(stderr, "%s: %s\n", msg, gai_strerror(code));
     exit(0);
@@ -605,7 +606,7 @@ void Getaddrinfo(const char *node, const char *service,
     int rc;
 
     if ((rc = getaddrinfo(node, service, hints, res)) != 0) 
-        gai_error(rc, "Getaddrinfo error");
+        getaddrinfo_error(rc, "Getaddrinfo error");
 }
 /* $end getaddrinfo */
 
@@ -616,7 +617,7 @@ void Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host,
 
     if ((rc = getnameinfo(sa, salen, host, hostlen, serv, 
                           servlen, flags)) != 0) 
-        gai_error(rc, "Getnameinfo error");
+        getaddrinfo_error(rc, "Getnameinfo error");
 }
 
 void Freeaddrinfo(struct addrinfo *res)
@@ -742,6 +743,158 @@ void V(sem_t *sem)
  * The Rio package - Robust I/O functions
  ****************************************/
 
+/*
+ * rio_wait - When set, called by the rio functions and open_clientfd of
+ *    this thread instead of failing with EAGAIN on a non-blocking
+ *    descriptor. It returns 0 once fd may be ready for reading (writing
+ *    == 0) or writing, e.g. after switching to other coroutines, or -1
+ *    if timeout_ms (< 0 for none) passed first.
+ */
+static __thread rio_waitfn *rio_wait;
+
+/*
+ * rio_pollfn - When set, called by rio_poll of this thread instead of
+ *    poll(), to wait for several descriptors the same way.
+ */
+static __thread rio_pollfn *rio_pollhook;
+
+__thread unsigned long rio_nwrites;
+
+void rio_setwait(rio_waitfn *wait)
+{
+    rio_wait = wait;
+}
+
+void rio_setpoll(rio_pollfn *poll)
+{
+    rio_pollhook = poll;
+}
+
+rio_waitfn *rio_getwait(void)
+{
+    return rio_wait;
+}
+
+/*
+ * rio_poll - poll() through rio_pollfn if one is set, restarted when
+ *    interrupted. Returns the number of ready descriptors with their
+ *    revents set, 0 on timeout and -1 with errno set on error.
+ */
+int rio_poll(struct pollfd *fds, int nfds, int timeout_ms)
+{
+    int rc;
+
+    if (rio_pollhook)
+	return rio_pollhook(fds, nfds, timeout_ms);
+    while ((rc = poll(fds, nfds, timeout_ms)) < 0)
+	if (errno != EINTR)
+	    return -1;
+    return rc;
+}
+
+/*
+ * rio_now - CLOCK_MONOTONIC ms
+ */
+static uint64_t rio_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * rio_remaining - Milliseconds left until deadline (CLOCK_MONOTONIC ms),
+ *    0 once it passed
+ */
+static int rio_remaining(uint64_t deadline)
+{
+    uint64_t now = rio_now();
+
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+/*
+ * rio_waitfd - Wait until fd is ready for reading (writing == 0) or
+ *    writing, through rio_wait if one is set, but not past deadline
+ *    (CLOCK_MONOTONIC ms, 0 for none). Returns 1 if it may be ready, 0
+ *    with errno ETIMEDOUT once the deadline passed, or set by poll().
+ */
+static int rio_waitfd(int fd, int writing, uint64_t deadline)
+{
+    struct pollfd pfd = {.fd = fd, .events = writing ? POLLOUT : POLLIN};
+    int timeout_ms = -1, rc;
+
+    if (deadline && (timeout_ms = rio_remaining(deadline)) == 0)
+	rc = 0;
+    else if (rio_wait)
+	rc = rio_wait(fd, writing, timeout_ms) == 0;
+    else
+	while ((rc = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+	    ;
+    if (rc == 0)
+	errno = ETIMEDOUT;
+    return rc > 0;
+}
+
+/*
+ * rio_blocked - Wait for fd through rio_wait, or with poll() when there
+ *    is a deadline, if the last call only failed because fd would block.
+ *    Returns 1 if the call should be retried.
+ */
+static int rio_blocked(int fd, int writing, uint64_t deadline)
+{
+    if ((!rio_wait && !deadline) || (errno != EAGAIN && errno != EWOULDBLOCK))
+	return 0;
+    return rio_waitfd(fd, writing, deadline);
+}
+
+/*
+ * rio_readdeadline - Deadline of a wait for rp to become readable:
+ *    rio_deadline, or rio_idle_ms from now if that comes first
+ */
+static uint64_t rio_readdeadline(rio_t *rp)
+{
+    uint64_t idle;
+
+    if (rp->rio_idle_ms <= 0)
+	return rp->rio_deadline;
+    idle = rio_now() + rp->rio_idle_ms;
+    return rp->rio_deadline && rp->rio_deadline < idle ? rp->rio_deadline : idle;
+}
+
+/*
+ * rio_readfd - read() of rp. When rp has a deadline or an idle timeout
+ *    and no rio_wait is set, the descriptor (then a socket) is read
+ *    without blocking, so rio_blocked can wait for it with a timeout.
+ */
+static ssize_t rio_readfd(rio_t *rp, void *buf, size_t n)
+{
+    if ((rp->rio_deadline || rp->rio_idle_ms > 0) && !rio_wait)
+	return recv(rp->rio_fd, buf, n, MSG_DONTWAIT);
+    return read(rp->rio_fd, buf, n);
+}
+
+/*
+ * rio_waitreadable - Wait up to timeout_ms (< 0 for ever) until a read
+ *    from rp would not block. Returns 1 if it would not, 0 on timeout
+ *    and -1 with errno set on error.
+ */
+int rio_waitreadable(rio_t *rp, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = rp->rio_fd, .events = POLLIN};
+    int rc;
+
+    if (rp->rio_cnt > 0 || rp->rio_fd < 0) /* Buffered bytes or memory */
+	return 1;
+    if (rio_wait)
+	return rio_wait(rp->rio_fd, 0, timeout_ms) == 0;
+    while ((rc = poll(&pfd, 1, timeout_ms)) < 0)
+	if (errno != EINTR)
+	    return -1;
+    return rc > 0;
+}
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -754,7 +907,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 
     while (nleft > 0) {
 	if ((nread = read(fd, bufp, nleft)) < 0) {
-	    if (errno == EINTR) /* Interrupted by sig handler return */
+	    if (errno == EINTR || rio_blocked(fd, 0, 0)) /* Interrupted or waited */
 		nread = 0;      /* and call read() again */
 	    else
 		return -1;      /* errno set by read() */ 
@@ -779,8 +932,9 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
+	rio_nwrites++;
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-	    if (errno == EINTR)  /* Interrupted by sig handler return */
+	    if (errno == EINTR || rio_blocked(fd, 1, 0)) /* Interrupted or waited */
 		nwritten = 0;    /* and call write() again */
 	    else
 		return -1;       /* errno set by write() */
@@ -792,6 +946,38 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * rio_writev - Robustly write all iovcnt buffers of iov with as few
+ *    writev() calls as possible. iov is consumed on partial writes.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+	rio_nwrites++;
+	if ((nwritten = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt)) <= 0) {
+	    if (errno == EINTR || rio_blocked(fd, 1, 0)) /* Interrupted or waited */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	total += nwritten;
+	for (; iovcnt > 0 && nwritten >= iov->iov_len; iov++, iovcnt--)
+	    nwritten -= iov->iov_len;
+	if (iovcnt > 0) {        /* Resume inside a partly written buffer */
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -807,10 +993,11 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	if (rp->rio_fd < 0)         /* Memory-backed buf is never refilled */
+	    return 0;
+	rp->rio_cnt = rio_readfd(rp, rp->rio_buf, sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
+	    if (errno != EINTR && !rio_blocked(rp->rio_fd, 0, rio_readdeadline(rp))) /* Interrupted or waited */
 		return -1;
 	}
 	else if (rp->rio_cnt == 0)  /* EOF */
@@ -839,9 +1026,134 @@ void rio_readinitb(rio_t *rp, int fd)
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_deadline = 0;
+    rp->rio_idle_ms = 0;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_readinitmem - Make rp read from a copy of buf (at most RIO_BUFSIZE
+ *    bytes) instead of a descriptor; reads past the end return EOF
+ */
+void rio_readinitmem(rio_t *rp, const void *buf, size_t n)
+{
+    if (n > sizeof(rp->rio_buf))
+	n = sizeof(rp->rio_buf);
+    memcpy(rp->rio_buf, buf, n);
+    rp->rio_fd = -1;
+    rp->rio_cnt = n;
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_deadline = 0;
+    rp->rio_idle_ms = 0;
+}
+
+/*
+ * rio_fill - Move the unread bytes of rp to the front of its buffer and
+ *    append what the descriptor has after them, so a record that straddles
+ *    reads can be parsed in place. Returns the number of bytes added, 0 on
+ *    EOF, -1 on error or if the buffer is already full (errno ENOBUFS)
+ */
+ssize_t rio_fill(rio_t *rp)
+{
+    ssize_t n;
+
+    if (rp->rio_cnt == sizeof(rp->rio_buf)) {
+	errno = ENOBUFS;
+	return -1;
+    }
+    if (rp->rio_bufptr != rp->rio_buf) {
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+    while ((n = rio_readfd(rp, rp->rio_buf + rp->rio_cnt, 
+			   sizeof(rp->rio_buf) - rp->rio_cnt)) < 0) {
+	if (errno != EINTR && !rio_blocked(rp->rio_fd, 0, rio_readdeadline(rp))) /* Interrupted or waited */
+	    return -1;
+    }
+    rp->rio_cnt += n;
+    return n;
+}
+
+/*
+ * rio_copyn - Move n bytes from rp to fd through a bounce buffer.
+ *    Returns like rio_splicen.
+ */
+static ssize_t rio_copyn(rio_t *rp, int fd, size_t n)
+{
+    char buf[RIO_BUFSIZE];
+    size_t nleft = n;
+    ssize_t nread;
+
+    while (nleft > 0) {
+	if ((nread = rio_readnb(rp, buf, nleft < sizeof(buf) ? nleft : sizeof(buf))) < 0)
+	    return -1;
+	if (nread == 0)
+	    break;              /* EOF */
+	if (rio_writen(fd, buf, nread) != nread)
+	    return -2;
+	nleft -= nread;
+    }
+    return n - nleft;
+}
+
+/*
+ * rio_splicen - Move n bytes from rp to fd without copying them through
+ *    user space where possible: the buffered bytes are written out, the
+ *    rest goes descriptor to descriptor through a pipe with splice() once
+ *    it is at least RIO_SPLICE_MIN bytes. Returns the number of bytes
+ *    moved, short only on EOF of rp, -1 if reading rp failed and -2 if
+ *    writing fd failed (errno set).
+ */
+ssize_t rio_splicen(rio_t *rp, int fd, size_t n)
+{
+    size_t nleft = n, m;
+    ssize_t nin, nout, rc = 0;
+    int p[2];
+
+    if (rp->rio_cnt > 0) {
+	m = (size_t)rp->rio_cnt < nleft ? (size_t)rp->rio_cnt : nleft;
+	if (rio_writen(fd, rp->rio_bufptr, m) != m)
+	    return -2;
+	rp->rio_bufptr += m;
+	rp->rio_cnt -= m;
+	nleft -= m;
+    }
+    if (nleft < RIO_SPLICE_MIN || rp->rio_fd < 0 || pipe2(p, O_CLOEXEC) < 0) {
+	if ((nin = rio_copyn(rp, fd, nleft)) < 0)
+	    return nin;
+	return n - nleft + nin;
+    }
+    while (nleft > 0) {
+	if ((rp->rio_deadline || rp->rio_idle_ms > 0) && !rio_wait && !rio_waitfd(rp->rio_fd, 0, rio_readdeadline(rp))) {
+	    rc = -1;            /* splice() of a socket blocks whatever its flags */
+	    break;
+	}
+	if ((nin = splice(rp->rio_fd, NULL, p[1], NULL, nleft, SPLICE_F_MOVE)) < 0) {
+	    if (errno == EINTR || rio_blocked(rp->rio_fd, 0, rio_readdeadline(rp))) /* Interrupted or waited */
+		continue;
+	    rc = -1;
+	    break;
+	}
+	if (nin == 0)
+	    break;              /* EOF */
+	for (m = nin; m > 0; m -= nout) { /* Drain the pipe, it never fills up */
+	    if ((nout = splice(p[0], NULL, fd, NULL, m, SPLICE_F_MOVE)) <= 0) {
+		if (nout < 0 && (errno == EINTR || rio_blocked(fd, 1, 0)))
+		    nout = 0;
+		else {
+		    rc = -2;
+		    goto done;
+		}
+	    }
+	}
+	nleft -= nin;
+    }
+ done:
+    close(p[0]);
+    close(p[1]);
+    return rc < 0 ? rc : (ssize_t)(n - nleft);
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -870,26 +1182,33 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (!nl && n + 1 < maxlen) { 
+	if (rp->rio_cnt <= 0) {	/* Refill through rio_read, then unread its byte */
+	    if ((rc = rio_read(rp, bufp, 1)) < 0)
+		return -1;	  /* Error */
+	    if (rc == 0)
+		break;    /* EOF */
+	    rp->rio_bufptr--;
+	    rp->rio_cnt++;
+	}
+	/* Copy up to the newline in one go rather than a byte at a time */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
@@ -946,10 +1265,33 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
+/*
+ * connect_wait - connect(), waiting through rio_wait for a non-blocking
+ *     connect to finish
+ */
+static int connect_wait(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int err;
+    socklen_t len = sizeof(err);
+
+    if (connect(fd, addr, addrlen) == 0)
+	return 0;
+    if (errno != EINPROGRESS || !rio_wait)
+	return -1;
+    rio_wait(fd, 1, -1);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	return -1;
+    if (err) {
+	errno = err;
+	return -1;
+    }
+    return 0;
+}
+
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
     int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    struct addrinfo hints, *listp;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -960,28 +1302,38 @@ int open_clientfd(char *hostname, char *port) {
         fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
         return -2;
     }
-  
+    clientfd = open_clientfd_addrinfo(listp);
+
+    /* Clean up */
+    freeaddrinfo(listp);
+    return clientfd;
+}
+
+/*
+ * open_clientfd_addrinfo - Connect to the first address of listp that
+ *     accepts, for callers that resolved the server themselves.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int open_clientfd_addrinfo(const struct addrinfo *listp) {
+    const struct addrinfo *p;
+    int clientfd;
+
     /* Walk the list for one that we can successfully connect to */
     for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
+        /* Create a socket descriptor, non-blocking if we may wait for it */
+        if ((clientfd = socket(p->ai_family, p->ai_socktype | (rio_wait ? SOCK_NONBLOCK : 0), p->ai_protocol)) < 0) 
             continue; /* Socket failed, try the next */
 
         /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
+        if (connect_wait(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
+            return clientfd; /* Success */
         if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
             fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
             return -1;
         } 
     } 
-
-    /* Clean up */
-    freeaddrinfo(listp);
-    if (!p) /* All connects failed */
-        return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    return -1; /* All connects failed */
 }
 /* $end open_clientfd */
 
@@ -994,7 +1346,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1018,6 +1370,11 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1041,8 +1398,23 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port)
+{
+    return open_listenfd_opt(port, 0);
+}
 /* $end open_listenfd */
 
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but several sockets may
+ *     listen on the same port and the kernel balances connections
+ *     between them.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
  ****************************************************/
@@ -1064,6 +1436,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -28,6 +28,9 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 /* $begin createmasks */
@@ -43,10 +46,13 @@ typedef struct sockaddr SA;
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
 #define RIO_BUFSIZE 8192
+#define RIO_SPLICE_MIN 16384 /* rio_splicen copies less than this */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
+    uint64_t rio_deadline;     /* CLOCK_MONOTONIC ms reads fail at, 0 for none */
+    int rio_idle_ms;           /* Reads also fail after waiting this long for data, 0 for none */
     char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
 } rio_t;
 /* $end rio_t */
@@ -64,7 +70,7 @@ extern char **environ; /* Defined by libc */
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
-void gai_error(int code, char *msg);
+void getaddrinfo_error(int code, char *msg);
 void app_error(char *msg);
 
 /* Process control wrappers */
@@ -173,11 +179,23 @@ void P(sem_t *sem);
 void V(sem_t *sem);
 
 /* Rio (Robust I/O) package */
+typedef int rio_waitfn(int fd, int writing, int timeout_ms);
+typedef int rio_pollfn(struct pollfd *fds, int nfds, int timeout_ms);
+void rio_setwait(rio_waitfn *wait);
+void rio_setpoll(rio_pollfn *poll);
+rio_waitfn *rio_getwait(void);
+int rio_poll(struct pollfd *fds, int nfds, int timeout_ms);
+extern __thread unsigned long rio_nwrites; /* write() and writev() calls of rio_writen and rio_writev */
+int rio_waitreadable(rio_t *rp, int timeout_ms);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitmem(rio_t *rp, const void *buf, size_t n);
+ssize_t rio_fill(rio_t *rp);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_splicen(rio_t *rp, int fd, size_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -188,11 +206,14 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_addrinfo(const struct addrinfo *listp);
 int open_listenfd(char *port);
+int open_listenfd_reuseport(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_reuseport(char *port);
 
 
 #endif /* __CSAPP_H__ */
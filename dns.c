@@ -0,0 +1,499 @@
+#include "dns.h"
+#include "timer.h"
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+struct dns_answer
+{
+	atomic_int refs;		// one for the cache entry, one per list handed out
+	int error;				// of getaddrinfo, 0 if list holds the addresses
+	struct addrinfo list[]; // then the addresses they point to
+};
+struct dns_entry
+{
+	struct dns_entry *next;
+	char *host, *port; // one allocation
+	uint64_t expires;
+	struct dns_answer *answer;	// NULL until a lookup succeeded or failed for the name
+	bool resolving;				// a lookup is queued or runs for it, the entry is not freed meanwhile
+	struct dns_waiter *waiters; // answered when the lookup ends
+	struct dns_entry *job_next; // in the resolver queue
+};
+struct dns_shard
+{
+	sem_t sem;
+	int n;
+	struct dns_entry *buckets[DNS_BUCKETS];
+};
+struct dns_jobs
+{
+	sem_t mutex, items;
+	struct dns_entry *head, *tail;
+}; // entries to resolve, first in first out
+struct dns_stats
+{
+	atomic_long entries, pending; // pending: lookups queued or running
+	atomic_ulong hits, negative_hits, misses, joined, refreshes, errors, evictions;
+};
+
+static struct dns_config config;
+static struct dns_shard shards[DNS_SHARDS];
+static struct dns_jobs jobs;
+static struct dns_stats stats;
+static __thread dns_parkfn *t_park;
+static __thread struct dns_queue *t_queue;
+
+static void *dns_resolver(void *arg);
+
+/**
+ * @brief apply the configuration and start the resolver threads
+ *
+ * @param cfg cache configuration, copied; ttl_ms 0 disables the cache
+ */
+void dns_init(const struct dns_config *cfg)
+{
+	pthread_t tid;
+
+	config = *cfg;
+	if (config.refresh_ahead_ms >= config.ttl_ms) // at least some hits are plain ones
+		config.refresh_ahead_ms = config.ttl_ms / 2;
+	if (config.resolvers <= 0)
+		config.resolvers = DNS_DEFAULT_RESOLVERS;
+	for (int i = 0; i < DNS_SHARDS; i++)
+		Sem_init(&shards[i].sem, 0, 1);
+	Sem_init(&jobs.mutex, 0, 1);
+	Sem_init(&jobs.items, 0, 0);
+	for (int i = 0; i < config.resolvers; i++)
+		Pthread_create(&tid, NULL, dns_resolver, NULL);
+}
+
+/**
+ * @brief prepare the completion queue of an event loop
+ *
+ * @param q queue
+ */
+void dns_queue_init(struct dns_queue *q)
+{
+	Sem_init(&q->mutex, 0, 1);
+	q->head = q->tail = NULL;
+	if ((q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		unix_error("dns_queue_init: eventfd error");
+}
+
+/**
+ * @brief take every answered waiter of q, once its eventfd was reported readable
+ *
+ * @param q queue
+ * @return struct dns_waiter* - list linked through next, in the order they were answered
+ */
+struct dns_waiter *dns_queue_take(struct dns_queue *q)
+{
+	struct dns_waiter *w;
+	eventfd_t n;
+
+	eventfd_read(q->efd, &n); // before taking, a waiter queued after that makes it readable again
+	P(&q->mutex);
+	w = q->head;
+	q->head = q->tail = NULL;
+	V(&q->mutex);
+	return w;
+}
+
+/**
+ * @brief have dns_getaddrinfo on the calling thread wait through park, with the answer handed back on q
+ *
+ * @param park switches away from the caller of dns_getaddrinfo until its waiter comes out of q, NULL to sleep instead
+ * @param q completion queue of the calling loop
+ */
+void dns_setpark(dns_parkfn *park, struct dns_queue *q)
+{
+	t_park = park;
+	t_queue = q;
+}
+
+/**
+ * @brief resolve host:port into an answer holding one reference
+ *
+ * @param host server host
+ * @param port numeric server port
+ * @return struct dns_answer* - with error set if getaddrinfo failed
+ */
+static struct dns_answer *dns_resolve(const char *host, const char *port)
+{
+	struct addrinfo hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG}, *listp, *p;
+	struct dns_answer *a;
+	size_t n = 0, size = 0;
+	char *addr;
+	int rc, i;
+
+	if ((rc = getaddrinfo(host, port, &hints, &listp)) != 0)
+	{
+		atomic_fetch_add_explicit(&stats.errors, 1, memory_order_relaxed);
+		a = Malloc(sizeof(*a));
+		atomic_init(&a->refs, 1);
+		a->error = rc;
+		return a;
+	}
+	for (p = listp; p; p = p->ai_next)
+	{
+		n++;
+		size += (p->ai_addrlen + 7) & ~7;
+	}
+	a = Malloc(sizeof(*a) + n * sizeof(a->list[0]) + size);
+	atomic_init(&a->refs, 1);
+	a->error = 0;
+	addr = (char *)&a->list[n];
+	for (p = listp, i = 0; p; p = p->ai_next, i++) // one block, shared as it is
+	{
+		a->list[i] = *p;
+		a->list[i].ai_canonname = NULL;
+		a->list[i].ai_addr = memcpy(addr, p->ai_addr, p->ai_addrlen);
+		a->list[i].ai_next = p->ai_next ? &a->list[i + 1] : NULL;
+		addr += (p->ai_addrlen + 7) & ~7;
+	}
+	freeaddrinfo(listp);
+	return a;
+}
+
+static void dns_answer_put(struct dns_answer *a)
+{
+	if (atomic_fetch_sub(&a->refs, 1) == 1)
+		free(a);
+}
+
+/**
+ * @brief hash host:port to its shard and bucket
+ *
+ * @param host server host
+ * @param port server port
+ * @param bucket set to the bucket of host:port in the returned shard
+ * @return struct dns_shard*
+ */
+static struct dns_shard *dns_shard(const char *host, const char *port, struct dns_entry ***bucket)
+{
+	unsigned long hash = 2166136261UL; // FNV-1a
+	struct dns_shard *shard;
+
+	for (const char *s = host; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619UL;
+	hash = (hash ^ ':') * 16777619UL;
+	for (const char *s = port; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619UL;
+	shard = &shards[hash % DNS_SHARDS];
+	*bucket = &shard->buckets[hash / DNS_SHARDS % DNS_BUCKETS];
+	return shard;
+}
+
+static struct dns_entry *dns_find(struct dns_entry *bucket, const char *host, const char *port)
+{
+	for (; bucket; bucket = bucket->next)
+	{
+		if (strcmp(bucket->host, host) == 0 && strcmp(bucket->port, port) == 0)
+			return bucket;
+	}
+	return NULL;
+}
+
+static void dns_entry_free(struct dns_entry *e)
+{
+	if (e->answer)
+		dns_answer_put(e->answer);
+	free(e->host);
+	free(e);
+	atomic_fetch_sub(&stats.entries, 1);
+}
+
+/**
+ * @brief drop the expired entries of a full shard, or else the one that expires first
+ *
+ * Entries being resolved stay, their lookup and its waiters hold on to them.
+ *
+ * @param shard locked shard
+ * @param now current time
+ */
+static void dns_make_room(struct dns_shard *shard, uint64_t now)
+{
+	struct dns_entry **link, **first = NULL, *e;
+
+	for (int i = 0; i < DNS_BUCKETS; i++)
+	{
+		for (link = &shard->buckets[i]; (e = *link) != NULL;)
+		{
+			if (e->resolving)
+			{
+				link = &e->next;
+				continue;
+			}
+			if (e->expires <= now)
+			{
+				*link = e->next;
+				dns_entry_free(e);
+				shard->n--;
+				continue;
+			}
+			if (first == NULL || e->expires < (*first)->expires)
+				first = link;
+			link = &e->next;
+		}
+	}
+	if (shard->n >= DNS_SHARD_ENTRIES && first)
+	{
+		e = *first;
+		*first = e->next;
+		dns_entry_free(e);
+		shard->n--;
+		atomic_fetch_add_explicit(&stats.evictions, 1, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief hand an answer to a waiter, which owns a reference to it from then on
+ *
+ * @param w waiter, not to be touched afterwards: its owner may be gone with it
+ * @param a answer, one reference of which goes to w
+ */
+static void dns_complete(struct dns_waiter *w, struct dns_answer *a)
+{
+	struct dns_queue *q = w->queue;
+
+	w->error = a->error;
+	w->res = a->error ? NULL : a->list;
+	if (a->error)
+		dns_answer_put(a);
+	if (q == NULL)
+	{
+		V(&w->done);
+		return;
+	}
+	w->next = NULL;
+	P(&q->mutex);
+	if (q->tail)
+		q->tail->next = w;
+	else
+		q->head = w;
+	q->tail = w;
+	V(&q->mutex);
+	eventfd_write(q->efd, 1);
+}
+
+/**
+ * @brief cache the answer of the lookup of e and hand it to the waiters of e
+ *
+ * A failed refresh leaves the answer in place until it expires, a name that
+ * resolved a moment ago is not turned into an error by one bad lookup.
+ *
+ * @param e entry being resolved
+ * @param a its answer, holding the reference of the lookup
+ */
+static void dns_finish(struct dns_entry *e, struct dns_answer *a)
+{
+	struct dns_entry **link;
+	struct dns_shard *shard = dns_shard(e->host, e->port, &link);
+	struct dns_waiter *w, *next;
+	uint64_t now = timer_now_ms();
+
+	P(&shard->sem);
+	w = e->waiters;
+	e->waiters = NULL;
+	e->resolving = false;
+	if (config.ttl_ms <= 0) // the entry only gathered the waiters of the lookup
+	{
+		while (*link != e)
+			link = &(*link)->next;
+		*link = e->next;
+		dns_entry_free(e);
+		shard->n--;
+	}
+	else if (a->error == EAI_SYSTEM || a->error == EAI_MEMORY) // about us, not the name
+		;
+	else if (!(a->error && e->answer && !e->answer->error && e->expires > now))
+	{
+		atomic_fetch_add(&a->refs, 1);
+		if (e->answer)
+			dns_answer_put(e->answer);
+		e->answer = a;
+		e->expires = now + (a->error ? config.negative_ttl_ms : config.ttl_ms);
+	}
+	V(&shard->sem);
+	for (; w; w = next)
+	{
+		next = w->next;
+		atomic_fetch_add(&a->refs, 1);
+		dns_complete(w, a);
+	}
+	dns_answer_put(a);
+}
+
+/**
+ * @brief queue the lookup of e for the resolver threads
+ *
+ * @param e entry with resolving set
+ */
+static void dns_submit(struct dns_entry *e)
+{
+	atomic_fetch_add(&stats.pending, 1);
+	e->job_next = NULL;
+	P(&jobs.mutex);
+	if (jobs.tail)
+		jobs.tail->job_next = e;
+	else
+		jobs.head = e;
+	jobs.tail = e;
+	V(&jobs.mutex);
+	V(&jobs.items);
+}
+
+/**
+ * @brief thread routine of a resolver, runs the queued lookups one at a time
+ *
+ * @param arg unused
+ * @return void* - never returns
+ */
+static void *dns_resolver(void *arg)
+{
+	struct dns_entry *e;
+
+	(void)arg;
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		P(&jobs.items);
+		P(&jobs.mutex);
+		e = jobs.head;
+		if ((jobs.head = e->job_next) == NULL)
+			jobs.tail = NULL;
+		V(&jobs.mutex);
+		dns_finish(e, dns_resolve(e->host, e->port)); // host and port do not change, and e stays while resolving
+		atomic_fetch_sub(&stats.pending, 1);
+	}
+	return NULL;
+}
+
+/**
+ * @brief look host:port up, answering w from the cache or else once the lookup in flight for the name ends
+ *
+ * A name being resolved already is not resolved again, w joins the waiters
+ * of that lookup. A hit in the refresh-ahead window queues a lookup of its
+ * own while w is answered with the cached addresses.
+ *
+ * @param host server host
+ * @param port numeric server port
+ * @param w waiter, its queue and done or data set by the caller
+ * @return bool - true if w was answered already, false if it will be through its queue or done
+ */
+bool dns_lookup(const char *host, const char *port, struct dns_waiter *w)
+{
+	struct dns_entry **bucket, *e;
+	struct dns_shard *shard = dns_shard(host, port, &bucket);
+	struct dns_answer *a = NULL;
+	uint64_t now = timer_now_ms();
+	bool submit = false;
+	size_t host_len;
+
+	P(&shard->sem);
+	if ((e = dns_find(*bucket, host, port)) != NULL && e->answer && e->expires > now)
+	{
+		a = e->answer;
+		atomic_fetch_add(&a->refs, 1);
+		if (!a->error && !e->resolving && e->expires - now <= (uint64_t)config.refresh_ahead_ms)
+			submit = e->resolving = true;
+	}
+	else if (e && e->resolving)
+	{
+		w->next = e->waiters;
+		e->waiters = w;
+		atomic_fetch_add_explicit(&stats.joined, 1, memory_order_relaxed);
+	}
+	else
+	{
+		if (e == NULL)
+		{
+			if (shard->n >= DNS_SHARD_ENTRIES)
+				dns_make_room(shard, now);
+			host_len = strlen(host);
+			e = Calloc(1, sizeof(*e));
+			e->host = Malloc(host_len + strlen(port) + 2);
+			e->port = strcpy(e->host + host_len + 1, port);
+			strcpy(e->host, host);
+			e->next = *bucket;
+			*bucket = e;
+			shard->n++;
+			atomic_fetch_add(&stats.entries, 1);
+		}
+		w->next = NULL;
+		e->waiters = w;
+		submit = e->resolving = true;
+		atomic_fetch_add_explicit(&stats.misses, 1, memory_order_relaxed);
+	}
+	V(&shard->sem);
+	if (submit) // e is kept while resolving
+		dns_submit(e);
+	if (a == NULL)
+		return false;
+	if (submit)
+		atomic_fetch_add_explicit(&stats.refreshes, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(a->error ? &stats.negative_hits : &stats.hits, 1, memory_order_relaxed);
+	w->error = a->error;
+	w->res = a->error ? NULL : a->list;
+	if (a->error)
+		dns_answer_put(a);
+	return true;
+}
+
+/**
+ * @brief getaddrinfo() for a TCP connection to host:port, answered from the cache when possible
+ *
+ * The caller sleeps while the name is resolved, or is parked if its thread
+ * set a park function with dns_setpark.
+ *
+ * @param host server host
+ * @param port numeric server port
+ * @param res set to the address list on success, given back with dns_freeaddrinfo
+ * @return int - 0 on success, else the getaddrinfo error
+ */
+int dns_getaddrinfo(const char *host, const char *port, struct addrinfo **res)
+{
+	struct dns_waiter w = {.queue = t_park ? t_queue : NULL};
+
+	if (w.queue == NULL)
+		Sem_init(&w.done, 0, 0);
+	if (!dns_lookup(host, port, &w))
+	{
+		if (w.queue)
+			t_park(&w);
+		else
+			P(&w.done);
+	}
+	if (w.error == 0)
+		*res = w.res;
+	return w.error;
+}
+
+/**
+ * @brief give back a list from dns_getaddrinfo
+ *
+ * @param res address list
+ */
+void dns_freeaddrinfo(struct addrinfo *res)
+{
+	dns_answer_put((struct dns_answer *)((char *)res - offsetof(struct dns_answer, list)));
+}
+
+/**
+ * @brief dump resolver cache counters
+ *
+ * @param fp output stream
+ */
+void dns_print_stats(FILE *fp)
+{
+	fprintf(fp, "dns: %d resolvers, %ld lookups queued or running, %lu joined one in flight\n",
+			config.resolvers, atomic_load(&stats.pending), atomic_load(&stats.joined));
+	if (config.ttl_ms <= 0)
+	{
+		fprintf(fp, "dns: cache off, %lu lookups, %lu failed\n", atomic_load(&stats.misses), atomic_load(&stats.errors));
+		return;
+	}
+	fprintf(fp, "dns: %ld names, hits %lu, negative hits %lu, misses %lu, refreshed ahead %lu, failed lookups %lu, evicted %lu\n",
+			atomic_load(&stats.entries), atomic_load(&stats.hits), atomic_load(&stats.negative_hits), atomic_load(&stats.misses),
+			atomic_load(&stats.refreshes), atomic_load(&stats.errors), atomic_load(&stats.evictions));
+}
@@ -0,0 +1,70 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+#include <stdbool.h>
+
+/*
+ * Cache of resolved server addresses, keyed by host:port, in front of
+ * getaddrinfo(). An answer is kept for the TTL, a failed lookup for the
+ * negative TTL. getaddrinfo() does not tell the TTL of the records, so both
+ * are fixed by configuration. A hit in the last refresh_ahead_ms of the TTL
+ * starts resolving the name again in the background, so names in steady use
+ * never expire under the requests.
+ *
+ * Answers are shared and reference counted: dns_getaddrinfo() hands out a
+ * list that stays valid, even if the entry is replaced, until the caller
+ * gives it back with dns_freeaddrinfo().
+ *
+ * getaddrinfo() itself only runs on a small pool of resolver threads, never
+ * on the thread asking. A name being resolved has one lookup in flight, the
+ * waiters for it queue on its cache entry and all get its answer. A waiter
+ * either sleeps on its done semaphore or, for an event loop, is handed back
+ * through the loop's dns_queue, whose eventfd the loop polls with its other
+ * fds. Coroutine loops park the coroutine calling dns_getaddrinfo() through
+ * dns_setpark() and resume it from their queue.
+ */
+
+#define DNS_DEFAULT_TTL 60			 // seconds an answer is used, 0 disables the cache
+#define DNS_DEFAULT_NEGATIVE_TTL 5	 // seconds a failed lookup is remembered
+#define DNS_DEFAULT_REFRESH_AHEAD 10 // seconds before expiry a hit resolves the name again
+#define DNS_DEFAULT_RESOLVERS 4		 // threads running getaddrinfo
+#define DNS_SHARDS 16
+#define DNS_BUCKETS 64
+#define DNS_SHARD_ENTRIES 256 // names a shard keeps, the one closest to expiry makes room
+
+struct dns_config
+{
+	int ttl_ms;
+	int negative_ttl_ms;
+	int refresh_ahead_ms;
+	int resolvers;
+};
+struct dns_queue;
+struct dns_waiter
+{
+	struct dns_waiter *next;
+	struct dns_queue *queue; // where the answer is handed back, NULL to post done instead
+	sem_t done;
+	void *data; // for the owner of queue
+	int error;	// 0 with res set, else the getaddrinfo error
+	struct addrinfo *res; // given back with dns_freeaddrinfo
+};
+struct dns_queue
+{
+	sem_t mutex;
+	struct dns_waiter *head, *tail; // answered waiters, in order
+	int efd;						// eventfd, readable while the queue is not empty
+};
+typedef void dns_parkfn(struct dns_waiter *w);
+
+void dns_init(const struct dns_config *);
+void dns_queue_init(struct dns_queue *);
+struct dns_waiter *dns_queue_take(struct dns_queue *);
+void dns_setpark(dns_parkfn *park, struct dns_queue *);
+bool dns_lookup(const char *host, const char *port, struct dns_waiter *w);
+int dns_getaddrinfo(const char *host, const char *port, struct addrinfo **res);
+void dns_freeaddrinfo(struct addrinfo *res);
+void dns_print_stats(FILE *);
+
+#endif /* __DNS_H__ */
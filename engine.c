@@ -0,0 +1,45 @@
+#define _GNU_SOURCE
+#include "conn.h"
+#include "engine.h"
+#include <sched.h>
+
+/**
+ * @brief prepare the calling thread to run event loop index
+ *
+ * @param cfg engine configuration
+ * @param index loop index
+ */
+void engine_loop_setup(const struct engine_config *cfg, int index)
+{
+	cpu_set_t allowed, mine;
+	int cpu, n;
+
+	if (cfg->pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0)
+	{
+		n = index % CPU_COUNT(&allowed);
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) // find the n-th allowed CPU
+		{
+			if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+				break;
+		}
+		CPU_ZERO(&mine);
+		CPU_SET(cpu, &mine);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine) != 0)
+			fprintf(stderr, "loop %d: cannot pin to CPU %d\n", index, cpu);
+	}
+	if (cfg->per_core)
+		cache_set_local(cache_new(false));
+	conn_stats_register();
+}
+
+/**
+ * @brief return the socket loop index accepts from
+ *
+ * @param cfg engine configuration
+ * @param index loop index
+ * @return int - listen fd
+ */
+int engine_listenfd(const struct engine_config *cfg, int index)
+{
+	return cfg->per_core ? cfg->listenfds[index] : cfg->listenfds[0];
+}
@@ -0,0 +1,42 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Event engines, alternatives to the thread pool running serve() */
+
+#define ENGINE_MAX_LOOPS 256
+
+#define EPOLL_MAX_EVENTS 256
+#define EPOLL_OP_BUDGET 32 // operations per wakeup before a connection yields to the others
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_SLOTS 512 // connections per loop whose buffers are registered with the ring
+#define URING_TICK_MAX_MS 1000	// wakeup period of a loop with deadlines when io_uring_enter takes no timeout
+
+#define CORO_STACK_SIZE (128 * 1024) // serve() keeps a batch of PIPELINE_MAX parsed requests and relay buffers
+#define CORO_STACK_CACHE 256		 // free stacks a loop keeps mapped for reuse
+
+/* increment a counter that only the calling loop writes, without a locked instruction */
+#define STAT_ADD(counter, n) atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+
+struct engine_config
+{
+	int nloops;
+	int *listenfds; // one SO_REUSEPORT socket per loop if per_core, else listenfds[0] is shared
+	bool per_core;	// loops share nothing: own listen socket, cache partition and counters
+	bool pin;		// pin loop i to the i-th CPU the process may run on
+};
+
+void engine_loop_setup(const struct engine_config *, int index);
+int engine_listenfd(const struct engine_config *, int index);
+
+void epoll_engine_run(const struct engine_config *);
+int uring_engine_run(const struct engine_config *);
+void uring_print_stats(FILE *);
+void coro_engine_run(const struct engine_config *);
+void coro_print_stats(FILE *);
+
+#endif /* __ENGINE_H__ */
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include "conn.h"
+#include "engine.h"
+#include "admission.h"
+#include <sys/epoll.h>
+
+/*
+ * Each loop owns an epoll instance and the connections it accepted. A
+ * connection waits on at most one fd at a time, armed with EPOLLONESHOT, so
+ * an event always belongs to a live connection and no locking is needed.
+ * Client deadlines are on a timer wheel per loop, which gives epoll_wait its
+ * timeout; a connection whose timer fires is driven like one with an event.
+ * Connections waiting for a server name come back through the dns queue of
+ * the loop, whose eventfd is in the epoll set.
+ */
+
+struct epoll_loop
+{
+	const struct engine_config *cfg;
+	int index, epfd, listenfd;
+	struct timer_wheel timers;
+	struct dns_queue dns; // answered lookups of connections in CONN_RESOLVE
+};
+
+/**
+ * @brief wait for fd to become ready for the pending operation of c
+ *
+ * @param loop event loop
+ * @param c connection
+ * @param fd fd the operation is blocked on
+ * @param events EPOLLIN or EPOLLOUT
+ */
+static void epoll_arm(struct epoll_loop *loop, struct conn *c, int fd, uint32_t events)
+{
+	struct epoll_event ev = {.events = events | EPOLLONESHOT | EPOLLRDHUP, .data.ptr = c};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+	{
+		if (errno != ENOENT || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			unix_error("epoll_arm: epoll_ctl error");
+	}
+}
+
+/**
+ * @brief run operations of c until one would block, c finishes or its budget is spent
+ *
+ * @param loop event loop
+ * @param c connection
+ */
+static void epoll_drive(struct epoll_loop *loop, struct conn *c)
+{
+	struct conn_io io;
+	ssize_t res;
+
+	for (int budget = EPOLL_OP_BUDGET; budget > 0; budget--)
+	{
+		conn_next(c, &io);
+		switch (io.op)
+		{
+		case CONN_OP_READ_CLIENT:
+		case CONN_OP_READ_SERVER:
+			if ((res = read(io.fd, io.buf, io.len)) < 0)
+			{
+				if (errno == EAGAIN || errno == EINTR)
+				{
+					epoll_arm(loop, c, io.fd, EPOLLIN);
+					return;
+				}
+				res = -errno;
+			}
+			break;
+
+		case CONN_OP_WRITE_CLIENT:
+		case CONN_OP_WRITE_SERVER:
+			if ((res = send(io.fd, io.buf, io.len, MSG_NOSIGNAL)) < 0)
+			{
+				if (errno == EAGAIN || errno == EINTR)
+				{
+					epoll_arm(loop, c, io.fd, EPOLLOUT);
+					return;
+				}
+				res = -errno;
+			}
+			break;
+
+		case CONN_OP_POLL:
+			if (!c->in_progress)
+			{
+				c->in_progress = true;
+				epoll_arm(loop, c, io.fd, EPOLLIN);
+				return;
+			}
+			c->in_progress = false; // woken up by readability
+			res = 0;
+			break;
+
+		case CONN_OP_WAIT: // epoll_resolved drives it again
+			return;
+
+		case CONN_OP_CLOSE:
+		default:
+			conn_free(c);
+			return;
+		}
+		conn_complete(c, res);
+	}
+	conn_next(c, &io); // out of budget, let epoll_wait put us back in line
+	if (io.op == CONN_OP_CLOSE)
+		conn_free(c);
+	else if (io.op != CONN_OP_WAIT)
+		epoll_arm(loop, c, io.fd, (io.op == CONN_OP_READ_CLIENT || io.op == CONN_OP_READ_SERVER) ? EPOLLIN : EPOLLOUT);
+}
+
+static void epoll_accept(struct epoll_loop *loop)
+{
+	int connfd;
+
+	while ((connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		if (!admission_accept())
+		{
+			admission_reject(connfd);
+			close(connfd);
+			continue;
+		}
+		epoll_drive(loop, conn_new(connfd, NULL, NULL, &loop->timers, &loop->dns));
+	}
+}
+
+static void epoll_resolved(struct epoll_loop *loop)
+{
+	struct dns_waiter *w, *next;
+
+	for (w = dns_queue_take(&loop->dns); w; w = next)
+	{
+		next = w->next; // w is part of the connection, which may be freed
+		conn_resolved(w->data);
+		epoll_drive(loop, w->data);
+	}
+}
+
+/**
+ * @brief drive the connections whose deadline has passed, and return how long until the next one may
+ *
+ * @param loop event loop
+ * @return int - epoll_wait timeout in ms, -1 if no connection has a deadline
+ */
+static int epoll_expire(struct epoll_loop *loop)
+{
+	struct timer *t;
+	struct conn *c;
+	uint64_t now = timer_now_ms();
+
+	while ((t = timer_expired(&loop->timers, now)) != NULL)
+	{
+		c = timer_entry(t, struct conn, timer);
+		conn_expire(c);
+		epoll_drive(loop, c);
+	}
+	return timer_wheel_timeout(&loop->timers, now);
+}
+
+static void *epoll_loop_run(void *arg)
+{
+	struct epoll_loop *loop = arg;
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	int n, timeout = -1;
+
+	engine_loop_setup(loop->cfg, loop->index);
+	while (1)
+	{
+		if ((n = epoll_wait(loop->epfd, events, EPOLL_MAX_EVENTS, timeout)) < 0)
+		{
+			if (errno != EINTR)
+				unix_error("epoll_loop_run: epoll_wait error");
+			n = 0;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == NULL)
+				epoll_accept(loop);
+			else if (events[i].data.ptr == &loop->dns)
+				epoll_resolved(loop);
+			else
+				epoll_drive(loop, events[i].data.ptr);
+		}
+		timeout = epoll_expire(loop);
+	}
+	return NULL;
+}
+
+/**
+ * @brief serve connections with cfg->nloops epoll loops, never returns
+ *
+ * @param cfg engine configuration, listen sockets are made non-blocking
+ */
+void epoll_engine_run(const struct engine_config *cfg)
+{
+	struct epoll_loop *loops;
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL}, dns_ev = {.events = EPOLLIN};
+	pthread_t tid;
+
+	if (!cfg->per_core)
+		ev.events |= EPOLLEXCLUSIVE; // every loop accepts from the shared socket, one is woken per connection
+	loops = Calloc(cfg->nloops, sizeof(*loops));
+	for (int i = 0; i < cfg->nloops; i++)
+	{
+		loops[i].cfg = cfg;
+		loops[i].index = i;
+		loops[i].listenfd = engine_listenfd(cfg, i);
+		timer_wheel_init(&loops[i].timers, timer_now_ms());
+		fcntl(loops[i].listenfd, F_SETFL, fcntl(loops[i].listenfd, F_GETFL) | O_NONBLOCK);
+		if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			unix_error("epoll_engine_run: epoll_create1 error");
+		if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listenfd, &ev) < 0)
+			unix_error("epoll_engine_run: epoll_ctl error");
+		dns_queue_init(&loops[i].dns);
+		dns_ev.data.ptr = &loops[i].dns;
+		if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].dns.efd, &dns_ev) < 0)
+			unix_error("epoll_engine_run: epoll_ctl error");
+	}
+	for (int i = 1; i < cfg->nloops; i++)
+		Pthread_create(&tid, NULL, epoll_loop_run, &loops[i]);
+	epoll_loop_run(&loops[0]);
+}
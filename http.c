@@ -0,0 +1,523 @@
+#include "proxy.h"
+#include "scan.h"
+
+struct http_header_name
+{
+	const char *name; // lowercase
+	uint8_t len;
+	uint8_t id; // enum http_header_id, HTTP_HDR_OTHER for an empty slot
+};
+static const struct http_header_name header_names[HTTP_HDR_SLOTS] = {
+#define HTTP_HDR_ENTRY(id_, name_, c0, c1, clast) \
+	[HTTP_HDR_SLOT(sizeof(name_) - 1, c0, c1, clast)] = {.name = name_, .len = sizeof(name_) - 1, .id = HTTP_HDR_##id_},
+	HTTP_HEADER_NAMES(HTTP_HDR_ENTRY)
+#undef HTTP_HDR_ENTRY
+};
+
+static struct http_slice slice(const char *buf, const char *start, const char *end)
+{
+	return (struct http_slice){.off = start - buf, .len = end - start};
+}
+
+/**
+ * @brief return true if c may appear in a method or a field name (tchar of RFC 9110)
+ *
+ * @param c character
+ * @return bool
+ */
+static bool is_tchar(unsigned char c)
+{
+	return c > ' ' && c < 0x7f && strchr("\"(),/:;<=>?@[\\]{}", c) == NULL;
+}
+
+/**
+ * @brief split an absolute-form target into host, port and path
+ *
+ * @param r request
+ * @param buf head
+ * @param p start of target
+ * @param e end of target
+ * @return int - 0 on success, -1 if the target is not an http URI
+ */
+static int parse_target(struct http_request *r, const char *buf, const char *p, const char *e)
+{
+	const char *t;
+
+	if (e - p < 7 || strncasecmp(p, "http://", 7) != 0)
+		return -1;
+	for (p += 7, t = p; p < e && *p != ':' && *p != '/' && *p != '?'; p++)
+		;
+	if (p == t || p - t > HTTP_MAX_HOST)
+		return -1;
+	r->host = slice(buf, t, p);
+	r->port = slice(buf, p, p);
+	if (p < e && *p == ':')
+	{
+		for (t = ++p; p < e && isdigit((unsigned char)*p); p++)
+			;
+		if (p - t > 5)
+			return -1;
+		r->port = slice(buf, t, p);
+	}
+	if (p < e && *p != '/')
+		return -1;
+	r->path = slice(buf, p, e);
+	return 0;
+}
+
+/**
+ * @brief split the authority-form target of CONNECT into host and port, both required
+ *
+ * @param r request
+ * @param buf head
+ * @param p start of target
+ * @param e end of target
+ * @return int - 0 on success, -1 if the target is not host:port
+ */
+static int parse_authority(struct http_request *r, const char *buf, const char *p, const char *e)
+{
+	const char *t;
+
+	for (t = p; p < e && *p != ':' && *p != '/' && *p != '@'; p++)
+		;
+	if (p == t || p - t > HTTP_MAX_HOST || p == e || *p != ':')
+		return -1;
+	r->host = slice(buf, t, p);
+	for (t = ++p; p < e && isdigit((unsigned char)*p); p++)
+		;
+	if (p != e || p == t || p - t > 5)
+		return -1;
+	r->port = slice(buf, t, p);
+	r->path = slice(buf, e, e);
+	return 0;
+}
+
+/**
+ * @brief parse "method SP target SP version"
+ *
+ * @param r request
+ * @param buf head
+ * @param p start of the line
+ * @param e end of the line, without CRLF
+ * @return int - 0 on success, -1 if malformed
+ */
+static int parse_request_line(struct http_request *r, const char *buf, const char *p, const char *e)
+{
+	const char *t;
+
+	for (t = p; p < e && *p != ' '; p++)
+	{
+		if (!is_tchar(*p))
+			return -1;
+	}
+	if (p == t || p == e)
+		return -1;
+	r->method = slice(buf, t, p);
+	while (p < e && *p == ' ')
+		p++;
+	for (t = p; p < e && *p != ' '; p++)
+	{
+		if ((unsigned char)*p <= ' ' || *p == 0x7f)
+			return -1;
+	}
+	if (p == t)
+		return -1;
+	if (r->method.len == 7 && memcmp(buf + r->method.off, "CONNECT", 7) == 0 ? parse_authority(r, buf, t, p) < 0 : parse_target(r, buf, t, p) < 0)
+		return -1;
+	r->target = slice(buf, t, p);
+	while (p < e && *p == ' ')
+		p++;
+	if (e - p != 8 || memcmp(p, "HTTP/", 5) != 0 || !isdigit((unsigned char)p[5]) || p[6] != '.' || !isdigit((unsigned char)p[7]))
+		return -1;
+	r->version = slice(buf, p, e);
+	return 0;
+}
+
+/**
+ * @brief parse "name: value", obsolete line folding is rejected
+ *
+ * @param r request
+ * @param buf head
+ * @param p start of the line
+ * @param e end of the line, without CRLF
+ * @return int - 0 on success, -1 if malformed
+ */
+static int parse_field(struct http_request *r, const char *buf, const char *p, const char *e)
+{
+	struct http_field *f = &r->fields[r->nfields];
+	size_t n = scan_name(p, e - p);
+
+	if (n == 0 || p + n == e || p[n] != ':')
+		return -1;
+	f->name = slice(buf, p, p + n);
+	f->id = http_header_lookup(p, n);
+	for (p += n + 1; p < e && (*p == ' ' || *p == '\t'); p++)
+		;
+	while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+		e--;
+	f->value = slice(buf, p, e);
+	r->nfields++;
+	return 0;
+}
+
+/**
+ * @brief classify a field name, case-insensitively
+ *
+ * @param name field name as delimited by scan_name
+ * @param len length of name
+ * @return enum http_header_id - HTTP_HDR_OTHER if not in HTTP_HEADER_NAMES
+ */
+enum http_header_id http_header_lookup(const char *name, size_t len)
+{
+	const struct http_header_name *h;
+
+	if (len < 2)
+		return HTTP_HDR_OTHER;
+	h = &header_names[HTTP_HDR_SLOT(len, name[0] | 0x20, name[1] | 0x20, name[len - 1] | 0x20)];
+	return h->id != HTTP_HDR_OTHER && scan_name_eq(name, len, h->name, h->len) ? h->id : HTTP_HDR_OTHER;
+}
+
+/**
+ * @brief return true if the comma-separated value of f lists token, case-insensitively
+ *
+ * @param head buffer given to http_parse
+ * @param f field parsed from head
+ * @param token token to look for, e.g. "close"
+ * @return bool
+ */
+bool http_field_has_token(const char *head, const struct http_field *f, const char *token)
+{
+	const char *p = head + f->value.off, *e = p + f->value.len, *t;
+	size_t n = strlen(token);
+
+	while (p < e)
+	{
+		for (; p < e && (*p == ',' || *p == ' ' || *p == '\t'); p++)
+			;
+		for (t = p; p < e && *p != ','; p++)
+			;
+		while (p > t && (p[-1] == ' ' || p[-1] == '\t'))
+			p--;
+		if (p - t == n && strncasecmp(t, token, n) == 0)
+			return true;
+		for (; p < e && *p != ','; p++)
+			;
+	}
+	return false;
+}
+
+/**
+ * @brief prepare r for a new request head
+ *
+ * @param r request
+ */
+void http_request_init(struct http_request *r)
+{
+	r->state = HTTP_STATE_REQUEST_LINE;
+	r->line = r->scan = 0;
+	r->nfields = 0;
+	r->head_len = 0;
+}
+
+/**
+ * @brief parse the lines of a request head that became complete since the last call
+ *
+ * @param r request, initialized by http_request_init
+ * @param buf head received so far, starting with the request line; bytes given to earlier calls must not change
+ * @param len length of buf, may extend past the head
+ * @return enum http_parse_result
+ */
+enum http_parse_result http_parse(struct http_request *r, const char *buf, size_t len)
+{
+	const char *line, *nl, *end;
+	size_t n;
+
+	if (len > HTTP_MAX_HEAD)
+		len = HTTP_MAX_HEAD;
+	while (r->state != HTTP_STATE_DONE)
+	{
+		line = buf + r->line;
+		end = line + r->scan + scan_line(line + r->scan, len - r->line - r->scan);
+		n = buf + len - end;
+		if (n == 0 || (*end == '\r' && n == 1)) // line end not here yet, or its LF is not
+		{
+			r->scan = end - line;
+			return len == HTTP_MAX_HEAD ? HTTP_PARSE_TOO_LARGE : HTTP_PARSE_AGAIN;
+		}
+		if (*end == '\n')
+			nl = end;
+		else if (*end == '\r' && end[1] == '\n')
+			nl = end + 1;
+		else // a bare CR or other control byte could be read differently by the origin
+			return r->state == HTTP_STATE_REQUEST_LINE ? HTTP_PARSE_BAD_REQUEST_LINE : HTTP_PARSE_BAD_FIELD;
+		if (r->state == HTTP_STATE_REQUEST_LINE)
+		{
+			if (end > line) // empty lines before a request are ignored
+			{
+				if (parse_request_line(r, buf, line, end) < 0)
+					return HTTP_PARSE_BAD_REQUEST_LINE;
+				r->state = HTTP_STATE_FIELDS;
+			}
+		}
+		else if (end == line)
+		{
+			r->state = HTTP_STATE_DONE;
+			r->head_len = nl + 1 - buf;
+		}
+		else if (r->nfields == HTTP_MAX_FIELDS)
+		{
+			return HTTP_PARSE_TOO_LARGE;
+		}
+		else if (parse_field(r, buf, line, end) < 0)
+		{
+			return HTTP_PARSE_BAD_FIELD;
+		}
+		else
+		{
+			r->fields[r->nfields - 1].end = nl + 1 - buf;
+		}
+		r->line = nl + 1 - buf;
+		r->scan = 0;
+	}
+	return HTTP_PARSE_DONE;
+}
+
+/**
+ * @brief prepare c for a new chunked body
+ *
+ * @param c chunked body state
+ */
+void http_chunked_init(struct http_chunked *c)
+{
+	c->state = HTTP_CHUNK_SIZE;
+	c->size = 0;
+	c->digits = 0;
+}
+
+/**
+ * @brief follow the framing of a chunked body over the next bytes of it
+ *
+ * Line ends must be CRLF, and a chunk size has at most 15 hex digits.
+ *
+ * @param c chunked body state
+ * @param buf next bytes of the body
+ * @param len length of buf
+ * @return ssize_t - bytes of buf that belong to the body, fewer than len only once c is HTTP_CHUNK_DONE; -1 if malformed
+ */
+ssize_t http_chunked_parse(struct http_chunked *c, const char *buf, size_t len)
+{
+	size_t i = 0, n;
+	int d;
+
+	while (i < len && c->state != HTTP_CHUNK_DONE)
+	{
+		unsigned char ch = buf[i];
+
+		switch (c->state)
+		{
+		case HTTP_CHUNK_SIZE:
+			if ((d = isdigit(ch) ? ch - '0' : isxdigit(ch) ? (ch | 0x20) - 'a' + 10 : -1) >= 0)
+			{
+				if (++c->digits > 15)
+					return -1;
+				c->size = c->size * 16 + d;
+			}
+			else if (c->digits && (ch == ';' || ch == ' ' || ch == '\t'))
+				c->state = HTTP_CHUNK_EXT;
+			else if (c->digits && ch == '\r')
+				c->state = HTTP_CHUNK_SIZE_LF;
+			else
+				return -1;
+			break;
+		case HTTP_CHUNK_EXT:
+			if (ch == '\r')
+				c->state = HTTP_CHUNK_SIZE_LF;
+			else if ((ch < 0x20 && ch != '\t') || ch == 0x7f)
+				return -1;
+			break;
+		case HTTP_CHUNK_SIZE_LF:
+			if (ch != '\n')
+				return -1;
+			c->state = c->size ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+			break;
+		case HTTP_CHUNK_DATA:
+			n = len - i < c->size ? len - i : c->size;
+			http_chunked_data(c, n);
+			i += n;
+			continue;
+		case HTTP_CHUNK_DATA_CR:
+		case HTTP_CHUNK_TRAILER_LINE:
+			if (ch == '\r')
+				c->state = c->state == HTTP_CHUNK_DATA_CR ? HTTP_CHUNK_DATA_LF : HTTP_CHUNK_TRAILER_LF;
+			else if (c->state == HTTP_CHUNK_DATA_CR || ch == '\n')
+				return -1;
+			break;
+		case HTTP_CHUNK_DATA_LF:
+			if (ch != '\n')
+				return -1;
+			http_chunked_init(c);
+			break;
+		case HTTP_CHUNK_TRAILER:
+			if (ch == '\n')
+				return -1;
+			c->state = ch == '\r' ? HTTP_CHUNK_END_LF : HTTP_CHUNK_TRAILER_LINE;
+			break;
+		case HTTP_CHUNK_TRAILER_LF:
+		case HTTP_CHUNK_END_LF:
+			if (ch != '\n')
+				return -1;
+			c->state = c->state == HTTP_CHUNK_END_LF ? HTTP_CHUNK_DONE : HTTP_CHUNK_TRAILER;
+			break;
+		default:
+			return -1;
+		}
+		i++;
+	}
+	return i;
+}
+
+/**
+ * @brief account for n bytes of chunk data the caller moved itself
+ *
+ * @param c chunked body in state HTTP_CHUNK_DATA
+ * @param n bytes, at most c->size
+ */
+void http_chunked_data(struct http_chunked *c, size_t n)
+{
+	if ((c->size -= n) == 0)
+		c->state = HTTP_CHUNK_DATA_CR;
+}
+
+/**
+ * @brief give the request line parsed by http_parse as C strings
+ *
+ * The method, path and version are terminated in place by overwriting the
+ * delimiter after each of them; host and port are copied to r because they
+ * abut the path.
+ *
+ * @param r request parsed by http_parse
+ * @param head buffer given to http_parse
+ * @return struct request_info - strings point into head and r, valid as long as both are
+ */
+struct request_info parse_request(struct http_request *r, char *head)
+{
+	struct request_info ret = {.err_type = REQ_MALFORMED};
+
+	if (r->state == HTTP_STATE_REQUEST_LINE)
+		return ret;
+	ret.err_type = REQ_OK;
+	ret.method = head + r->method.off;
+	ret.method[r->method.len] = '\0';
+	for (int i = 0; i < r->host.len; i++) // host names are case-insensitive, the cache compares them as strings
+		r->host_str[i] = tolower((unsigned char)head[r->host.off + i]);
+	r->host_str[r->host.len] = '\0';
+	ret.host = r->host_str;
+	memcpy(r->port_str, head + r->port.off, r->port.len);
+	r->port_str[r->port.len] = '\0';
+	ret.port = r->port.len ? r->port_str : "80";
+	if (r->path.len)
+	{
+		ret.abs_path = head + r->path.off;
+		ret.abs_path[r->path.len] = '\0';
+	}
+	else
+	{
+		ret.abs_path = "/";
+	}
+	ret.http_version = head + r->version.off;
+	ret.http_version[r->version.len] = '\0';
+	return ret;
+}
+
+/**
+ * @brief return true if the last coding a Transfer-Encoding field lists is chunked
+ *
+ * @param head buffer given to http_parse
+ * @param f Transfer-Encoding field
+ * @return bool
+ */
+static bool is_chunked_last(const char *head, const struct http_field *f)
+{
+	const char *p = head + f->value.off, *e = p + f->value.len, *t = e;
+
+	while (t > p && t[-1] != ',')
+		t--;
+	while (t < e && (*t == ' ' || *t == '\t'))
+		t++;
+	return e - t == 7 && strncasecmp(t, "chunked", 7) == 0;
+}
+
+/**
+ * @brief parse a Content-Length value
+ *
+ * @param head buffer given to http_parse
+ * @param f Content-Length field
+ * @return long - the length, -1 if it is not a plain decimal number
+ */
+static long parse_content_length(const char *head, const struct http_field *f)
+{
+	const char *p = head + f->value.off;
+	long n = 0;
+
+	if (f->value.len == 0 || f->value.len > 18)
+		return -1;
+	for (int i = 0; i < f->value.len; i++)
+	{
+		if (!isdigit((unsigned char)p[i]))
+			return -1;
+		n = n * 10 + p[i] - '0';
+	}
+	return n;
+}
+
+/**
+ * @brief give the header fields parsed by http_parse, the bytes of head stay as received
+ *
+ * A request body must be framed one way only: Transfer-Encoding ending in
+ * chunked, or a single Content-Length. Anything else could be read
+ * differently by the server and is rejected.
+ *
+ * @param r request parsed by http_parse
+ * @param head buffer given to http_parse
+ * @return struct header_info - fields of r, slices of head; valid as long as both are
+ */
+struct header_info parse_header(const struct http_request *r, const char *head)
+{
+	struct header_info ret = {.err_type = HDR_MALFORMED};
+	bool has_te = false;
+	long n;
+
+	if (r->state != HTTP_STATE_DONE)
+		return ret;
+	ret.content_length = -1;
+	for (int i = 0; i < r->nfields; i++)
+	{
+		const struct http_field *f = &r->fields[i];
+
+		switch (f->id)
+		{
+		case HTTP_HDR_CONTENT_LENGTH:
+			if ((n = parse_content_length(head, f)) < 0 || (ret.content_length >= 0 && n != ret.content_length))
+				return ret;
+			ret.content_length = n;
+			break;
+		case HTTP_HDR_TRANSFER_ENCODING: // the last field holds the last coding
+			has_te = true;
+			ret.chunked = is_chunked_last(head, f);
+			break;
+		case HTTP_HDR_EXPECT:
+			ret.expect_continue |= http_field_has_token(head, f, "100-continue");
+			break;
+		default:
+			break;
+		}
+	}
+	if (has_te && (!ret.chunked || ret.content_length >= 0))
+		return ret;
+	ret.err_type = HDR_OK;
+	ret.has_entity_body = ret.chunked || ret.content_length > 0;
+	ret.count = r->nfields;
+	ret.head = head;
+	ret.fields = r->fields;
+	return ret;
+}
@@ -0,0 +1,152 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Incremental parser of HTTP/1.x request heads. It neither copies nor
+ * modifies what it parses: every field is an offset/length slice of the
+ * buffer holding the head, which the caller keeps in place (the rio_t
+ * buffer of serve(), the request buffer of a conn). When a head is cut short
+ * http_parse returns HTTP_PARSE_AGAIN and is called again on the same bytes
+ * with more appended; only the part of the head not seen yet is scanned.
+ */
+
+#define HTTP_MAX_HEAD 65535	 // slices are 16 bit, callers' buffers are smaller anyway
+#define HTTP_MAX_FIELDS 128	 // header fields of one request, more is a 400
+#define HTTP_MAX_HOST 255
+
+enum http_parse_state
+{
+	HTTP_STATE_REQUEST_LINE,
+	HTTP_STATE_FIELDS,
+	HTTP_STATE_DONE
+};
+enum http_parse_result
+{
+	HTTP_PARSE_AGAIN,			 // head incomplete, call again with more bytes
+	HTTP_PARSE_DONE,			 // head complete, head_len bytes long
+	HTTP_PARSE_BAD_REQUEST_LINE, // malformed request line or target
+	HTTP_PARSE_BAD_FIELD,		 // malformed header field
+	HTTP_PARSE_TOO_LARGE		 // head longer than HTTP_MAX_HEAD or more than HTTP_MAX_FIELDS fields
+};
+
+/*
+ * Header names the proxy knows, as X(ID, name, first, second and last
+ * character of name). Each maps to enum http_header_id through a perfect
+ * hash of the length and those three characters: http_header_lookup costs
+ * one hash and one compare, and a name not listed is HTTP_HDR_OTHER. The
+ * slots are computed by the compiler from this list; two names sharing a
+ * slot fail the build of http.o, then HTTP_HDR_SLOT needs new factors.
+ */
+#define HTTP_HEADER_NAMES(X) \
+	X(ACCEPT, "accept", 'a', 'c', 't') \
+	X(ACCEPT_ENCODING, "accept-encoding", 'a', 'c', 'g') \
+	X(ACCEPT_LANGUAGE, "accept-language", 'a', 'c', 'e') \
+	X(AGE, "age", 'a', 'g', 'e') \
+	X(AUTHORIZATION, "authorization", 'a', 'u', 'n') \
+	X(CACHE_CONTROL, "cache-control", 'c', 'a', 'l') \
+	X(CONNECTION, "connection", 'c', 'o', 'n') \
+	X(CONTENT_ENCODING, "content-encoding", 'c', 'o', 'g') \
+	X(CONTENT_LENGTH, "content-length", 'c', 'o', 'h') \
+	X(CONTENT_TYPE, "content-type", 'c', 'o', 'e') \
+	X(COOKIE, "cookie", 'c', 'o', 'e') \
+	X(DATE, "date", 'd', 'a', 'e') \
+	X(ETAG, "etag", 'e', 't', 'g') \
+	X(EXPECT, "expect", 'e', 'x', 't') \
+	X(EXPIRES, "expires", 'e', 'x', 's') \
+	X(HOST, "host", 'h', 'o', 't') \
+	X(IF_MODIFIED_SINCE, "if-modified-since", 'i', 'f', 'e') \
+	X(IF_NONE_MATCH, "if-none-match", 'i', 'f', 'h') \
+	X(KEEP_ALIVE, "keep-alive", 'k', 'e', 'e') \
+	X(LAST_MODIFIED, "last-modified", 'l', 'a', 'd') \
+	X(LOCATION, "location", 'l', 'o', 'n') \
+	X(PRAGMA, "pragma", 'p', 'r', 'a') \
+	X(PROXY_AUTHENTICATE, "proxy-authenticate", 'p', 'r', 'e') \
+	X(PROXY_AUTHORIZATION, "proxy-authorization", 'p', 'r', 'n') \
+	X(PROXY_CONNECTION, "proxy-connection", 'p', 'r', 'n') \
+	X(RANGE, "range", 'r', 'a', 'e') \
+	X(REFERER, "referer", 'r', 'e', 'r') \
+	X(SERVER, "server", 's', 'e', 'r') \
+	X(SET_COOKIE, "set-cookie", 's', 'e', 'e') \
+	X(TE, "te", 't', 'e', 'e') \
+	X(TRAILER, "trailer", 't', 'r', 'r') \
+	X(TRANSFER_ENCODING, "transfer-encoding", 't', 'r', 'g') \
+	X(UPGRADE, "upgrade", 'u', 'p', 'e') \
+	X(USER_AGENT, "user-agent", 'u', 's', 't') \
+	X(VARY, "vary", 'v', 'a', 'y') \
+	X(VIA, "via", 'v', 'i', 'a')
+
+#define HTTP_HDR_SLOTS 128
+#define HTTP_HDR_SLOT(len, c0, c1, clast) (((len) + 2 * (c0) + 4 * (c1) + 13 * (clast)) & (HTTP_HDR_SLOTS - 1))
+
+enum http_header_id
+{
+	HTTP_HDR_OTHER,
+#define HTTP_HDR_ENUM(id, name, c0, c1, clast) HTTP_HDR_##id,
+	HTTP_HEADER_NAMES(HTTP_HDR_ENUM)
+#undef HTTP_HDR_ENUM
+};
+
+struct http_slice
+{
+	uint16_t off, len; // from the start of the head
+};
+struct http_field
+{
+	struct http_slice name, value; // value without surrounding whitespace
+	uint16_t end;				   // of the line, past its LF; the line starts at name.off
+	enum http_header_id id;
+};
+struct http_request
+{
+	enum http_parse_state state;
+	uint16_t line; // start of the first line not parsed yet
+	uint16_t scan; // bytes of that line already searched for its end
+
+	struct http_slice method, target, version;
+	struct http_slice host, port, path; // parts of an absolute-form target, port and path may be empty
+	int nfields;
+	struct http_field fields[HTTP_MAX_FIELDS];
+	size_t head_len; // including the blank line, once state is HTTP_STATE_DONE
+
+	char host_str[HTTP_MAX_HOST + 1], port_str[8]; // NUL-terminated by parse_request, they abut the path
+};
+
+/*
+ * A chunked body is forwarded as it is; http_chunked_parse only finds
+ * where it ends and rejects framing the next hop could read differently.
+ */
+enum http_chunk_state
+{
+	HTTP_CHUNK_SIZE,	   // hex digits of a chunk size
+	HTTP_CHUNK_EXT,		   // chunk extensions, up to CR
+	HTTP_CHUNK_SIZE_LF,	   // LF ending the size line
+	HTTP_CHUNK_DATA,	   // size bytes of data left
+	HTTP_CHUNK_DATA_CR,	   // CRLF after the data
+	HTTP_CHUNK_DATA_LF,
+	HTTP_CHUNK_TRAILER,	   // start of a trailer line, or of the final CRLF
+	HTTP_CHUNK_TRAILER_LINE,
+	HTTP_CHUNK_TRAILER_LF,
+	HTTP_CHUNK_END_LF,
+	HTTP_CHUNK_DONE
+};
+struct http_chunked
+{
+	enum http_chunk_state state;
+	uint64_t size;
+	int digits;
+};
+
+void http_request_init(struct http_request *);
+enum http_parse_result http_parse(struct http_request *, const char *buf, size_t len);
+enum http_header_id http_header_lookup(const char *name, size_t len);
+void http_chunked_init(struct http_chunked *);
+ssize_t http_chunked_parse(struct http_chunked *, const char *buf, size_t len);
+void http_chunked_data(struct http_chunked *, size_t n);
+bool http_field_has_token(const char *head, const struct http_field *, const char *token);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,265 @@
+#include "proxy.h"
+#include "scan.h"
+
+/*
+ * Requests/sec one core parses, with the sscanf/strdup parser the proxy used
+ * before http.c (kept below verbatim for comparison) and with http_parse on
+ * each set of scan kernels the CPU supports. Every round copies the request
+ * into the parse buffer first, as reading it from the socket would. The
+ * legacy parser rejects header values containing spaces, so the requests
+ * avoid them.
+ */
+
+#define BENCH_SECONDS 1.0
+#define LEGACY_MAX_HDR_CNT 512
+
+static const char *requests[][2] = {
+	{"minimal", "GET http://localhost:8080/home.html HTTP/1.0\r\n"
+				"Host: localhost:8080\r\n"
+				"\r\n"},
+	{"browser", "GET http://www.example.com:8080/static/js/app.min.js?v=20240101 HTTP/1.1\r\n"
+				"Host: www.example.com:8080\r\n"
+				"User-Agent: Mozilla/5.0\r\n"
+				"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+				"Accept-Language: en-US,en;q=0.5\r\n"
+				"Accept-Encoding: gzip,deflate,br\r\n"
+				"Referer: http://www.example.com:8080/index.html\r\n"
+				"Connection: keep-alive\r\n"
+				"Cookie: session=8c1f0a6b2d4e4e2a9f7b3c5d6e7f8091;theme=dark;lang=en\r\n"
+				"Upgrade-Insecure-Requests: 1\r\n"
+				"Sec-Fetch-Dest: script\r\n"
+				"Sec-Fetch-Mode: no-cors\r\n"
+				"Sec-Fetch-Site: same-origin\r\n"
+				"Cache-Control: max-age=0\r\n"
+				"\r\n"},
+	{"cookies", "GET http://shop.example.com/cart?item=1234567890&ref=newsletter&utm_source=mail HTTP/1.1\r\n"
+				"Host: shop.example.com\r\n"
+				"Accept: */*\r\n"
+				"Cookie: a=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef;"
+				"b=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef;"
+				"c=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef;"
+				"d=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef;"
+				"e=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef;"
+				"f=0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\r\n"
+				"X-Forwarded-For: 192.0.2.1,198.51.100.2,203.0.113.3\r\n"
+				"Authorization: Bearer.eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6IkpvaG4ifQ\r\n"
+				"\r\n"},
+};
+static const char *impls[] = {"scalar", "sse2", "avx2"};
+
+struct legacy_header_info
+{
+	enum header_error_type err_type;
+	int count;
+	bool has_entity_body;
+	char *(*kvpairs)[2];
+}; // struct header_info before it referenced the head as received
+
+static struct request_info legacy_parse_request(rio_t *rio)
+{
+	struct request_info ret;
+	char str[MAXLINE], method[MAXLINE], uri[MAXLINE], http_version[MAXLINE], host[MAXLINE], port[MAXLINE], path[MAXLINE], *pos;
+	int read_cnt;
+
+	if (rio_readlineb(rio, str, MAXLINE) <= 0)
+	{
+		ret.err_type = REQ_MALFORMED;
+		goto end;
+	}
+	if (sscanf(str, "%s%s%s %n", method, uri, http_version, &read_cnt) < 3 || read_cnt != strlen(str))
+	{
+		ret.err_type = REQ_MALFORMED;
+		goto end;
+	}
+	for (size_t i = 0, len = strlen(uri); i < len; i++)
+		uri[i] = tolower(uri[i]);
+	if ((sscanf(uri, "http://%[^:/]%n", host, &read_cnt)) < 1)
+	{
+		ret.err_type = REQ_MALFORMED;
+		goto end;
+	}
+	pos = uri + read_cnt;
+	if (uri[read_cnt] == ':')
+	{
+		sscanf(pos, ":%[^/]%n", port, &read_cnt);
+		pos += read_cnt;
+	}
+	else
+	{
+		strcpy(port, "80");
+	}
+	if (sscanf(pos, "%s", path) < 1)
+	{
+		ret.err_type = REQ_MALFORMED;
+		goto end;
+	}
+	ret.err_type = REQ_OK;
+	ret.method = strdup(method);
+	ret.host = strdup(host);
+	ret.port = strdup(port);
+	ret.abs_path = strdup(path);
+	ret.http_version = strdup(http_version);
+
+end:
+	return ret;
+}
+
+static struct legacy_header_info legacy_parse_header(rio_t *rio)
+{
+	struct legacy_header_info ret;
+	char buf[MAXLINE], key[MAXLINE], val[MAXLINE], *(kvpairs[LEGACY_MAX_HDR_CNT])[2];
+	int readcnt;
+
+	ret.count = 0;
+	while (rio_readlineb(rio, buf, MAXLINE) > 0)
+	{
+		if (strcmp(buf, "\r\n") == 0)
+			break;
+		if (ret.count == LEGACY_MAX_HDR_CNT || sscanf(buf, "%[^:]: %s %n", key, val, &readcnt) < 2 || readcnt != strlen(buf))
+		{
+			for (int i = 0; i < ret.count; i++)
+			{
+				free(kvpairs[i][0]);
+				free(kvpairs[i][1]);
+			}
+			ret.err_type = HDR_MALFORMED;
+			ret.count = 0;
+			ret.kvpairs = NULL;
+			goto end;
+		}
+		kvpairs[ret.count][0] = strdup(key);
+		kvpairs[ret.count][1] = strdup(val);
+		ret.count++;
+	}
+	ret.err_type = HDR_OK;
+	ret.has_entity_body = false;
+	ret.kvpairs = NULL;
+	if (ret.count)
+	{
+		ret.kvpairs = Malloc(sizeof(*ret.kvpairs) * ret.count);
+		memcpy(ret.kvpairs, kvpairs, sizeof(*ret.kvpairs) * ret.count);
+	}
+
+end:
+	return ret;
+}
+
+static int legacy_round(const char *req, size_t len, size_t split)
+{
+	struct request_info r;
+	struct legacy_header_info h;
+	rio_t rio;
+
+	rio_readinitmem(&rio, req, len);
+	r = legacy_parse_request(&rio);
+	h = legacy_parse_header(&rio);
+	if (r.err_type != REQ_OK || h.err_type != HDR_OK)
+		return -1;
+	free(r.method);
+	free(r.host);
+	free(r.port);
+	free(r.abs_path);
+	free(r.http_version);
+	for (int i = 0; i < h.count; i++)
+	{
+		free(h.kvpairs[i][0]);
+		free(h.kvpairs[i][1]);
+	}
+	free(h.kvpairs);
+	return 0;
+}
+
+/**
+ * @brief parse req with http_parse, handing it over split bytes at a time as a slow client would send it
+ *
+ * @param req request
+ * @param len length of req
+ * @param split bytes per read, or len
+ * @return int - 0 on success, -1 if the request did not parse
+ */
+static int http_round(const char *req, size_t len, size_t split)
+{
+	static struct http_request http;
+	static char buf[RIO_BUFSIZE];
+	struct request_info r;
+	struct header_info h;
+	enum http_parse_result rc = HTTP_PARSE_AGAIN;
+
+	http_request_init(&http);
+	for (size_t got = 0; got < len && rc == HTTP_PARSE_AGAIN;)
+	{
+		size_t n = len - got < split ? len - got : split;
+
+		memcpy(buf + got, req + got, n);
+		got += n;
+		rc = http_parse(&http, buf, got);
+	}
+	r = parse_request(&http, buf);
+	h = parse_header(&http, buf);
+	if (r.err_type != REQ_OK || h.err_type != HDR_OK)
+		return -1;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief run round on req for BENCH_SECONDS
+ *
+ * @return double - requests per second
+ */
+static double bench(int (*round)(const char *, size_t, size_t), const char *req, size_t split)
+{
+	size_t len = strlen(req);
+	double start = now(), elapsed;
+	unsigned long n = 0;
+
+	do
+	{
+		for (int i = 0; i < 1000; i++, n++)
+		{
+			if (round(req, len, split) < 0)
+			{
+				fprintf(stderr, "parse_bench: request rejected\n");
+				exit(1);
+			}
+		}
+	} while ((elapsed = now() - start) < BENCH_SECONDS);
+	return n / elapsed;
+}
+
+int main(void)
+{
+	double before, rate;
+
+	printf("%-8s %12s", "request", "sscanf");
+	for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+		printf(" %12s", impls[k]);
+	printf(" %12s  (requests/sec; last column: best kernels, 32 B reads)\n", "32 B reads");
+	for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++)
+	{
+		before = bench(legacy_round, requests[i][1], SIZE_MAX);
+		printf("%-8s %12.0f", requests[i][0], before);
+		for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+		{
+			if (scan_select(impls[k]) < 0)
+			{
+				printf(" %12s", "-");
+				continue;
+			}
+			rate = bench(http_round, requests[i][1], SIZE_MAX);
+			printf(" %7.0f %3.1fx", rate, rate / before);
+		}
+		for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+			scan_select(impls[k]); // leaves the best supported one
+		printf(" %12.0f\n", bench(http_round, requests[i][1], 32));
+		fflush(stdout);
+	}
+	return 0;
+}
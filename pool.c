@@ -0,0 +1,500 @@
+#include "csapp.h"
+#include "pool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+
+/*
+ * Every worker owns a run queue. A new connection goes to the most recently
+ * parked worker, which is woken through its own semaphore, or to the shorter
+ * of two random queues if every worker is busy. A worker serves its own
+ * queue first and otherwise steals the oldest connection of another, so
+ * connections queued behind a worker stuck on a slow origin are picked up by
+ * whoever finishes first. Submitting is lock-free while no worker is parked:
+ * the fd is pushed with the ring's atomics and idle_lock is only taken to pop
+ * a parked worker. A parking worker publishes nidle and then looks at the
+ * rings again, a submitter pushes and then looks at nidle again, so one of
+ * the two always sees the other and no connection is left behind.
+ */
+
+struct pool_slot
+{
+	atomic_size_t seq;
+	int fd;
+	uint64_t enqueue_ns;
+};
+struct pool_ring
+{
+	size_t mask;
+	struct pool_slot *slots;
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+}; // bounded MPMC ring, every slot carries a sequence number telling whose turn it is
+struct pool_worker
+{
+	struct pool_ring ring; // run queue, popped by the owner and stolen from by the others
+	sem_t wake;			   // posted when a connection is handed to the parked worker
+	atomic_bool active;
+	bool idle; // parked on idle_stack, protected by idle_lock
+	atomic_ulong local, stolen; // connections taken from the own ring and from others
+};
+struct pool_stats
+{
+	atomic_ulong submitted, completed, rejected;
+	atomic_long depth;
+	atomic_ulong depth_max, wait_ns_total, wait_ns_max;
+	atomic_ulong wait_ns_avg; // moving average over the last few connections
+	atomic_int threads, idle;
+	atomic_ulong threads_max;
+	atomic_ulong spawned, retired;
+	atomic_ulong steal_scans; // rings looked at while stealing
+};
+
+static struct pool_config config;
+static struct pool_worker *workers; // max_threads entries
+static atomic_int nworkers;			// high-water mark of worker indices in use
+static struct pool_stats stats;
+static sem_t idle_lock;
+static int *idle_stack;		// parked workers, the last one parked is woken first
+static atomic_int nidle;	// changed under idle_lock, read without it by submitters
+
+static void *pool_worker(void *);
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void atomic_max(atomic_ulong *obj, unsigned long val)
+{
+	unsigned long cur = atomic_load_explicit(obj, memory_order_relaxed);
+	while (cur < val && !atomic_compare_exchange_weak_explicit(obj, &cur, val, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+static void ring_init(struct pool_ring *ring, size_t size)
+{
+	ring->mask = size - 1;
+	ring->slots = Calloc(size, sizeof(*ring->slots));
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&ring->slots[i].seq, i);
+}
+
+static size_t ring_length(struct pool_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	return tail > head ? tail - head : 0;
+}
+
+static int ring_push(struct pool_ring *ring, int fd, uint64_t enqueue_ns)
+{
+	struct pool_slot *slot;
+	size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed), seq;
+	intptr_t dif;
+
+	while (1)
+	{
+		slot = &ring->slots[pos & ring->mask];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) // slot is free for this position, try to claim it
+		{
+			if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) // consumers have not caught up, ring is full
+		{
+			return -1;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		}
+	}
+	slot->fd = fd;
+	slot->enqueue_ns = enqueue_ns;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+static int ring_pop(struct pool_ring *ring, int *fd, uint64_t *enqueue_ns)
+{
+	struct pool_slot *slot;
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed), seq;
+	intptr_t dif;
+
+	while (1)
+	{
+		slot = &ring->slots[pos & ring->mask];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) // slot is published, try to claim it
+		{
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) // producer has not published this slot yet
+		{
+			return -1;
+		}
+		else
+		{
+			pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		}
+	}
+	*fd = slot->fd;
+	*enqueue_ns = slot->enqueue_ns;
+	atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+	return 0;
+}
+
+/**
+ * @brief start one more worker unless max_threads is reached
+ *
+ * @return int - 0 if a worker was started
+ */
+static int pool_spawn(void)
+{
+	pthread_t tid;
+	int n = atomic_load(&stats.threads), rc, id;
+	bool expected;
+
+	do
+	{
+		if (n >= config.max_threads)
+			return -1;
+	} while (!atomic_compare_exchange_weak(&stats.threads, &n, n + 1));
+	for (id = 0;; id = (id + 1) % config.max_threads) // a slot is free as threads <= max_threads
+	{
+		expected = false;
+		if (atomic_compare_exchange_strong(&workers[id].active, &expected, true))
+			break;
+	}
+	for (int hwm = atomic_load(&nworkers); hwm <= id && !atomic_compare_exchange_weak(&nworkers, &hwm, id + 1);)
+		;
+	if ((rc = pthread_create(&tid, NULL, pool_worker, (void *)(intptr_t)id)) != 0)
+	{
+		atomic_store(&workers[id].active, false);
+		atomic_fetch_sub(&stats.threads, 1);
+		fprintf(stderr, "pool_spawn: pthread_create error: %s\n", strerror(rc)); // not fatal, the pool just does not grow
+		return -1;
+	}
+	atomic_fetch_add(&stats.spawned, 1);
+	atomic_max(&stats.threads_max, n + 1);
+	return 0;
+}
+/**
+ * @brief give up the calling worker if the pool is above min_threads
+ *
+ * @return int - 1 if the caller must exit
+ */
+static int pool_retire(void)
+{
+	int n = atomic_load(&stats.threads);
+
+	do
+	{
+		if (n <= config.min_threads)
+			return 0;
+	} while (!atomic_compare_exchange_weak(&stats.threads, &n, n - 1));
+	atomic_fetch_add(&stats.retired, 1);
+	return 1;
+}
+
+/**
+ * @brief take a connection from the own ring, or steal the oldest one of another worker
+ *
+ * @param id index of the calling worker
+ * @param fd taken fd
+ * @param enqueue_ns time fd was submitted
+ * @return int - 0 on success, -1 if every ring looked empty
+ */
+static int pool_take(int id, int *fd, uint64_t *enqueue_ns)
+{
+	int n = atomic_load(&nworkers), victim;
+
+	if (ring_pop(&workers[id].ring, fd, enqueue_ns) == 0)
+	{
+		atomic_fetch_add_explicit(&workers[id].local, 1, memory_order_relaxed);
+		return 0;
+	}
+	if (atomic_load(&stats.depth) == 0) // nothing queued anywhere, skip the scan
+		return -1;
+	for (int i = 1; i < n; i++)
+	{
+		victim = (id + i) % n;
+		atomic_fetch_add_explicit(&stats.steal_scans, 1, memory_order_relaxed);
+		if (ring_pop(&workers[victim].ring, fd, enqueue_ns) == 0)
+		{
+			atomic_fetch_add_explicit(&workers[id].stolen, 1, memory_order_relaxed);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief sleep until a connection is handed to the calling worker, which is on idle_stack
+ *
+ * @param id index of the calling worker
+ * @return int - 1 if the worker retired and must exit
+ */
+static int pool_park(int id)
+{
+	struct timespec deadline;
+	int rc;
+
+	while (1)
+	{
+		if (atomic_load(&stats.threads) > config.min_threads) // extra worker, wait with timeout
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += POOL_IDLE_TIMEOUT;
+			rc = sem_timedwait(&workers[id].wake, &deadline);
+		}
+		else
+		{
+			rc = sem_wait(&workers[id].wake);
+		}
+		if (rc == 0)
+			return 0;
+		if (errno != ETIMEDOUT)
+			continue;
+		P(&idle_lock);
+		if (workers[id].idle && pool_retire()) // not handed a connection in the meantime
+		{
+			for (int i = 0; i < nidle; i++)
+			{
+				if (idle_stack[i] == id)
+				{
+					memmove(&idle_stack[i], &idle_stack[i + 1], (nidle - i - 1) * sizeof(*idle_stack));
+					break;
+				}
+			}
+			atomic_fetch_sub(&nidle, 1);
+			workers[id].idle = false;
+			atomic_fetch_sub(&stats.idle, 1);
+			V(&idle_lock);
+			return 1;
+		}
+		V(&idle_lock);
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	uint64_t enqueue_ns, waited, avg;
+	int id = (intptr_t)arg, fd;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		if (pool_take(id, &fd, &enqueue_ns) != 0)
+		{
+			P(&idle_lock);
+			idle_stack[nidle] = id;
+			workers[id].idle = true;
+			atomic_fetch_add(&nidle, 1);
+			atomic_fetch_add(&stats.idle, 1);
+			atomic_thread_fence(memory_order_seq_cst); // pairs with the fence in pool_submit
+			if (pool_take(id, &fd, &enqueue_ns) != 0)
+			{
+				V(&idle_lock);
+				if (pool_park(id))
+					break;
+				continue;
+			}
+			atomic_fetch_sub(&nidle, 1); // still on top of idle_stack, the lock was held
+			workers[id].idle = false;
+			atomic_fetch_sub(&stats.idle, 1);
+			V(&idle_lock);
+		}
+		atomic_fetch_sub(&stats.depth, 1);
+		waited = now_ns() - enqueue_ns;
+		atomic_fetch_add_explicit(&stats.wait_ns_total, waited, memory_order_relaxed);
+		atomic_max(&stats.wait_ns_max, waited);
+		avg = atomic_load_explicit(&stats.wait_ns_avg, memory_order_relaxed); // racy updates only lose samples
+		atomic_store_explicit(&stats.wait_ns_avg, avg - avg / 8 + waited / 8, memory_order_relaxed);
+
+		config.handler(fd);
+		atomic_fetch_add_explicit(&stats.completed, 1, memory_order_relaxed);
+	}
+	atomic_store(&workers[id].active, false); // its ring is empty, it was parked
+	return NULL;
+}
+
+/**
+ * @brief allocate the run queues and start min_threads workers
+ *
+ * @param cfg pool configuration, copied
+ */
+void pool_start(const struct pool_config *cfg)
+{
+	size_t size = 2;
+
+	config = *cfg;
+	if (config.min_threads < 1)
+		config.min_threads = 1;
+	if (config.max_threads < config.min_threads)
+		config.max_threads = config.min_threads;
+	while (size < config.queue_size)
+		size <<= 1;
+	config.queue_size = size;
+
+	workers = Calloc(config.max_threads, sizeof(*workers));
+	for (int i = 0; i < config.max_threads; i++)
+	{
+		ring_init(&workers[i].ring, size);
+		Sem_init(&workers[i].wake, 0, 0);
+	}
+	idle_stack = Calloc(config.max_threads, sizeof(*idle_stack));
+	Sem_init(&idle_lock, 0, 1);
+	for (int i = 0; i < config.min_threads; i++)
+		pool_spawn();
+}
+
+/**
+ * @brief pick the run queue for a new connection when no worker is parked: the shorter of two random ones
+ *
+ * @return int - worker index
+ */
+static int pool_pick(void)
+{
+	static _Thread_local unsigned int seed = 2463534242u;
+	int n = atomic_load(&nworkers), a, b;
+
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	a = seed % n;
+	b = (seed >> 16) % n;
+	if (!atomic_load(&workers[a].active))
+		return b;
+	if (!atomic_load(&workers[b].active))
+		return a;
+	return ring_length(&workers[a].ring) <= ring_length(&workers[b].ring) ? a : b;
+}
+
+/**
+ * @brief take the most recently parked worker off idle_stack, locking only if one is parked
+ *
+ * @return int - worker index, -1 if none is parked
+ */
+static int pool_unpark(void)
+{
+	int id = -1;
+
+	if (atomic_load(&nidle) == 0)
+		return -1;
+	P(&idle_lock);
+	if (nidle > 0)
+	{
+		id = idle_stack[nidle - 1];
+		atomic_fetch_sub(&nidle, 1);
+		workers[id].idle = false;
+		atomic_fetch_sub(&stats.idle, 1);
+	}
+	V(&idle_lock);
+	return id;
+}
+
+/**
+ * @brief hand an accepted fd to the pool, growing it if every worker is busy
+ *
+ * @param fd connected client fd, owned by the pool on success
+ * @return int - 0 on success, -1 if the queue is full
+ */
+int pool_submit(int fd)
+{
+	long depth;
+	int id;
+
+	if (atomic_load(&stats.depth) >= (long)config.queue_size)
+		goto reject;
+	depth = atomic_fetch_add(&stats.depth, 1) + 1; // before the push, a worker seeing depth 0 must find nothing
+	if ((id = pool_unpark()) >= 0)
+	{
+		if (ring_push(&workers[id].ring, fd, now_ns()) != 0) // cannot happen, a parked worker has an empty ring
+		{
+			V(&workers[id].wake);
+			goto full;
+		}
+		V(&workers[id].wake);
+	}
+	else
+	{
+		if (ring_push(&workers[pool_pick()].ring, fd, now_ns()) != 0)
+			goto full;
+		atomic_thread_fence(memory_order_seq_cst); // pairs with the fence in pool_worker
+		if ((id = pool_unpark()) >= 0) // parked after the first look, it steals the fd
+			V(&workers[id].wake);
+		else
+			pool_spawn(); // every worker is busy, the new one steals it
+	}
+	atomic_fetch_add_explicit(&stats.submitted, 1, memory_order_relaxed);
+	atomic_max(&stats.depth_max, depth);
+	return 0;
+
+full:
+	atomic_fetch_sub(&stats.depth, 1);
+reject:
+	atomic_fetch_add(&stats.rejected, 1);
+	return -1;
+}
+
+/**
+ * @brief return the number of connections waiting for a worker
+ *
+ * @return long
+ */
+long pool_queue_depth(void)
+{
+	return atomic_load_explicit(&stats.depth, memory_order_relaxed);
+}
+
+/**
+ * @brief recent time connections waited for a worker
+ *
+ * @return unsigned long - moving average in ns
+ */
+unsigned long pool_queue_wait_ns(void)
+{
+	return atomic_load_explicit(&stats.wait_ns_avg, memory_order_relaxed);
+}
+
+/**
+ * @brief dump pool counters
+ *
+ * @param fp output stream
+ */
+void pool_print_stats(FILE *fp)
+{
+	unsigned long completed = atomic_load(&stats.completed), local = 0, stolen = 0;
+	int n = atomic_load(&nworkers);
+
+	fprintf(fp, "pool: threads %d (min %d, max %d, peak %lu, idle %d, spawned %lu, retired %lu)\n",
+			atomic_load(&stats.threads), config.min_threads, config.max_threads, atomic_load(&stats.threads_max),
+			atomic_load(&stats.idle), atomic_load(&stats.spawned), atomic_load(&stats.retired));
+	fprintf(fp, "pool: submitted %lu, completed %lu, rejected %lu\n",
+			atomic_load(&stats.submitted), completed, atomic_load(&stats.rejected));
+	fprintf(fp, "pool: queue depth %ld (max %lu, capacity %zu)\n",
+			atomic_load(&stats.depth), atomic_load(&stats.depth_max), config.queue_size);
+	fprintf(fp, "pool: queue wait avg %.1f us, recent %.1f us, max %.1f us\n",
+			completed ? atomic_load(&stats.wait_ns_total) / 1e3 / completed : 0.0, pool_queue_wait_ns() / 1e3,
+			atomic_load(&stats.wait_ns_max) / 1e3);
+	fprintf(fp, "pool: run queue lengths");
+	for (int i = 0; i < n; i++)
+	{
+		local += atomic_load(&workers[i].local);
+		stolen += atomic_load(&workers[i].stolen);
+		if (atomic_load(&workers[i].active))
+			fprintf(fp, " %zu", ring_length(&workers[i].ring));
+	}
+	fprintf(fp, "\npool: taken from own queue %lu, stolen %lu (%lu queues scanned)\n", local, stolen, atomic_load(&stats.steal_scans));
+}
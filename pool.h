@@ -0,0 +1,27 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define POOL_DEFAULT_MIN_THREADS 8
+#define POOL_DEFAULT_MAX_THREADS 128
+#define POOL_DEFAULT_QUEUE_SIZE 1024
+#define POOL_IDLE_TIMEOUT 5 // seconds an extra worker may stay idle before it retires
+
+typedef void pool_handler(int fd);
+
+struct pool_config
+{
+	int min_threads, max_threads;
+	size_t queue_size; // rounded up to a power of 2
+	pool_handler *handler;
+};
+
+void pool_start(const struct pool_config *);
+int pool_submit(int fd);
+long pool_queue_depth(void);
+unsigned long pool_queue_wait_ns(void);
+void pool_print_stats(FILE *);
+
+#endif /* __POOL_H__ */
@@ -1,123 +1,316 @@
-#include "csapp.h"
-#include <stdbool.h>
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_HDR_CNT 512
-#define MAX_CONNECTION 32
-
-enum request_error_type
-{
-	REQ_OK,
-	REQ_MALFORMED,
-	REQ_UNIMPLEMENTED
-}; // All cases of errors that may occured parsing request line
-enum header_error_type
-{
-	HDR_OK,
-	HDR_MALFORMED,
-	HDR_UNIMPLEMENTED
-};
-enum entity_error_type
-{
-	ENT_OK,
-	ENT_MALFORMED
-};
-enum client_error_type
-{
-	CLIENT_ERR_400,
-	CLIENT_ERR_500,
-	CLIENT_ERR_501
-}; // All cases of errors that might be sent to client
-struct request_info
-{
-	enum request_error_type err_type;
-	char *method, *host, *port, *abs_path, *http_version;
-};
-struct header_info
-{
-	enum header_error_type err_type;
-	int count;
-	bool has_entity_body;
-	char *(*kvpairs)[2];
-};
-struct entity_info
-{
-	enum entity_error_type err_type;
-	char *data;
-};
-struct cache_line
-{
-	struct request_info req_info;
-	char *content, *type;
-	clock_t timestamp;
-	size_t length;
-	bool used;
-};
-struct cache
-{
-	size_t bytes_left;
-	struct cache_line cache_content[MAX_CONNECTION];
-};
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "pool.h"
+#include "conn.h"
+#include "engine.h"
+#include "admission.h"
+#include "scan.h"
+#include "tunnel.h"
+#include "timer.h"
+#include "upstream.h"
+#include "dns.h"
+#include "race.h"
+#include "collapse.h"
+#include <getopt.h>
+
 typedef void *pthread_func(void *);
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-sem_t sem_cache;
-struct cache g_cache = {.bytes_left = MAX_CACHE_SIZE};
-
-void serve(int clientfd);
-
-struct request_info parse_request(rio_t *);
-struct header_info parse_header(rio_t *);
-struct entity_info parse_entity(rio_t *);
-
-struct request_info convert_client_to_server_request(struct request_info);
-struct header_info convert_client_to_server_header(struct header_info, struct request_info);
+struct cache g_cache = {.bytes_left = MAX_CACHE_SIZE, .shared = true};
+static __thread struct cache *t_cache; // partition of the calling thread, NULL for g_cache
+static const char *engine = "threads";
+int keepalive_ms = KEEPALIVE_TIMEOUT * 1000; // idle time a persistent client connection is kept, 0 disables them
+static int tunnel_idle_ms = TUNNEL_DEFAULT_IDLE_TIMEOUT * 1000;
+int header_timeout_ms = HEADER_TIMEOUT * 1000, request_timeout_ms = REQUEST_TIMEOUT * 1000;
+int first_byte_timeout_ms = FIRST_BYTE_TIMEOUT * 1000, read_timeout_ms = READ_TIMEOUT * 1000;
 
-int send_request(int, struct request_info);
-int send_header(int, struct header_info);
-int send_entity(int, struct entity_info);
+int send_request(int, struct request_info, struct header_info, struct arena *);
+enum entity_error_type send_entity(rio_t *, int, struct header_info);
 
 int connect_to_server(struct request_info);
-int forward_server_to_client(rio_t *, rio_t *, struct request_info);
-int try_cache_server_response(rio_t *, rio_t *, struct request_info);
+static enum client_error_type server_error(void);
+int forward_server_to_client(rio_t *, rio_t *, struct request_info, bool keep_alive, struct arena *, struct collapse_fill **, bool *server_reusable);
+
+struct pending
+{
+	struct http_request http;
+	struct request_info req; // points into the head, left in the client rio_t buffer
+	struct header_info hdr;
+	bool keep_alive, miss_admitted;
+	bool body_pending; // sent to serverfd without its body, which batch_finish streams
+	bool tunnel;	   // CONNECT, serverfd is connected and batch_finish relays bytes both ways
+	bool server_reused; // serverfd came from upstream_take
+	bool server_dirty;	// the server did not take the whole request, serverfd cannot go back to the pool
+	const char *response; // complete response in the arena or static, or NULL if it comes from serverfd or a fill
+	size_t response_len;
+	int serverfd;
+	struct collapse_fill *fill;		   // led by this request until its response shows whether it can be shared
+	struct collapse_follower follower; // of the fill of another request, answering this one if follower.fill is set
+}; // a request of a pipelined batch, answered in order
+static struct
+{
+	atomic_ulong batches, requests, gathered_writes, gathered_responses;
+	atomic_ulong upstream_requests, upstream_writes; // write calls that sent request heads to servers
+	atomic_ulong head_timeouts;						 // clients answered 408, too slow to send a request head
+} pipeline_stats;
 
-int is_request_in_cache(struct request_info);
+static char *read_request(rio_t *, struct http_request *);
+static bool request_start(rio_t *, struct pending *, struct arena *, bool lead);
+static bool request_buffered(rio_t *, struct http_request *);
+static bool batch_finish(rio_t *, struct pending *, int, struct arena *);
+static bool wait_next_request(rio_t *);
 static int is_request_info_equal(struct request_info, struct request_info);
-void evicte(void);
-int forward_cache_to_client(rio_t *, struct request_info req_info);
+static struct request_info copy_request_info(struct request_info);
+static void free_request_info(struct request_info);
+void evicte(struct cache *);
 
-void clienterror(int fd, enum client_error_type);
+pool_handler incoming_connection_handler;
+pthread_func stats_handler;
 
-pthread_func incoming_connection_handler;
+static void usage(const char *prog)
+{
+	fprintf(stderr, "\e[1;031mUsage: %s [options] port\e[0m\n", prog);
+	fprintf(stderr, "      --engine=NAME    threads (default), epoll, io_uring or coro\n");
+	fprintf(stderr, "      --loops=N        event loops of the epoll, io_uring and coro engines (default: online CPUs)\n");
+	fprintf(stderr, "      --per-core       loops share nothing: own SO_REUSEPORT socket and cache partition (implies epoll)\n");
+	fprintf(stderr, "      --pin            pin each loop to its own CPU\n");
+	fprintf(stderr, "  -t, --threads=N      fixed number of worker threads\n");
+	fprintf(stderr, "      --min-threads=N  workers kept alive when idle (default %d)\n", POOL_DEFAULT_MIN_THREADS);
+	fprintf(stderr, "      --max-threads=N  upper bound when autoscaling (default %d)\n", POOL_DEFAULT_MAX_THREADS);
+	fprintf(stderr, "      --queue-size=N   accepted connections waiting for a worker (default %d)\n", POOL_DEFAULT_QUEUE_SIZE);
+	fprintf(stderr, "      --max-clients=N  connections served at once, more get a 503 (default: half the fd limit)\n");
+	fprintf(stderr, "      --max-misses=N   cache misses fetched at once, more get a 503 (default %d)\n", ADMISSION_DEFAULT_MAX_MISSES);
+	fprintf(stderr, "      --max-queue-wait=MS  shed cache misses while connections wait longer for a worker (default %d, 0 = off)\n", ADMISSION_DEFAULT_MAX_QUEUE_WAIT);
+	fprintf(stderr, "      --retry-after=S  Retry-After of the 503 (default %d)\n", ADMISSION_DEFAULT_RETRY_AFTER);
+	fprintf(stderr, "      --keepalive-timeout=S  idle time before a persistent client connection is closed (default %d, 0 = off)\n", KEEPALIVE_TIMEOUT);
+	fprintf(stderr, "      --header-timeout=S  time a client has to send a request head, else 408 (default %d, 0 = off)\n", HEADER_TIMEOUT);
+	fprintf(stderr, "      --request-timeout=S  time a client has to send a whole request (default %d, 0 = off)\n", REQUEST_TIMEOUT);
+	fprintf(stderr, "      --tunnel-timeout=S  idle time before a CONNECT tunnel is closed (default %d)\n", TUNNEL_DEFAULT_IDLE_TIMEOUT);
+	fprintf(stderr, "      --upstream-max-idle=N  idle server connections kept for reuse (default %d, 0 = off)\n", UPSTREAM_DEFAULT_MAX_IDLE);
+	fprintf(stderr, "      --upstream-max-per-host=N  idle connections kept per server host:port (default %d)\n", UPSTREAM_DEFAULT_MAX_PER_HOST);
+	fprintf(stderr, "      --upstream-idle-timeout=S  idle time before a pooled server connection is closed (default %d)\n", UPSTREAM_DEFAULT_IDLE_TIMEOUT);
+	fprintf(stderr, "      --dns-ttl=S      time a resolved server address is reused (default %d, 0 = no cache)\n", DNS_DEFAULT_TTL);
+	fprintf(stderr, "      --dns-negative-ttl=S  time a failed lookup is remembered (default %d)\n", DNS_DEFAULT_NEGATIVE_TTL);
+	fprintf(stderr, "      --dns-refresh-ahead=S  resolve a name in use again this long before it expires (default %d)\n", DNS_DEFAULT_REFRESH_AHEAD);
+	fprintf(stderr, "      --dns-resolvers=N  threads resolving server names (default %d)\n", DNS_DEFAULT_RESOLVERS);
+	fprintf(stderr, "      --connect-timeout=S  time to connect to a server over all its addresses (default %d, 0 = no limit)\n", RACE_DEFAULT_TIMEOUT);
+	fprintf(stderr, "      --connect-stagger=MS  delay before the next server address is tried alongside (default %d)\n", RACE_DEFAULT_STAGGER);
+	fprintf(stderr, "      --first-byte-timeout=S  time a server has to start its response, else 504 (default %d, 0 = off)\n", FIRST_BYTE_TIMEOUT);
+	fprintf(stderr, "      --read-timeout=S  time a server response may stall before it is given up (default %d, 0 = off)\n", READ_TIMEOUT);
+	fprintf(stderr, "      --no-collapse    fetch every cache miss, rather than share the fetch of a request in flight\n");
+	fprintf(stderr, "Send SIGUSR1 to dump statistics to stderr.\n");
+	exit(1);
+}
 
 int main(int argc, char *argv[])
 {
-	int listenfd, connfd;
+	static const struct option long_options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"min-threads", required_argument, NULL, 'm'},
+		{"max-threads", required_argument, NULL, 'M'},
+		{"queue-size", required_argument, NULL, 'q'},
+		{"engine", required_argument, NULL, 'e'},
+		{"loops", required_argument, NULL, 'l'},
+		{"per-core", no_argument, NULL, 'P'},
+		{"pin", no_argument, NULL, 'p'},
+		{"max-clients", required_argument, NULL, 'C'},
+		{"max-misses", required_argument, NULL, 'X'},
+		{"max-queue-wait", required_argument, NULL, 'W'},
+		{"retry-after", required_argument, NULL, 'R'},
+		{"keepalive-timeout", required_argument, NULL, 'K'},
+		{"header-timeout", required_argument, NULL, 'H'},
+		{"request-timeout", required_argument, NULL, 'Q'},
+		{"tunnel-timeout", required_argument, NULL, 'T'},
+		{"upstream-max-idle", required_argument, NULL, 'U'},
+		{"upstream-max-per-host", required_argument, NULL, 'u'},
+		{"upstream-idle-timeout", required_argument, NULL, 'I'},
+		{"dns-ttl", required_argument, NULL, 'D'},
+		{"dns-negative-ttl", required_argument, NULL, 'N'},
+		{"dns-refresh-ahead", required_argument, NULL, 'A'},
+		{"dns-resolvers", required_argument, NULL, 'r'},
+		{"connect-timeout", required_argument, NULL, 'c'},
+		{"connect-stagger", required_argument, NULL, 's'},
+		{"first-byte-timeout", required_argument, NULL, 'F'},
+		{"read-timeout", required_argument, NULL, 'B'},
+		{"no-collapse", no_argument, NULL, 'n'},
+		{NULL, 0, NULL, 0}};
+	struct pool_config pool_cfg = {
+		.min_threads = POOL_DEFAULT_MIN_THREADS,
+		.max_threads = POOL_DEFAULT_MAX_THREADS,
+		.queue_size = POOL_DEFAULT_QUEUE_SIZE,
+		.handler = incoming_connection_handler};
+	struct engine_config engine_cfg = {.nloops = sysconf(_SC_NPROCESSORS_ONLN)};
+	struct admission_config admission_cfg = {
+		.max_misses = ADMISSION_DEFAULT_MAX_MISSES,
+		.max_queue_wait_ms = ADMISSION_DEFAULT_MAX_QUEUE_WAIT,
+		.retry_after = ADMISSION_DEFAULT_RETRY_AFTER};
+	struct upstream_config upstream_cfg = {
+		.max_idle = UPSTREAM_DEFAULT_MAX_IDLE,
+		.max_per_host = UPSTREAM_DEFAULT_MAX_PER_HOST,
+		.idle_timeout_ms = UPSTREAM_DEFAULT_IDLE_TIMEOUT * 1000};
+	struct dns_config dns_cfg = {
+		.ttl_ms = DNS_DEFAULT_TTL * 1000,
+		.negative_ttl_ms = DNS_DEFAULT_NEGATIVE_TTL * 1000,
+		.refresh_ahead_ms = DNS_DEFAULT_REFRESH_AHEAD * 1000,
+		.resolvers = DNS_DEFAULT_RESOLVERS};
+	struct race_config race_cfg = {
+		.stagger_ms = RACE_DEFAULT_STAGGER,
+		.timeout_ms = RACE_DEFAULT_TIMEOUT * 1000};
+	struct collapse_config collapse_cfg = {.enabled = true};
+	int listenfd, connfd, opt;
 	struct sockaddr_storage sockaddr;
 	socklen_t len;
-	pthread_t dummy;
-	if (argc != 2)
+	sigset_t mask;
+	pthread_t tid;
+
+	while ((opt = getopt_long(argc, argv, "t:", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			pool_cfg.min_threads = pool_cfg.max_threads = atoi(optarg);
+			break;
+		case 'm':
+			pool_cfg.min_threads = atoi(optarg);
+			break;
+		case 'M':
+			pool_cfg.max_threads = atoi(optarg);
+			break;
+		case 'q':
+			pool_cfg.queue_size = atoi(optarg);
+			break;
+		case 'e':
+			engine = optarg;
+			break;
+		case 'l':
+			engine_cfg.nloops = atoi(optarg);
+			break;
+		case 'P':
+			engine_cfg.per_core = true;
+			break;
+		case 'p':
+			engine_cfg.pin = true;
+			break;
+		case 'C':
+			admission_cfg.max_clients = atoi(optarg);
+			break;
+		case 'X':
+			admission_cfg.max_misses = atoi(optarg);
+			break;
+		case 'W':
+			admission_cfg.max_queue_wait_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			admission_cfg.retry_after = atoi(optarg);
+			break;
+		case 'K':
+			keepalive_ms = atoi(optarg) * 1000;
+			break;
+		case 'H':
+			header_timeout_ms = atoi(optarg) * 1000;
+			break;
+		case 'Q':
+			request_timeout_ms = atoi(optarg) * 1000;
+			break;
+		case 'T':
+			tunnel_idle_ms = atoi(optarg) * 1000;
+			break;
+		case 'U':
+			upstream_cfg.max_idle = atoi(optarg);
+			break;
+		case 'u':
+			upstream_cfg.max_per_host = atoi(optarg);
+			break;
+		case 'I':
+			upstream_cfg.idle_timeout_ms = atoi(optarg) * 1000;
+			break;
+		case 'D':
+			dns_cfg.ttl_ms = atoi(optarg) * 1000;
+			break;
+		case 'N':
+			dns_cfg.negative_ttl_ms = atoi(optarg) * 1000;
+			break;
+		case 'A':
+			dns_cfg.refresh_ahead_ms = atoi(optarg) * 1000;
+			break;
+		case 'r':
+			dns_cfg.resolvers = atoi(optarg);
+			break;
+		case 'c':
+			race_cfg.timeout_ms = atoi(optarg) * 1000;
+			break;
+		case 's':
+			race_cfg.stagger_ms = atoi(optarg);
+			break;
+		case 'F':
+			first_byte_timeout_ms = atoi(optarg) * 1000;
+			break;
+		case 'B':
+			read_timeout_ms = atoi(optarg) * 1000;
+			break;
+		case 'n':
+			collapse_cfg.enabled = false;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	if (strcmp(engine, "threads") != 0 && strcmp(engine, "epoll") != 0 && strcmp(engine, "io_uring") != 0 && strcmp(engine, "coro") != 0)
+		usage(argv[0]);
+	if (engine_cfg.nloops < 1 || engine_cfg.nloops > ENGINE_MAX_LOOPS)
+		usage(argv[0]);
+	if (engine_cfg.per_core && strcmp(engine, "threads") == 0) // a blocking thread per core would stall on one slow client
+		engine = "epoll";
+
+	Signal(SIGPIPE, SIG_IGN); // a client hanging up must not kill the proxy
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGUSR1);
+	Sigprocmask(SIG_BLOCK, &mask, NULL); // inherited by every thread, only stats_handler takes it
+	Pthread_create(&tid, NULL, stats_handler, NULL);
+
+	Sem_init(&g_cache.sem, 0, 1);
+	if (strcmp(engine, "threads") == 0) // only the pool queues connections
+		admission_cfg.queue_wait_ns = pool_queue_wait_ns;
+	admission_init(&admission_cfg);
+	upstream_init(&upstream_cfg);
+	dns_init(&dns_cfg);
+	race_init(&race_cfg);
+	collapse_init(&collapse_cfg);
+	if (strcmp(engine, "threads") != 0)
 	{
-		fprintf(stderr, "\e[1;031mUsage: %s port\n", argv[0]);
-		exit(1);
+		engine_cfg.listenfds = Calloc(engine_cfg.nloops, sizeof(int));
+		for (int i = 0; i < (engine_cfg.per_core ? engine_cfg.nloops : 1); i++)
+			engine_cfg.listenfds[i] = engine_cfg.per_core ? Open_listenfd_reuseport(argv[optind]) : Open_listenfd(argv[optind]);
+		if (strcmp(engine, "io_uring") == 0 && uring_engine_run(&engine_cfg) < 0)
+		{
+			fprintf(stderr, "falling back to the epoll engine\n");
+			engine = "epoll";
+		}
+		if (strcmp(engine, "coro") == 0)
+			coro_engine_run(&engine_cfg);
+		epoll_engine_run(&engine_cfg);
 	}
-	listenfd = Open_listenfd(argv[1]);
-	Sem_init(&sem_cache, 0, 1);
+	listenfd = Open_listenfd(argv[optind]);
+	pool_start(&pool_cfg);
 	while (1)
 	{
-		connfd = Accept(listenfd, (SA *)&sockaddr, &len);
-		Pthread_create(&dummy, (pthread_attr_t *)NULL, incoming_connection_handler, (void *)(long long)connfd);
-#if 0
-		if(fork() == 0)
+		len = sizeof(sockaddr);
+		if ((connfd = accept(listenfd, (SA *)&sockaddr, &len)) < 0)
+			continue; // EMFILE or an aborted handshake, keep accepting
+		if (!admission_accept())
 		{
-			serve(connfd);
+			admission_reject(connfd);
+			Close(connfd);
+		}
+		else if (pool_submit(connfd) != 0) // every worker busy and queue full
+		{
+			admission_reject(connfd);
+			admission_release();
 			Close(connfd);
-			exit(0);
 		}
-#endif
 	}
 	printf("%s", user_agent_hdr);
 	return 0;
@@ -126,481 +319,1225 @@ int main(int argc, char *argv[])
 /**
  * @brief serve the given client until it is finished.
  *
+ * Requests the client pipelined are answered as a batch: every complete
+ * request already buffered is parsed and its upstream request sent before
+ * the first response is written, so origins work on them concurrently.
+ * Responses go back in request order, and runs of ready ones (cache hits,
+ * errors) leave with one gathered write. What a batch allocates comes from
+ * an arena that is reset once its responses are written. A CONNECT ends the
+ * batch and turns the connection into a tunnel after the responses before it.
+ *
+ * A cache miss for a request some other client is fetching follows that
+ * fill (collapse.h). Only the first request of a batch may lead one: it is
+ * relayed first, so a leader never waits for a fill behind its followers.
+ *
+ * The heads of a batch have to arrive within the header timeout and its
+ * bodies within the request timeout, both counted from when the client
+ * connected or, on a persistent connection, from its first byte after an
+ * idle wait. Reads past the deadline fail, so a slow client cannot hold on
+ * to a worker or coroutine.
+ *
  * @param clientfd the file descriptor of client
  */
 void serve(int clientfd)
 {
-	struct request_info client_req_info, server_req_info;
-	struct header_info client_hdr_info, server_hdr_info;
-	struct entity_info ent_info;
-	int serverfd;
-	rio_t rio_client, rio_server;
+	struct pending batch[PIPELINE_MAX];
+	struct arena arena;
+	rio_t rio_client;
+	bool keep_alive, more;
+	uint64_t start;
+	int n;
 
 	rio_readinitb(&rio_client, clientfd);
-	client_req_info = parse_request(&rio_client);
-	switch (client_req_info.err_type)
+	arena_init(&arena);
+	do
 	{
-	case REQ_OK:
-		break;
+		start = timer_now_ms();
+		rio_client.rio_deadline = timer_min(timer_after(start, header_timeout_ms), timer_after(start, request_timeout_ms));
+		n = 0;
+		http_request_init(&batch[0].http);
+		do
+			more = request_start(&rio_client, &batch[n], &arena, n == 0);
+		while (++n < PIPELINE_MAX && more && request_buffered(&rio_client, &batch[n].http));
+		if (n > 1)
+		{
+			atomic_fetch_add_explicit(&pipeline_stats.batches, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&pipeline_stats.requests, n, memory_order_relaxed);
+		}
+		rio_client.rio_deadline = timer_after(start, request_timeout_ms); // for the bodies
+		keep_alive = batch_finish(&rio_client, batch, n, &arena);
+		rio_client.rio_deadline = 0;
+		arena_reset(&arena, n);
+	} while (keep_alive && wait_next_request(&rio_client));
+}
 
-	case REQ_MALFORMED:
-		clienterror(clientfd, CLIENT_ERR_400);
-		goto end;
+/**
+ * @brief return true if a complete request head is already buffered in rio
+ *
+ * Reading more would move the buffer under the heads of the batch, so only
+ * a head that parses to its end without a read joins it.
+ *
+ * @param rio client rio_t
+ * @param http parser state of the next request, parsed over the buffered bytes
+ * @return bool
+ */
+static bool request_buffered(rio_t *rio, struct http_request *http)
+{
+	http_request_init(http);
+	return rio->rio_cnt > 0 && http_parse(http, rio->rio_bufptr, rio->rio_cnt) == HTTP_PARSE_DONE;
+}
 
-	case REQ_UNIMPLEMENTED:
-		clienterror(clientfd, CLIENT_ERR_501);
-		goto end;
+/**
+ * @brief wait for the next request of a persistent connection
+ *
+ * @param rio_client client rio_t
+ * @return bool - true if a request (or EOF) arrived before the idle timeout
+ */
+static bool wait_next_request(rio_t *rio_client)
+{
+	int slice = keepalive_ms, rc;
 
-	default:
-		clienterror(clientfd, CLIENT_ERR_500);
-		goto end;
+	if (strcmp(engine, "threads") == 0) // an idle connection holds a worker, give it up when others queue
+		slice = KEEPALIVE_POLL_MS;
+	for (int waited = 0; waited < keepalive_ms; waited += slice)
+	{
+		if ((rc = rio_waitreadable(rio_client, slice < keepalive_ms - waited ? slice : keepalive_ms - waited)) != 0)
+			return rc > 0;
+		if (strcmp(engine, "threads") == 0 && pool_queue_depth() > 0)
+			return false;
 	}
-	if(is_request_in_cache(client_req_info))
+	return false;
+}
+
+/**
+ * @brief decide whether the client connection persists after this request
+ *
+ * @param req client request line
+ * @param hdr client headers
+ * @return bool
+ */
+bool client_keep_alive(struct request_info req, struct header_info hdr)
+{
+	bool keep_alive = strcasecmp(req.http_version, "HTTP/1.1") == 0; // HTTP/1.0 persists only if asked to
+
+	if (keepalive_ms <= 0)
+		return false;
+	for (int i = 0; i < hdr.count; i++)
+	{
+		const struct http_field *f = &hdr.fields[i];
+
+		switch (f->id)
+		{
+		case HTTP_HDR_CONNECTION:
+		case HTTP_HDR_PROXY_CONNECTION:
+			if (http_field_has_token(hdr.head, f, "close"))
+				return false;
+			if (http_field_has_token(hdr.head, f, "keep-alive"))
+				keep_alive = true;
+			break;
+		default:
+			break;
+		}
+	}
+	return keep_alive;
+}
+
+/**
+ * @brief queue a complete response for p, written in order by batch_finish
+ *
+ * @param p pending request
+ * @param buf response, in the arena of the batch or static
+ * @param len length of buf
+ */
+static void request_reply(struct pending *p, const char *buf, size_t len)
+{
+	p->response = buf;
+	p->response_len = len;
+}
+
+static void request_reply_error(struct pending *p, enum client_error_type err_type)
+{
+	const char *msg = client_error_message(err_type);
+
+	request_reply(p, msg, strlen(msg));
+	p->keep_alive = false;
+}
+
+/**
+ * @brief read the next request head into the rio_t buffer and parse it there
+ *
+ * A head cut short by a read stays put while more is appended by rio_fill,
+ * so it is scanned once however it arrives. It must fit in the buffer.
+ *
+ * @param rio client rio_t, consumed up to the end of the head if it parsed
+ * @param http parser state, initialized or parsed over the buffered bytes already; the result
+ * @return char* - the head, valid until the next read from rio; NULL if the deadline of rio passed first
+ */
+static char *read_request(rio_t *rio, struct http_request *http)
+{
+	char *head;
+	ssize_t n;
+
+	while (http_parse(http, rio->rio_bufptr, rio->rio_cnt) == HTTP_PARSE_AGAIN)
 	{
-		client_hdr_info = parse_header(&rio_client);
-		forward_cache_to_client(&rio_client, client_req_info);
-		goto end;
+		if ((n = rio_fill(rio)) < 0 && errno == ETIMEDOUT)
+			return NULL;
+		if (n <= 0)
+			break;
 	}
-	if ((serverfd = connect_to_server(client_req_info)) == -1)
+	head = rio->rio_bufptr;
+	if (http->state == HTTP_STATE_DONE)
 	{
-		goto end;
+		rio->rio_bufptr += http->head_len;
+		rio->rio_cnt -= http->head_len;
 	}
-	server_req_info = convert_client_to_server_request(client_req_info);
-	rio_readinitb(&rio_server, serverfd);
-	if (send_request(serverfd, server_req_info))
+	return head;
+}
+
+/**
+ * @brief send the request head of p to its server, on an idle pooled connection if there is one
+ *
+ * A pooled connection the server closed since the liveness check of
+ * upstream_take fails the write, and the head goes out on a fresh one. If
+ * it fails later, before the response, batch_finish sends it again.
+ *
+ * @param p pending request
+ * @param arena of the batch
+ * @param fresh do not take a pooled connection
+ * @return int - 0 on success, -1 if the server could not be reached; p->serverfd is closed by request_free
+ */
+static int server_send(struct pending *p, struct arena *arena, bool fresh)
+{
+	struct request_info server_req_info = convert_client_to_server_request(p->req);
+
+	if (!fresh && (p->serverfd = upstream_take(p->req.host, p->req.port)) >= 0)
 	{
-		goto end;
+		if (send_request(p->serverfd, server_req_info, p->hdr, arena) == 0)
+		{
+			p->server_reused = true;
+			return 0;
+		}
+		upstream_discard(p->serverfd);
 	}
-	client_hdr_info = parse_header(&rio_client);
-	switch (client_hdr_info.err_type)
+	p->server_reused = false;
+	if ((p->serverfd = connect_to_server(p->req)) < 0)
+	{
+		p->serverfd = -1;
+		return -1;
+	}
+	return send_request(p->serverfd, server_req_info, p->hdr, arena);
+}
+
+/**
+ * @brief end the fill p leads, if any, without a response to share; its followers fetch on their own
+ *
+ * @param p pending request
+ */
+static void request_unlead(struct pending *p)
+{
+	if (p->fill)
+	{
+		collapse_end(p->fill, false);
+		p->fill = NULL;
+	}
+}
+
+/**
+ * @brief read one request and start answering it: look it up in cache, or send it to server
+ *
+ * @param rio_client client rio_t
+ * @param p with http initialized or parsed by request_buffered; filled with the request and either its response, the server it was sent to or the fill it follows
+ * @param arena of the batch, holds what p needs until its response is written
+ * @param lead whether a cache miss may lead a fill
+ * @return bool - true if the connection may carry another request after this one
+ */
+static bool request_start(rio_t *rio_client, struct pending *p, struct arena *arena, bool lead)
+{
+	const char *buf;
+	char *head;
+	size_t len;
+	bool cacheable;
+
+	p->keep_alive = p->miss_admitted = p->body_pending = p->tunnel = p->server_reused = p->server_dirty = false;
+	p->response = NULL;
+	p->serverfd = -1;
+	p->fill = NULL;
+	p->follower.fill = NULL;
+	if ((head = read_request(rio_client, &p->http)) == NULL) // slow, or holding the connection on purpose
+	{
+		atomic_fetch_add_explicit(&pipeline_stats.head_timeouts, 1, memory_order_relaxed);
+		request_reply_error(p, CLIENT_ERR_408);
+		return false;
+	}
+	p->req = parse_request(&p->http, head);
+	switch (p->req.err_type)
 	{
 	case REQ_OK:
 		break;
 
 	case REQ_MALFORMED:
-		clienterror(clientfd, CLIENT_ERR_400);
-		goto end;
+		request_reply_error(p, CLIENT_ERR_400);
+		return false;
 
 	case REQ_UNIMPLEMENTED:
-		clienterror(clientfd, CLIENT_ERR_501);
-		goto end;
+		request_reply_error(p, CLIENT_ERR_501);
+		return false;
 
 	default:
-		clienterror(clientfd, CLIENT_ERR_500);
-		goto end;
+		request_reply_error(p, CLIENT_ERR_500);
+		return false;
 	}
-	server_hdr_info = convert_client_to_server_header(client_hdr_info, client_req_info);
-	send_header(serverfd, server_hdr_info);
-
-	if (client_hdr_info.has_entity_body)
+	p->hdr = parse_header(&p->http, head);
+	switch (p->hdr.err_type)
 	{
-		goto end;
-	}
+	case HDR_OK:
+		break;
 
-	ent_info = parse_entity(&rio_client);
-	switch (ent_info.err_type)
-	{
-	case ENT_MALFORMED:
-		clienterror(clientfd, CLIENT_ERR_400);
-		goto end;
+	case HDR_MALFORMED:
+		request_reply_error(p, CLIENT_ERR_400);
+		return false;
 
-	case ENT_OK:
-		break;
+	case HDR_UNIMPLEMENTED:
+		request_reply_error(p, CLIENT_ERR_501);
+		return false;
 
 	default:
-		clienterror(clientfd, CLIENT_ERR_500);
-		goto end;
+		request_reply_error(p, CLIENT_ERR_500);
+		return false;
 	}
-	send_entity(serverfd, ent_info);
-	forward_server_to_client(&rio_server, &rio_client, client_req_info);
-
-end:
-	return;
+	if (strcmp(p->req.method, "CONNECT") == 0) // not a cache miss, it takes no admission_miss_begin slot
+	{
+		if ((p->serverfd = connect_to_server(p->req)) < 0)
+		{
+			p->serverfd = -1;
+			request_reply_error(p, server_error());
+			return false;
+		}
+		p->tunnel = true;
+		return false;
+	}
+	p->keep_alive = client_keep_alive(p->req, p->hdr);
+	cacheable = is_request_cacheable(p->req, p->hdr);
+	if (cacheable && (buf = cache_build_response(p->req, p->keep_alive, arena, &len)) != NULL) // cache hit
+	{
+		request_reply(p, buf, len);
+		return p->keep_alive;
+	}
+	if (cacheable && collapse_join(p->req, p->keep_alive, lead, &p->fill, &p->follower) == COLLAPSE_FOLLOWER) // answered by batch_finish
+		return p->keep_alive;
+	if (!(p->miss_admitted = admission_miss_begin())) // overloaded, only cache hits are served
+	{
+		request_unlead(p);
+		buf = admission_response(&len);
+		request_reply(p, buf, len);
+		p->keep_alive = false;
+		return false;
+	}
+	if (server_send(p, arena, p->hdr.has_entity_body) != 0) // a body could not be sent again, it gets a fresh connection
+	{
+		request_unlead(p);
+		request_reply_error(p, server_error());
+		return false; // the body, if any, is still unread
+	}
+	if (p->hdr.has_entity_body) // ends the batch, reading the body moves the heads in the rio_t buffer
+	{
+		p->req.method = arena_strndup(arena, p->req.method, strlen(p->req.method));
+		p->req.abs_path = arena_strndup(arena, p->req.abs_path, strlen(p->req.abs_path));
+		p->req.http_version = arena_strndup(arena, p->req.http_version, strlen(p->req.http_version));
+		p->body_pending = true;
+		return false;
+	}
+	return p->keep_alive;
 }
 
 /**
- * @brief read and parse request line from the given rio_t
+ * @brief stream the body of p to its server once the responses before it are written
  *
- * @param rio initialized rio_t of the file descriptor
- * @return struct request_info - details of request line
+ * A client that expects 100-continue gets it from the proxy, the Expect
+ * field is not forwarded.
+ *
+ * @param rio_client client rio_t
+ * @param p pending request with body_pending set
+ * @return bool - true if the response of the server is to be relayed
  */
-struct request_info parse_request(rio_t *rio)
+static bool request_body(rio_t *rio_client, struct pending *p)
 {
-	struct request_info ret;
-	char str[MAXLINE], method[MAXLINE], uri[MAXLINE], http_version[MAXLINE], host[MAXLINE], port[MAXLINE], path[MAXLINE], *pos;
-	int read_cnt;
+	static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+	const char *msg;
 
-	if (rio_readlineb(rio, str, MAXLINE) == 0)
+	if (p->hdr.expect_continue && strcasecmp(p->req.http_version, "HTTP/1.1") == 0 &&
+		rio_writen(rio_client->rio_fd, (void *)continue_line, sizeof(continue_line) - 1) < 0)
 	{
-		ret.err_type = REQ_MALFORMED;
-		goto end;
+		p->keep_alive = false;
+		return false;
 	}
-	/* Parse request line into 3 parts roughly */
-	if (sscanf(str, "%s%s%s %n", method, uri, http_version, &read_cnt) < 3 || read_cnt != strlen(str))
+	switch (send_entity(rio_client, p->serverfd, p->hdr))
 	{
-		ret.err_type = REQ_MALFORMED;
-		goto end;
-	}
+	case ENT_OK:
+		return true;
 
-#ifndef SUPPORT_POST
-	if (strcmp(method, "POST") == 0)
-	{
-		ret.err_type = REQ_UNIMPLEMENTED;
-		goto end;
+	case ENT_MALFORMED:
+		msg = client_error_message(CLIENT_ERR_400);
+		rio_writen(rio_client->rio_fd, (void *)msg, strlen(msg));
+		p->keep_alive = false;
+		return false;
+
+	case ENT_UNSENT: // whatever the server answered before it stopped reading
+		p->keep_alive = false;
+		p->server_dirty = true;
+		return true;
+
+	case ENT_INCOMPLETE:
+	default:
+		p->keep_alive = false;
+		return false;
 	}
-#endif
+}
 
-	/* parse uri part */
-	for (size_t i = 0, len = strlen(uri); i < len; i++) // convert all capital to lowercase
-		uri[i] = tolower(uri[i]);
-	if ((sscanf(uri, "http://%[^:/]%n", host, &read_cnt)) < 1) // read leading scheme and host
+/**
+ * @brief relay the response of p from a fresh connection, the pooled one it went to closed without answering
+ *
+ * Requests with a body never went to a pooled connection; the head of the
+ * others is still in the client rio_t buffer.
+ *
+ * @param rio_client client rio_t
+ * @param p pending request, sent on a pooled connection
+ * @param rio_server server rio_t
+ * @param arena of the batch
+ * @param server_reusable as for forward_server_to_client
+ * @return int - as forward_server_to_client
+ */
+static int request_retry(rio_t *rio_client, struct pending *p, rio_t *rio_server, struct arena *arena, bool *server_reusable)
+{
+	upstream_discard(p->serverfd);
+	if (server_send(p, arena, true) != 0)
 	{
-		ret.err_type = REQ_MALFORMED;
-		goto end;
+		clienterror(rio_client->rio_fd, server_error());
+		return -1;
 	}
-	pos = uri + read_cnt;	  // update position pointer
-	if (uri[read_cnt] == ':') // if port is specified, parse port
+	rio_readinitb(rio_server, p->serverfd);
+	return forward_server_to_client(rio_server, rio_client, p->req, p->keep_alive, arena, &p->fill, server_reusable);
+}
+
+/**
+ * @brief answer p from the fill it follows, or like any cache miss if the fill ends with nothing to share
+ *
+ * @param rio_client client rio_t
+ * @param p pending request following a fill
+ * @param rio_server server rio_t, for a miss
+ * @param arena of the batch
+ * @param server_reusable as for forward_server_to_client
+ * @return int - as forward_server_to_client
+ */
+static int request_follow(rio_t *rio_client, struct pending *p, rio_t *rio_server, struct arena *arena, bool *server_reusable)
+{
+	struct pollfd pfd = {.fd = p->follower.efd, .events = POLLIN};
+	char buf[MAXLINE];
+	const char *msg;
+	size_t len;
+	ssize_t n;
+
+	*server_reusable = false;
+	while ((n = collapse_read(&p->follower, buf, sizeof(buf))) != 0)
 	{
-		sscanf(pos, ":%[^/]%n", port, &read_cnt);
-		pos += read_cnt; // update position
+		if (n == COLLAPSE_PENDING && rio_poll(&pfd, 1, -1) >= 0)
+			continue;
+		if (n < 0)
+			break;
+		if (rio_writen(rio_client->rio_fd, buf, n) != n)
+		{
+			n = -1;
+			break;
+		}
 	}
-	else // else use default port 80
+	collapse_leave(&p->follower);
+	if (n != COLLAPSE_FALLBACK)
+		return n == 0 && p->keep_alive ? 0 : -1;
+	if (!(p->miss_admitted = admission_miss_begin()))
 	{
-		strcpy(port, "80");
+		msg = admission_response(&len);
+		rio_writen(rio_client->rio_fd, (void *)msg, len);
+		return -1;
 	}
-	if (sscanf(pos, "%s", path) < 1) // read path
+	if (server_send(p, arena, false) != 0)
 	{
-		ret.err_type = REQ_MALFORMED;
-		goto end;
+		clienterror(rio_client->rio_fd, server_error());
+		return -1;
 	}
+	rio_readinitb(rio_server, p->serverfd);
+	return forward_server_to_client(rio_server, rio_client, p->req, p->keep_alive, arena, &p->fill, server_reusable);
+}
 
-	/* construct the return struct */
-	ret.err_type = REQ_OK;
-	ret.method = strdup(method);
-	ret.host = strdup(host);
-	ret.port = strdup(port);
-	ret.abs_path = strdup(path);
-	ret.http_version = strdup(http_version);
-
-end:
-	return ret;
+static void request_free(struct pending *p)
+{
+	request_unlead(p);
+	collapse_leave(&p->follower);
+	if (p->serverfd >= 0)
+		Close(p->serverfd);
+	if (p->miss_admitted)
+		admission_miss_end();
 }
 
 /**
- * @brief read and parse all headers from the given rio_t
+ * @brief write the responses of a batch in request order
  *
- * @param rio initialized rio_t of the file descriptor
- * @return struct header_info - details of request line
+ * @param rio_client client rio_t
+ * @param batch requests started by request_start
+ * @param n number of requests in batch
+ * @param arena of the batch
+ * @return bool - true if the connection may serve another request
  */
-struct header_info parse_header(rio_t *rio)
+static bool batch_finish(rio_t *rio_client, struct pending *batch, int n, struct arena *arena)
 {
-	struct header_info ret;
-	char buf[MAXLINE], key[MAXLINE], val[MAXLINE], *(kvpairs[MAX_HDR_CNT])[2];
-	int readcnt;
+	static const char tunnel_established[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+	struct iovec iov[PIPELINE_MAX];
+	rio_t *rio_server = NULL;
+	bool keep_alive = true, server_reusable;
+	int i, start, niov, rc;
 
-	ret.count = 0;
-	while (rio_readlineb(rio, buf, MAXLINE))
+	for (i = 0; i < n && keep_alive; i = start)
 	{
-		if (strcmp(buf, "\r\n") == 0)
+		for (start = i, niov = 0; start < n && batch[start].response && keep_alive; start++) // ready responses
+		{
+			iov[niov].iov_base = (void *)batch[start].response;
+			iov[niov++].iov_len = batch[start].response_len;
+			keep_alive = batch[start].keep_alive;
+		}
+		if (niov > 0)
+		{
+			if (niov > 1)
+			{
+				atomic_fetch_add_explicit(&pipeline_stats.gathered_writes, 1, memory_order_relaxed);
+				atomic_fetch_add_explicit(&pipeline_stats.gathered_responses, niov, memory_order_relaxed);
+			}
+			if (rio_writev(rio_client->rio_fd, iov, niov) < 0)
+				keep_alive = false;
+			continue;
+		}
+		if (rio_server == NULL)
+			rio_server = arena_alloc(arena, sizeof(*rio_server)); // off the stack, which coroutines keep small
+		if (batch[start].tunnel)
+		{
+			if (rio_writen(rio_client->rio_fd, (void *)tunnel_established, sizeof(tunnel_established) - 1) >= 0)
+				tunnel_run(rio_client, batch[start].serverfd, tunnel_idle_ms);
+			keep_alive = false;
 			break;
-		if (sscanf(buf, "%[^:]: %s %n", key, val, &readcnt) < 2 || readcnt != strlen(buf))
+		}
+		if (batch[start].body_pending && !request_body(rio_client, &batch[start]))
 		{
-			ret.err_type = HDR_MALFORMED;
-			goto end;
+			keep_alive = false;
+			break;
 		}
-		kvpairs[ret.count][0] = strdup(key);
-		kvpairs[ret.count][1] = strdup(val);
-		ret.count++;
-	}
-	ret.err_type = HDR_OK;
-	ret.has_entity_body = false;
-	if (ret.count)
-	{
-		ret.kvpairs = Malloc(sizeof(*ret.kvpairs) * --ret.count);
-		memcpy(ret.kvpairs, kvpairs, sizeof(*ret.kvpairs) * ret.count);
-		for (int i = 0; i < ret.count; i++)
+		if (batch[start].follower.fill)
+			rc = request_follow(rio_client, &batch[start], rio_server, arena, &server_reusable);
+		else
 		{
-			ret.kvpairs[i][0] = strdup(kvpairs[i][0]);
-			ret.kvpairs[i][1] = strdup(kvpairs[i][1]);
+			rio_readinitb(rio_server, batch[start].serverfd);
+			rc = forward_server_to_client(rio_server, rio_client, batch[start].req, batch[start].keep_alive, arena, &batch[start].fill, &server_reusable);
 		}
+		if (rc == -2 && batch[start].server_reused)
+			rc = request_retry(rio_client, &batch[start], rio_server, arena, &server_reusable);
+		request_unlead(&batch[start]); // its response did not get that far
+		if (server_reusable && !batch[start].server_dirty)
+		{
+			upstream_put(batch[start].req.host, batch[start].req.port, batch[start].serverfd);
+			batch[start].serverfd = -1;
+		}
+		keep_alive = rc == 0;
+		start++;
 	}
-	else
-	{
-		ret.kvpairs = NULL;
-	}
-
-end:
-	return ret;
+	for (i = 0; i < n; i++)
+		request_free(&batch[i]);
+	return keep_alive;
 }
 
-struct entity_info parse_entity(rio_t *rio)
-{
-	struct entity_info ret;
-	ret.err_type = ENT_OK;
-	return ret;
-}
 /**
  * @brief convert client request line struct to server request line struct
  *
  * @param in client request line
- * @return struct request_info - server request line, can be directly passed to send_request
+ * @return struct request_info - server request line sharing the strings of in, can be directly passed to send_request
  */
 struct request_info convert_client_to_server_request(struct request_info in)
 {
 	struct request_info ret;
 
 	ret.err_type = in.err_type;
-	ret.method = strdup(in.method);
-	ret.host = NULL;
-	ret.port = NULL;
-	ret.abs_path = strdup(in.abs_path);
-	ret.http_version = strdup(in.http_version);
+	ret.method = in.method;
+	ret.host = in.host; // for the Host field
+	ret.port = in.port;
+	ret.abs_path = in.abs_path;
+	ret.http_version = in.http_version;
 
 	return ret;
 }
 
 /**
- * @brief convert client header struct to server header struct
+ * @brief lay out the request head for server: the request line and the fields the proxy sets, then every other client field as received
+ *
+ * Host, User-Agent, Connection and Proxy-Connection are replaced, asking the
+ * server to keep the connection open when it can be pooled; the other
+ * fields are not copied but referenced in runs of consecutive lines of the
+ * client head. A line ending in a bare LF gets a CRLF.
  *
- * @param in client header
- * @param req_info client request line
- * @return struct header_info - server header_info, can be directly passed to send_header
+ * @param req server request line
+ * @param hdr client headers
+ * @param arena holds the replaced part and the iovec array
+ * @param iov set to the buffers to write in order
+ * @return int - number of buffers
  */
-struct header_info convert_client_to_server_header(struct header_info in, struct request_info req_info)
+int build_request(struct request_info req, struct header_info hdr, struct arena *arena, struct iovec **iov)
 {
-	struct header_info ret;
+	static const char user_agent[] = "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
+	size_t size = strlen(req.method) + strlen(req.abs_path) + strlen(req.http_version) + strlen(req.host) + sizeof(user_agent) + 128;
+	const char *run = NULL, *end = NULL;
+	char *buf, *pos;
+	int n = 0;
 
-	ret.err_type = in.err_type;
-	ret.count = in.count + 4; // add 4 additional header first, and subtract them if needed.
-	ret.has_entity_body = in.has_entity_body;
-
-	ret.kvpairs = Malloc((in.count + 4) * sizeof(*ret.kvpairs));
-
-	ret.kvpairs[0][0] = strdup("Host");
-	ret.kvpairs[0][1] = strdup(req_info.host);
-	ret.kvpairs[1][0] = strdup("User-Agent");
-	ret.kvpairs[1][1] = strdup("Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3");
-	ret.kvpairs[2][0] = strdup("Connection");
-	ret.kvpairs[2][1] = strdup("close");
-	ret.kvpairs[3][0] = strdup("Proxy-Connection");
-	ret.kvpairs[3][1] = strdup("close");
-	for (int i = 0, j = 4; i < in.count; i++)
-	{
-		if (strcmp(in.kvpairs[i][0], "Host") == 0)
-		{
-			ret.count--;
-			continue;
-		}
-		else if (strcmp(in.kvpairs[i][0], "User-Agent") == 0)
-		{
-			ret.count--;
-			continue;
-		}
-		else if (strcmp(in.kvpairs[i][0], "Connection") == 0)
-		{
-			ret.count--;
-			continue;
-		}
-		else if (strcmp(in.kvpairs[i][0], "Proxy-Connection") == 0)
+	*iov = arena_alloc(arena, (2 * hdr.count + 2) * sizeof(**iov));
+	pos = buf = arena_alloc(arena, size);
+	pos += sprintf(pos, "%s %s %s\r\nHost: %s\r\nUser-Agent: %s\r\n%s",
+				   req.method, req.abs_path, req.http_version, req.host, user_agent,
+				   upstream_enabled() ? "Connection: keep-alive\r\n" : "Connection: close\r\nProxy-Connection: close\r\n");
+	(*iov)[n++] = (struct iovec){.iov_base = buf, .iov_len = pos - buf};
+	for (int i = 0; i < hdr.count; i++)
+	{
+		const struct http_field *f = &hdr.fields[i];
+
+		switch (f->id)
 		{
-			ret.count--;
+		case HTTP_HDR_HOST: // replaced above
+		case HTTP_HDR_USER_AGENT:
+		case HTTP_HDR_CONNECTION:
+		case HTTP_HDR_PROXY_CONNECTION:
+		case HTTP_HDR_EXPECT: // 100-continue is answered by the proxy, see request_body
+			if (run)
+				(*iov)[n++] = (struct iovec){.iov_base = (void *)run, .iov_len = end - run};
+			run = NULL;
 			continue;
+		default:
+			break;
 		}
-		else
+		if (run == NULL)
+			run = hdr.head + f->name.off;
+		end = hdr.head + f->end;
+		if (end[-2] != '\r')
 		{
-			ret.kvpairs[j][0] = strdup(in.kvpairs[i][0]);
-			ret.kvpairs[j][1] = strdup(in.kvpairs[i][1]);
-			j++;
+			(*iov)[n++] = (struct iovec){.iov_base = (void *)run, .iov_len = end - 1 - run};
+			(*iov)[n++] = (struct iovec){.iov_base = "\r\n", .iov_len = 2};
+			run = NULL;
 		}
 	}
-
-	return ret;
+	if (run)
+		(*iov)[n++] = (struct iovec){.iov_base = (void *)run, .iov_len = end - run};
+	(*iov)[n++] = (struct iovec){.iov_base = "\r\n", .iov_len = 2};
+	return n;
 }
 
 /**
- * @brief send request line to server
+ * @brief send the request head to server with one gathered write
  *
  * @param fd server fd
- * @param in server request_info
+ * @param req server request line
+ * @param hdr client headers
+ * @param arena holds what build_request lays out
  * @return int - state
  */
-int send_request(int fd, struct request_info in)
+int send_request(int fd, struct request_info req, struct header_info hdr, struct arena *arena)
 {
-	dprintf(fd, "%s %s %s\r\n", in.method, in.abs_path, in.http_version);
-	return 0;
+	unsigned long nwrites = rio_nwrites;
+	struct iovec *iov;
+	int niov = build_request(req, hdr, arena, &iov);
+	int rc = rio_writev(fd, iov, niov) < 0 ? -1 : 0; // it may wait on a non-blocking fd
+
+	atomic_fetch_add_explicit(&pipeline_stats.upstream_requests, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pipeline_stats.upstream_writes, rio_nwrites - nwrites, memory_order_relaxed);
+	return rc;
 }
 
 /**
- * @brief send headers to server
+ * @brief stream a request body from client to server as it arrives, framing included
+ *
+ * Content-Length bodies and the data of large chunks are spliced; chunked
+ * framing is checked on the way and ends the body.
  *
+ * @param rio_client client rio_t, positioned at the start of the body
  * @param fd server fd
- * @param in server request_info
- * @return int - state
+ * @param hdr client headers, giving the framing
+ * @return enum entity_error_type
  */
-int send_header(int fd, struct header_info in)
+enum entity_error_type send_entity(rio_t *rio_client, int fd, struct header_info hdr)
 {
-	for (int i = 0; i < in.count; i++)
-		dprintf(fd, "%s: %s\r\n", in.kvpairs[i][0], in.kvpairs[i][1]);
-	dprintf(fd, "\r\n");
-	return 0;
+	struct http_chunked chunked;
+	ssize_t n;
+
+	if (!hdr.chunked)
+	{
+		n = rio_splicen(rio_client, fd, hdr.content_length);
+		return n == hdr.content_length ? ENT_OK : n == -2 ? ENT_UNSENT : ENT_INCOMPLETE;
+	}
+	http_chunked_init(&chunked);
+	while (chunked.state != HTTP_CHUNK_DONE)
+	{
+		if (chunked.state == HTTP_CHUNK_DATA && rio_client->rio_cnt == 0) // move the data without looking at it
+		{
+			if ((n = rio_splicen(rio_client, fd, chunked.size)) != chunked.size)
+				return n == -2 ? ENT_UNSENT : ENT_INCOMPLETE;
+			http_chunked_data(&chunked, n);
+			continue;
+		}
+		if (rio_client->rio_cnt == 0 && rio_fill(rio_client) <= 0)
+			return ENT_INCOMPLETE;
+		if ((n = http_chunked_parse(&chunked, rio_client->rio_bufptr, rio_client->rio_cnt)) < 0)
+			return ENT_MALFORMED;
+		if (rio_writen(fd, rio_client->rio_bufptr, n) != n)
+			return ENT_UNSENT;
+		rio_client->rio_bufptr += n;
+		rio_client->rio_cnt -= n;
+	}
+	return ENT_OK;
 }
 
 /**
- * @brief send entity to server
+ * @brief copy the request head laid out by build_request into one buffer, for callers that write it piecewise
  *
- * @param fd server fd
- * @param in server request_info
- * @return int - state
+ * @param req server request line
+ * @param hdr client headers
+ * @param arena holds the result
+ * @param len set to the length of the result
+ * @return char* - request head in arena
  */
-int send_entity(int fd, struct entity_info in)
+char *format_request(struct request_info req, struct header_info hdr, struct arena *arena, size_t *len)
 {
-	return 0;
+	struct iovec *iov;
+	int niov = build_request(req, hdr, arena, &iov);
+	char *buf, *pos;
+
+	*len = 0;
+	for (int i = 0; i < niov; i++)
+		*len += iov[i].iov_len;
+	pos = buf = arena_alloc(arena, *len);
+	for (int i = 0; i < niov; i++)
+		pos = mempcpy(pos, iov[i].iov_base, iov[i].iov_len);
+	return buf;
 }
 
 /**
- * @brief connect to the server in the parameter
+ * @brief connect to the server in the parameter, its addresses coming from the dns cache and raced for
  *
  * @param in server request info
- * @return int - serverfd or -1 if failed
+ * @return int - serverfd or -1 if failed, with errno ETIMEDOUT if the connect timeout passed
  */
 int connect_to_server(struct request_info in)
 {
-	return open_clientfd(in.host, in.port);
+	struct addrinfo *addrs;
+	int fd, err;
+
+	if (dns_getaddrinfo(in.host, in.port, &addrs) != 0)
+	{
+		errno = EHOSTUNREACH; // not a timeout, whatever the lookup left in errno
+		return -1;
+	}
+	fd = race_connect(addrs);
+	err = errno;
+	dns_freeaddrinfo(addrs);
+	if (fd < 0 && err == ETIMEDOUT)
+		upstream_timed_out(in.host, in.port, UPSTREAM_CONNECT);
+	errno = err;
+	return fd;
+}
+
+/**
+ * @brief return the error for a server that could not be reached or sent to
+ *
+ * @return enum client_error_type - 504 if connecting to it timed out, 502 otherwise; from errno as connect_to_server left it
+ */
+static enum client_error_type server_error(void)
+{
+	return errno == ETIMEDOUT ? CLIENT_ERR_504 : CLIENT_ERR_502;
 }
 
 /**
- * @brief forward all output of server to client, will update cache
+ * @brief give up on a server that missed a deadline before any byte of its response went to client
+ *
+ * @param clientfd client fd, answered 504
+ * @param req client request
+ * @param kind which deadline
+ * @return int - -1, as forward_server_to_client
+ */
+static int server_timed_out(int clientfd, struct request_info req, enum upstream_deadline kind)
+{
+	upstream_timed_out(req.host, req.port, kind);
+	clienterror(clientfd, CLIENT_ERR_504);
+	return -1;
+}
+
+/**
+ * @brief relay the rest of a response that cannot be framed, until server closes
  *
  * @param rio_server server rio_t
- * @param rio_client client rio_t
- * @param client_req_info client request line info, used to get path and cache
- * @return int unused
+ * @param clientfd client fd
+ * @return int - 0 once server closed, -1 if reading failed
  */
-int forward_server_to_client(rio_t *rio_server, rio_t *rio_client, struct request_info client_req_info)
+static int relay_until_close(rio_t *rio_server, int clientfd)
 {
 	char buf[MAXLINE];
 	ssize_t read_cnt;
 
-	if (try_cache_server_response(rio_server, rio_client, client_req_info) != 0) // failed
+	while ((read_cnt = rio_readnb(rio_server, buf, MAXLINE)) > 0)
+		rio_writen(clientfd, buf, read_cnt);
+	return read_cnt < 0 ? -1 : 0;
+}
+
+/**
+ * @brief relay a chunked body as it is, up to and including its trailer, decoding it into body on the way
+ *
+ * @param rio_server server rio_t
+ * @param clientfd client fd
+ * @param body initialized by chunked_body_init
+ * @return int - 0 if the body was complete
+ */
+static int relay_chunked(rio_t *rio_server, int clientfd, struct chunked_body *body)
+{
+	ssize_t n;
+
+	while (body->framing.state != HTTP_CHUNK_DONE)
 	{
-		while ((read_cnt = rio_readnb(rio_server, buf, MAXLINE)) > 0)
-		{
-			rio_writen(rio_client->rio_fd, buf, read_cnt);
-		}
+		if (rio_server->rio_cnt == 0 && rio_fill(rio_server) <= 0)
+			return -1;
+		if ((n = chunked_body_feed(body, rio_server->rio_bufptr, rio_server->rio_cnt)) < 0)
+			return -1;
+		if (rio_writen(clientfd, rio_server->rio_bufptr, n) != n)
+			return -1;
+		rio_server->rio_bufptr += n;
+		rio_server->rio_cnt -= n;
 	}
 	return 0;
 }
 
 /**
- * @brief try to cache the response from the server, will fallback to non-caching if unable to parse the response
- * 
+ * @brief relay a body delimited by the server closing the connection as chunks
+ *
+ * A body cut short by a read error gets no last chunk, the client sees it
+ * is incomplete when the connection closes.
+ *
  * @param rio_server server rio_t
- * @param rio_client client rio_t
- * @param client_req_info client request line info
- * @return int 
+ * @param clientfd client fd
+ * @return int - 0 once server closed, -1 if reading failed
  */
-int try_cache_server_response(rio_t *rio_server, rio_t *rio_client, struct request_info client_req_info)
+static int relay_as_chunks(rio_t *rio_server, int clientfd)
 {
-	char buf[MAXLINE], parse_buf[2][MAXLINE], *type = NULL, *pos;
-	bool iscacheable[2] = {false, false};
-	int len, index, bytes_cnt;
-	ssize_t read_cnt, nleft;
+	char buf[MAXLINE + 32];
+	ssize_t read_cnt;
+	int n;
 
-	// parse response line
-	if((read_cnt = rio_readlineb(rio_server, buf, MAXLINE)) <= 0)
+	while ((read_cnt = rio_readnb(rio_server, buf + 16, MAXLINE)) > 0)
 	{
-		return 1;
+		n = snprintf(buf, 16, "%zx\r\n", read_cnt); // size line in front of the data, CRLF after it
+		memmove(buf + 16 - n, buf, n);
+		memcpy(buf + 16 + read_cnt, "\r\n", 2);
+		rio_writen(clientfd, buf + 16 - n, n + read_cnt + 2);
 	}
-	rio_writen(rio_client->rio_fd, buf, read_cnt);
-	if((sscanf(buf, "%*s%s%*s %n", parse_buf[0], &bytes_cnt) < 1) || bytes_cnt != strlen(buf) || (strcmp(parse_buf[0], "200") != 0))
+	if (read_cnt < 0)
+		return -1;
+	rio_writen(clientfd, "0\r\n\r\n", 5);
+	return 0;
+}
+
+/**
+ * @brief return true for response headers that only apply to the connection with the server
+ *
+ * @param line header line
+ * @param len length of line
+ * @return bool
+ */
+bool is_hop_by_hop_header(const char *line, size_t len)
+{
+	switch (http_header_lookup(line, scan_name(line, len)))
 	{
-		return 1;
+	case HTTP_HDR_CONNECTION:
+	case HTTP_HDR_KEEP_ALIVE:
+	case HTTP_HDR_PROXY_CONNECTION:
+		return true;
+	default:
+		return false;
 	}
+}
 
-	// parse headers
-	while((read_cnt = rio_readlineb(rio_server, buf, MAXLINE)) > 0)
+/**
+ * @brief forward the response of server to client, framed so that the client connection can be reused; will update cache
+ *
+ * Content-Length and chunked bodies are relayed as they are. A body that
+ * ends when the server closes is sent as chunks to an HTTP/1.1 client,
+ * otherwise the client connection has to close too.
+ *
+ * The server has first_byte_timeout_ms to send its status line, then each
+ * read may wait read_timeout_ms. Until the head is complete a timeout gets
+ * the client a 504, later the client connection just closes.
+ *
+ * A fill the request leads gets a cacheable body too, and is ended once the
+ * response shows it has none to share or is over.
+ *
+ * @param rio_server server rio_t
+ * @param rio_client client rio_t
+ * @param client_req_info client request line info, used to get path and cache
+ * @param keep_alive whether the client asked for a persistent connection
+ * @param arena holds the response head
+ * @param fill fill led by the request or NULL, set to NULL once ended; left as it is if no response head arrived
+ * @param server_reusable set to true if the response was read to the end of its framing and the server keeps the connection open
+ * @return int - 0 if the response was complete and the client connection persists, -2 if the server closed without sending anything
+ */
+int forward_server_to_client(rio_t *rio_server, rio_t *rio_client, struct request_info client_req_info, bool keep_alive, struct arena *arena,
+							 struct collapse_fill **fill, bool *server_reusable)
+{
+	char buf[MAXLINE], *hdr, *grown, *content, *pos;
+	struct response_info resp = {.content_length = -1, .type = NULL, .keep_alive = false};
+	struct chunked_body body;
+	int clientfd = rio_client->rio_fd;
+	ssize_t read_cnt;
+	size_t hdr_len, hdr_size = 2 * MAXLINE, nleft;
+	bool no_body, as_chunks = false, complete, cacheable;
+
+	// status line, anything we cannot parse is relayed as it is
+	*server_reusable = false;
+	rio_server->rio_deadline = timer_after(timer_now_ms(), first_byte_timeout_ms);
+	if ((read_cnt = rio_readlineb(rio_server, buf, MAXLINE)) < 0 && errno == ETIMEDOUT)
+		return server_timed_out(clientfd, client_req_info, UPSTREAM_FIRST_BYTE);
+	if (read_cnt <= 0)
+		return -2;
+	rio_server->rio_deadline = 0;
+	rio_server->rio_idle_ms = read_timeout_ms;
+	if (parse_response_line(buf, &resp) != 0)
 	{
-		rio_writen(rio_client->rio_fd, buf, read_cnt);
-		if(strcmp(buf, "\r\n") == 0) // all headers are parsed
-		{
-			break;
-		}
-		if(sscanf(buf, "%[^:]: %s", parse_buf[0], parse_buf[1]) < 2)
-		{
-			return 1;
-		}
-		for(size_t i = 0, len = strlen(parse_buf[0]); i < len; i++)
-		{
-			parse_buf[0][i] = tolower(parse_buf[0][i]);
-		}
-		if(strcmp(parse_buf[0], "content-length") == 0) // Content-Length field found
+		rio_writen(clientfd, buf, read_cnt);
+		relay_until_close(rio_server, clientfd);
+		return -1;
+	}
+	while (resp.status / 100 == 1 && resp.status != 101) // interim response to a request body, the client got its 100 from us
+	{
+		while ((read_cnt = rio_readlineb(rio_server, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n") != 0)
+			;
+		if (read_cnt <= 0 || (read_cnt = rio_readlineb(rio_server, buf, MAXLINE)) <= 0)
+			return read_cnt < 0 && errno == ETIMEDOUT ? server_timed_out(clientfd, client_req_info, UPSTREAM_READ) : -1;
+		if (parse_response_line(buf, &resp) != 0)
 		{
-			len = atoi(parse_buf[1]);
-			iscacheable[0] = true;
+			rio_writen(clientfd, buf, read_cnt);
+			relay_until_close(rio_server, clientfd);
+			return -1;
 		}
-		if(strcmp(parse_buf[0], "content-type") == 0) // Content-Type field found
+	}
+	hdr = arena_alloc(arena, hdr_size);
+	memcpy(hdr, buf, read_cnt);
+	hdr_len = read_cnt;
+
+	// headers, without the ones about our connection to server
+	while ((read_cnt = rio_readlineb(rio_server, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n") != 0)
+	{
+		if (parse_response_header(buf, &resp, arena) != 0)
+			break;
+		if (is_hop_by_hop_header(buf, read_cnt))
+			continue;
+		if (hdr_len + read_cnt + 64 > hdr_size)
 		{
-			type = strdup(parse_buf[1]);
-			iscacheable[1] = true;
+			grown = arena_alloc(arena, hdr_size *= 2);
+			hdr = memcpy(grown, hdr, hdr_len);
 		}
+		memcpy(hdr + hdr_len, buf, read_cnt);
+		hdr_len += read_cnt;
+	}
+	if (read_cnt < 0 && errno == ETIMEDOUT)
+		return server_timed_out(clientfd, client_req_info, UPSTREAM_READ);
+	if (read_cnt <= 0 || strcmp(buf, "\r\n") != 0) // truncated or malformed, give up framing it
+	{
+		rio_writen(clientfd, hdr, hdr_len);
+		if (read_cnt > 0)
+			rio_writen(clientfd, buf, read_cnt);
+		relay_until_close(rio_server, clientfd);
+		return -1;
 	}
 
-	if(!(iscacheable[0] && iscacheable[1])) // either of necessary fields is not found
+	no_body = strcasecmp(client_req_info.method, "HEAD") == 0 || resp.status / 100 == 1 || resp.status == 204 || resp.status == 304;
+	if (!no_body && !resp.chunked && resp.content_length < 0) // delimited by close
 	{
-		free(type);
-		return 1;
+		as_chunks = keep_alive && strcasecmp(client_req_info.http_version, "HTTP/1.1") == 0;
+		keep_alive = as_chunks;
 	}
-	if(len > MAX_OBJECT_SIZE) // Too big to be cached
+	if (as_chunks)
 	{
-		free(type);
-		return 1;
+		memcpy(hdr + 5, "1.1", 3); // chunks need an HTTP/1.1 status line
+		hdr_len += sprintf(hdr + hdr_len, "Transfer-Encoding: chunked\r\n");
 	}
+	hdr_len += sprintf(hdr + hdr_len, keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+	rio_writen(clientfd, hdr, hdr_len);
 
-	P(&sem_cache); // critical section
-	while(len > g_cache.bytes_left) // needs to evicte an item
+	cacheable = !no_body && strcmp(client_req_info.method, "GET") == 0 && is_response_cacheable(&resp);
+	if (*fill && cacheable && !resp.chunked)
+		collapse_begin(*fill, resp.type, resp.content_length);
+	else if (*fill && !cacheable) // the followers fetch it themselves
 	{
-		evicte();
+		collapse_end(*fill, false);
+		*fill = NULL;
 	}
-	nleft = len;
-	for(index = 0; (index < MAX_CONNECTION) && (g_cache.cache_content[index].used); index++); // find an empty slot
-	pos = g_cache.cache_content[index].content = Malloc(len);
-	while((read_cnt = rio_readnb(rio_server, buf, MAXLINE)) > 0)
+	complete = true;
+	errno = 0; // tells a stalled body from one that failed otherwise
+	if (no_body)
+		;
+	else if (resp.chunked) // cached with a Content-Length once decoded
 	{
-		nleft -= read_cnt;
-		rio_writen(rio_client->rio_fd, buf, read_cnt);
-		memcpy(pos, buf, read_cnt);
-		pos += read_cnt;
+		chunked_body_init(&body, cacheable);
+		complete = relay_chunked(rio_server, clientfd, &body) == 0;
+		if (body.data && complete && *fill) // shared only now that its length is known
+		{
+			collapse_begin(*fill, resp.type, body.len);
+			collapse_append(*fill, body.data, body.len);
+		}
+		if (body.data && complete)
+			cache_insert(client_req_info, resp.type, body.data, body.len);
+		else
+			free(body.data);
 	}
-	if(nleft > 0) // incomplete response
+	else if (as_chunks)
+		complete = relay_as_chunks(rio_server, clientfd) == 0;
+	else if (resp.content_length < 0)
+		complete = relay_until_close(rio_server, clientfd) == 0;
+	else
+	{
+		// read the body outside of the cache lock, a slow server must not stall other clients
+		nleft = resp.content_length;
+		pos = content = cacheable ? Malloc(nleft ? nleft : 1) : NULL;
+		while (nleft > 0 && (read_cnt = rio_readnb(rio_server, buf, nleft < MAXLINE ? nleft : MAXLINE)) > 0)
+		{
+			nleft -= read_cnt;
+			if (*fill)
+				collapse_append(*fill, buf, read_cnt);
+			rio_writen(clientfd, buf, read_cnt);
+			if (content)
+			{
+				memcpy(pos, buf, read_cnt);
+				pos += read_cnt;
+			}
+		}
+		complete = nleft == 0;
+		if (content && complete)
+			cache_insert(client_req_info, resp.type, content, resp.content_length);
+		else
+			free(content);
+	}
+	if (*fill)
 	{
-		free(g_cache.cache_content[index].content);
-		return 1;
+		collapse_end(*fill, complete);
+		*fill = NULL;
 	}
-	g_cache.cache_content[index].length = len;
-	g_cache.cache_content[index].req_info = client_req_info;
-	g_cache.cache_content[index].timestamp = clock();
-	g_cache.cache_content[index].used = true;
-	g_cache.cache_content[index].type = strdup(type);
-	g_cache.bytes_left -= len;
-	V(&sem_cache);
+	if (!complete && errno == ETIMEDOUT) // too late for a 504, the client sees the connection close early
+		upstream_timed_out(client_req_info.host, client_req_info.port, UPSTREAM_READ);
+	*server_reusable = complete && resp.keep_alive && resp.status != 101 && (no_body || resp.chunked || resp.content_length >= 0) &&
+					   rio_server->rio_cnt == 0; // nothing the server sent past the response
+	return keep_alive && complete ? 0 : -1;
+}
 
+/**
+ * @brief parse the status line of a response
+ *
+ * @param line status line, with or without trailing CRLF
+ * @param resp filled with the status code, and keep_alive set for an HTTP/1.1 server
+ * @return int - 0 on success, -1 if malformed
+ */
+int parse_response_line(const char *line, struct response_info *resp)
+{
+	if (strncmp(line, "HTTP/", 5) != 0 || sscanf(line, "%*s %d", &resp->status) < 1)
+		return -1;
+	resp->keep_alive = strncmp(line, "HTTP/1.1", 8) == 0;
 	return 0;
 }
 
 /**
- * @brief return 1 if req_info is found in cache
- * 
+ * @brief parse one response header line, recording the fields needed for caching
+ *
+ * @param line header line, with or without trailing CRLF
+ * @param resp updated with Content-Length, Content-Type, Transfer-Encoding and Connection
+ * @param arena holds the Content-Type
+ * @return int - 0 on success, -1 if malformed
+ */
+int parse_response_header(const char *line, struct response_info *resp, struct arena *arena)
+{
+	size_t len = strlen(line), key_len = scan_name(line, len);
+	const char *val, *end;
+
+	if (key_len == 0 || line[key_len] != ':')
+		return -1;
+	for (val = line + key_len + 1; *val == ' ' || *val == '\t'; val++)
+		;
+	for (end = line + len; end > val && isspace(end[-1]); end--)
+		;
+
+	switch (http_header_lookup(line, key_len))
+	{
+	case HTTP_HDR_CONTENT_LENGTH:
+		resp->content_length = strtol(val, NULL, 10);
+		break;
+	case HTTP_HDR_CONTENT_TYPE:
+		resp->type = arena_strndup(arena, val, end - val);
+		break;
+	case HTTP_HDR_TRANSFER_ENCODING: // body is framed as chunks
+		resp->chunked = strcasestr(val, "chunked") != NULL;
+		break;
+	case HTTP_HDR_CONNECTION: // whether the server keeps its end open after the response
+		if (strcasestr(val, "close"))
+			resp->keep_alive = false;
+		else if (strcasestr(val, "keep-alive"))
+			resp->keep_alive = true;
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/**
+ * @brief return true if the response to a request may come from cache, and go to it
+ *
+ * @param req client request line
+ * @param hdr client headers
+ * @return bool
+ */
+bool is_request_cacheable(struct request_info req, struct header_info hdr)
+{
+	return strcmp(req.method, "GET") == 0 && !hdr.has_entity_body;
+}
+
+/**
+ * @brief return true if a response with these fields may be stored in cache
+ *
+ * @param resp parsed response
+ * @return bool
+ */
+bool is_response_cacheable(const struct response_info *resp)
+{
+	return resp->status == 200 && resp->type != NULL &&
+		   (resp->chunked || (resp->content_length >= 0 && resp->content_length <= MAX_OBJECT_SIZE));
+}
+
+/**
+ * @brief start decoding a chunked body
+ *
+ * @param body chunked body
+ * @param keep whether to keep the decoded data for the cache
+ */
+void chunked_body_init(struct chunked_body *body, bool keep)
+{
+	http_chunked_init(&body->framing);
+	body->len = 0;
+	body->size = keep ? MAXLINE : 0;
+	body->data = keep ? Malloc(body->size) : NULL;
+}
+
+/**
+ * @brief decode the next bytes of a chunked body, which are relayed unchanged by the caller
+ *
+ * The data is appended to body->data until it would grow over
+ * MAX_OBJECT_SIZE, then dropped; the framing is still followed to its end.
+ *
+ * @param body chunked body
+ * @param buf bytes following the ones fed before
+ * @param len length of buf
+ * @return ssize_t - bytes of buf that belong to the body, less than len once it is complete; -1 if malformed
+ */
+ssize_t chunked_body_feed(struct chunked_body *body, const char *buf, size_t len)
+{
+	const char *lf;
+	size_t i = 0;
+	ssize_t n;
+
+	while (i < len && body->framing.state != HTTP_CHUNK_DONE)
+	{
+		if (body->framing.state != HTTP_CHUNK_DATA) // framing up to the end of its line, where data may start
+		{
+			lf = memchr(buf + i, '\n', len - i);
+			if ((n = http_chunked_parse(&body->framing, buf + i, lf ? lf + 1 - (buf + i) : len - i)) < 0)
+				return -1;
+			i += n;
+			continue;
+		}
+		n = body->framing.size < len - i ? body->framing.size : len - i;
+		if (body->data && body->len + n > MAX_OBJECT_SIZE)
+		{
+			free(body->data);
+			body->data = NULL;
+		}
+		if (body->data)
+		{
+			if (body->len + n > body->size)
+			{
+				while (body->len + n > body->size)
+					body->size = body->size * 2 < MAX_OBJECT_SIZE ? body->size * 2 : MAX_OBJECT_SIZE;
+				body->data = Realloc(body->data, body->size);
+			}
+			memcpy(body->data + body->len, buf + i, n);
+			body->len += n;
+		}
+		http_chunked_data(&body->framing, n);
+		i += n;
+	}
+	return i;
+}
+
+/**
+ * @brief create a cache partition
+ *
+ * @param shared true if several threads use it and it needs locking
+ * @return struct cache*
+ */
+struct cache *cache_new(bool shared)
+{
+	struct cache *cache = Calloc(1, sizeof(*cache));
+
+	cache->bytes_left = MAX_CACHE_SIZE;
+	cache->shared = shared;
+	Sem_init(&cache->sem, 0, 1);
+	return cache;
+}
+
+/**
+ * @brief make the calling thread use cache instead of g_cache
+ *
+ * @param cache partition owned by the thread, or NULL for g_cache
+ */
+void cache_set_local(struct cache *cache)
+{
+	t_cache = cache;
+}
+
+static struct cache *cache_local(void)
+{
+	return t_cache ? t_cache : &g_cache;
+}
+
+static void cache_lock(struct cache *cache)
+{
+	if(cache->shared)
+		P(&cache->sem);
+}
+
+static void cache_unlock(struct cache *cache)
+{
+	if(cache->shared)
+		V(&cache->sem);
+}
+
+/**
+ * @brief find the cache line of req_info, must be called with semaphore set
+ *
+ * @param cache partition
  * @param req_info item
- * @return int 
+ * @return int - index, or -1 if not cached
  */
-int is_request_in_cache(struct request_info req_info)
+static int cache_find(struct cache *cache, struct request_info req_info)
 {
 	for(int i = 0; i < MAX_CONNECTION; i++)
 	{
-		if(g_cache.cache_content[i].used && is_request_info_equal(req_info, g_cache.cache_content[i].req_info))
-			return 1;
+		if(cache->cache_content[i].used && is_request_info_equal(req_info, cache->cache_content[i].req_info))
+			return i;
 	}
-	return 0;
+	return -1;
 }
 
 int is_request_info_equal(struct request_info req1, struct request_info req2)
@@ -620,80 +1557,250 @@ int is_request_info_equal(struct request_info req1, struct request_info req2)
 	return 1;
 }
 
+/**
+ * @brief deep copy a request_info so it can outlive the request
+ *
+ * @param in item
+ * @return struct request_info
+ */
+static struct request_info copy_request_info(struct request_info in)
+{
+	struct request_info ret;
+
+	ret.err_type = in.err_type;
+	ret.method = strdup(in.method);
+	ret.host = strdup(in.host);
+	ret.port = strdup(in.port);
+	ret.abs_path = strdup(in.abs_path);
+	ret.http_version = strdup(in.http_version);
+	return ret;
+}
+
+static void free_request_info(struct request_info in)
+{
+	free(in.method);
+	free(in.host);
+	free(in.port);
+	free(in.abs_path);
+	free(in.http_version);
+}
+
 /**
  * @brief evicte an item from cache using LRU, must be called with semaphore set
- * 
+ *
+ * @param cache partition
  */
-void evicte(void)
+void evicte(struct cache *cache)
 {
-	int index, len = 0;
+	int index = -1;
 	for(int i = 0; i < MAX_CONNECTION; i++)
 	{
-		if(g_cache.cache_content[i].used)
+		if(cache->cache_content[i].used)
 		{
-			if(g_cache.cache_content[i].length > len)
+			if(index < 0 || cache->cache_content[i].timestamp < cache->cache_content[index].timestamp)
 			{
 				index = i;
 			}
 		}
 	}
-	free(g_cache.cache_content[index].content);
-	g_cache.cache_content[index].used = false;
-	g_cache.bytes_left += g_cache.cache_content[index].length;
+	if(index < 0)
+		return;
+	free(cache->cache_content[index].content);
+	free(cache->cache_content[index].type);
+	free_request_info(cache->cache_content[index].req_info);
+	cache->cache_content[index].used = false;
+	cache->bytes_left += cache->cache_content[index].length;
 }
 
-int forward_cache_to_client(rio_t *rio_client, struct request_info req_info)
+/**
+ * @brief store a response body in cache, evicting least recently used items to make room
+ *
+ * @param req_info client request line info, copied
+ * @param type Content-Type of the response, copied
+ * @param content Malloc'ed body, owned by the cache afterwards
+ * @param len length of content
+ * @return int - 0 if stored
+ */
+int cache_insert(struct request_info req_info, const char *type, char *content, size_t len)
 {
-	int index, len;
+	struct cache *cache = cache_local();
+	int index;
 
-	for(int i = 0; i < MAX_CONNECTION; i++)
+	if(len > MAX_OBJECT_SIZE)
 	{
-		if(g_cache.cache_content[i].used && is_request_info_equal(req_info, g_cache.cache_content[i].req_info))
-		{
-			index = i;
+		free(content);
+		return -1;
+	}
+	cache_lock(cache); // critical section
+	if(cache_find(cache, req_info) >= 0) // another client filled it meanwhile
+	{
+		cache_unlock(cache);
+		free(content);
+		return 0;
+	}
+	while(len > cache->bytes_left) // needs to evicte an item
+	{
+		evicte(cache);
+	}
+	while(1) // find an empty slot
+	{
+		for(index = 0; (index < MAX_CONNECTION) && (cache->cache_content[index].used); index++)
+			;
+		if(index < MAX_CONNECTION)
 			break;
-		}
+		evicte(cache);
 	}
-	len = g_cache.cache_content[index].length;
-	dprintf(rio_client->rio_fd, "HTTP/1.0 200 OK\r\n");
-	dprintf(rio_client->rio_fd, "Server: Tiny Web Server\r\n");
-	dprintf(rio_client->rio_fd, "Content-Length: %d\r\n", len);
-	dprintf(rio_client->rio_fd, "Content-Type: %s\r\n", g_cache.cache_content[index].type);
-	dprintf(rio_client->rio_fd, "\r\n");
-	rio_writen(rio_client->rio_fd, g_cache.cache_content[index].content, len);
+	cache->cache_content[index].content = content;
+	cache->cache_content[index].length = len;
+	cache->cache_content[index].req_info = copy_request_info(req_info);
+	cache->cache_content[index].timestamp = ++cache->tick;
+	cache->cache_content[index].used = true;
+	cache->cache_content[index].type = strdup(type);
+	cache->bytes_left -= len;
+	cache_unlock(cache);
 	return 0;
 }
 
 /**
- * @brief output error page to client
+ * @brief format the head of a response served from cache
+ *
+ * @param buf where it goes, NULL with size 0 to measure it
+ * @param size of buf
+ * @param length body length
+ * @param type Content-Type
+ * @param keep_alive whether the client connection persists after the response
+ * @return int - length of the head, as snprintf
+ */
+int cache_response_head(char *buf, size_t size, size_t length, const char *type, bool keep_alive)
+{
+	return snprintf(buf, size, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\nContent-Length: %zu\r\nContent-Type: %s\r\nConnection: %s\r\n\r\n",
+					length, type, keep_alive ? "keep-alive" : "close");
+}
+
+/**
+ * @brief build the full response for a cached request, marking it as recently used
+ *
+ * @param req_info client request line info
+ * @param keep_alive whether the client connection persists after the response
+ * @param arena holds the response
+ * @param len set to the length of the response
+ * @return char* - response in arena, or NULL if not cached
+ */
+char *cache_build_response(struct request_info req_info, bool keep_alive, struct arena *arena, size_t *len)
+{
+	struct cache *cache = cache_local();
+	struct cache_line *line;
+	char *buf;
+	int index, hdr_len;
+
+	cache_lock(cache);
+	if((index = cache_find(cache, req_info)) < 0)
+	{
+		cache_unlock(cache);
+		return NULL;
+	}
+	line = &cache->cache_content[index];
+	line->timestamp = ++cache->tick;
+	hdr_len = cache_response_head(NULL, 0, line->length, line->type, keep_alive);
+	buf = arena_alloc(arena, hdr_len + line->length + 1);
+	cache_response_head(buf, hdr_len + 1, line->length, line->type, keep_alive);
+	memcpy(buf + hdr_len, line->content, line->length);
+	*len = hdr_len + line->length;
+	cache_unlock(cache);
+	return buf;
+}
+
+/**
+ * @brief return the response sent to client for err_type
  *
- * @param fd client fd
  * @param err_type enum value of err_type
+ * @return const char* - complete response, including the blank line
  */
-void clienterror(int fd, enum client_error_type err_type)
+const char *client_error_message(enum client_error_type err_type)
 {
 	switch (err_type)
 	{
 	case CLIENT_ERR_400:
-		dprintf(fd, "HTTP/1.0 400 Bad Request\r\n\r\n");
-		break;
+		return "HTTP/1.0 400 Bad Request\r\n\r\n";
+
+	case CLIENT_ERR_408:
+		return "HTTP/1.0 408 Request Timeout\r\n\r\n";
 
 	case CLIENT_ERR_501:
-		dprintf(fd, "HTTP/1.0 501 Not Implemented\r\n\r\n");
-		break;
+		return "HTTP/1.0 501 Not Implemented\r\n\r\n";
+
+	case CLIENT_ERR_502:
+		return "HTTP/1.0 502 Bad Gateway\r\n\r\n";
+
+	case CLIENT_ERR_504:
+		return "HTTP/1.0 504 Gateway Timeout\r\n\r\n";
 
 	case CLIENT_ERR_500:
 	default:
-		dprintf(fd, "HTTP/1.0 500 Bad Request\r\n\r\n");
-		break;
+		return "HTTP/1.0 500 Internal Server Error\r\n\r\n";
 	}
 }
 
-void *incoming_connection_handler(void *clientfd_)
+/**
+ * @brief output error page to client
+ *
+ * @param fd client fd
+ * @param err_type enum value of err_type
+ */
+void clienterror(int fd, enum client_error_type err_type)
+{
+	const char *msg = client_error_message(err_type);
+
+	rio_writen(fd, (void *)msg, strlen(msg));
+}
+
+void incoming_connection_handler(int clientfd)
 {
-	int clientfd = (long long)clientfd_;
 	serve(clientfd);
 	Close(clientfd);
-	Pthread_exit((void *)NULL);
-	return 0; // never execute to here
+	admission_release();
+}
+
+/**
+ * @brief wait for SIGUSR1 and dump statistics of every component to stderr
+ *
+ * @param arg unused
+ */
+void *stats_handler(void *arg)
+{
+	sigset_t mask;
+	int sig;
+
+	Pthread_detach(pthread_self());
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGUSR1);
+	while (sigwait(&mask, &sig) == 0)
+	{
+		if (strcmp(engine, "threads") == 0)
+			pool_print_stats(stderr);
+		else if (strcmp(engine, "coro") == 0)
+			coro_print_stats(stderr);
+		else
+			conn_print_stats(stderr);
+		if (strcmp(engine, "io_uring") == 0)
+			uring_print_stats(stderr);
+		admission_print_stats(stderr);
+		upstream_print_stats(stderr);
+		dns_print_stats(stderr);
+		race_print_stats(stderr);
+		collapse_print_stats(stderr);
+		arena_print_stats(stderr);
+		if (strcmp(engine, "threads") == 0 || strcmp(engine, "coro") == 0)
+		{
+			fprintf(stderr, "serve: pipelined batches %lu (%lu requests), gathered writes %lu (%lu responses)\n",
+					atomic_load(&pipeline_stats.batches), atomic_load(&pipeline_stats.requests),
+					atomic_load(&pipeline_stats.gathered_writes), atomic_load(&pipeline_stats.gathered_responses));
+			fprintf(stderr, "serve: %lu requests sent to servers in %lu write calls, %lu request heads timed out\n",
+					atomic_load(&pipeline_stats.upstream_requests), atomic_load(&pipeline_stats.upstream_writes),
+					atomic_load(&pipeline_stats.head_timeouts));
+			tunnel_print_stats(stderr);
+		}
+		fflush(stderr);
+	}
+	return NULL;
 }
\ No newline at end of file
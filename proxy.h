@@ -0,0 +1,129 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "http.h"
+#include "arena.h"
+#include <stdbool.h>
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+#define MAX_CONNECTION 32
+
+#define KEEPALIVE_TIMEOUT 5   // seconds an idle persistent client connection is kept open
+#define HEADER_TIMEOUT 10	  // seconds a client has to send a request head, from its first byte
+#define REQUEST_TIMEOUT 60	  // seconds a client has to send a whole request, body included
+#define FIRST_BYTE_TIMEOUT 30 // seconds a server has to start its response once it has the request
+#define READ_TIMEOUT 30		  // seconds a server may leave its response stalled
+#define KEEPALIVE_POLL_MS 100 // how often an idle connection of the thread pool checks if its worker is needed
+#define PIPELINE_MAX 16		  // pipelined requests answered as one batch
+
+enum request_error_type
+{
+	REQ_OK,
+	REQ_MALFORMED,
+	REQ_UNIMPLEMENTED
+}; // All cases of errors that may occured parsing request line
+enum header_error_type
+{
+	HDR_OK,
+	HDR_MALFORMED,
+	HDR_UNIMPLEMENTED
+};
+enum entity_error_type
+{
+	ENT_OK,
+	ENT_MALFORMED,	// chunk framing the server could read differently
+	ENT_INCOMPLETE, // client closed or failed before the end of the body
+	ENT_UNSENT		// server stopped taking the body
+};
+enum client_error_type
+{
+	CLIENT_ERR_400,
+	CLIENT_ERR_408,
+	CLIENT_ERR_500,
+	CLIENT_ERR_501,
+	CLIENT_ERR_502,
+	CLIENT_ERR_504
+}; // All cases of errors that might be sent to client
+struct request_info
+{
+	enum request_error_type err_type;
+	char *method, *host, *port, *abs_path, *http_version;
+};
+struct header_info
+{
+	enum header_error_type err_type;
+	int count;
+	bool has_entity_body;
+	long content_length;  // of the request body, -1 if absent
+	bool chunked;		  // request body framed as chunks
+	bool expect_continue; // Expect: 100-continue
+	const char *head;				 // the fields are slices of it, as received
+	const struct http_field *fields; // with their ids
+};
+struct response_info
+{
+	int status;
+	long content_length; // -1 if absent
+	char *type;			 // NULL if absent, in the arena given to parse_response_header
+	bool chunked;		 // Transfer-Encoding: chunked
+	bool keep_alive;	 // the server keeps the connection open after it
+}; // the fields of a response that decide how it is framed, whether it can be cached and whether its connection can be reused
+struct chunked_body
+{
+	struct http_chunked framing;
+	char *data; // decoded body, Malloc'ed; NULL if not kept or once over MAX_OBJECT_SIZE
+	size_t len, size;
+}; // a chunked response decoded for the cache while it is relayed
+struct cache_line
+{
+	struct request_info req_info;
+	char *content, *type;
+	unsigned long timestamp; // value of cache.tick at last use
+	size_t length;
+	bool used;
+};
+struct cache
+{
+	sem_t sem;
+	bool shared; // false for a per-core partition, which is never locked
+	size_t bytes_left;
+	unsigned long tick;
+	struct cache_line cache_content[MAX_CONNECTION];
+};
+
+extern struct cache g_cache;
+extern int header_timeout_ms, request_timeout_ms; // client deadlines, 0 disables one
+extern int first_byte_timeout_ms, read_timeout_ms; // server deadlines, 0 disables one
+extern int keepalive_ms;						   // idle time of a persistent client connection, 0 disables them
+
+void serve(int clientfd);
+
+struct request_info parse_request(struct http_request *, char *head);
+struct header_info parse_header(const struct http_request *, const char *head);
+
+struct request_info convert_client_to_server_request(struct request_info);
+int build_request(struct request_info, struct header_info, struct arena *, struct iovec **iov);
+char *format_request(struct request_info, struct header_info, struct arena *, size_t *len);
+
+bool client_keep_alive(struct request_info, struct header_info);
+bool is_request_cacheable(struct request_info, struct header_info);
+int parse_response_line(const char *line, struct response_info *);
+int parse_response_header(const char *line, struct response_info *, struct arena *);
+bool is_hop_by_hop_header(const char *line, size_t len);
+bool is_response_cacheable(const struct response_info *);
+void chunked_body_init(struct chunked_body *, bool keep);
+ssize_t chunked_body_feed(struct chunked_body *, const char *buf, size_t len);
+
+struct cache *cache_new(bool shared);
+void cache_set_local(struct cache *);
+int cache_insert(struct request_info, const char *type, char *content, size_t len);
+int cache_response_head(char *buf, size_t size, size_t length, const char *type, bool keep_alive);
+char *cache_build_response(struct request_info, bool keep_alive, struct arena *, size_t *len);
+
+const char *client_error_message(enum client_error_type);
+void clienterror(int fd, enum client_error_type);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,266 @@
+#include "race.h"
+#include "timer.h"
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+struct race_stats
+{
+	atomic_ulong races, attempts, first, fallback, timeouts, failed; // first, fallback: won by the first address or a later one
+};
+
+static struct race_config config = {.stagger_ms = RACE_DEFAULT_STAGGER, .timeout_ms = RACE_DEFAULT_TIMEOUT * 1000};
+static struct race_stats stats;
+
+/**
+ * @brief apply the configuration
+ *
+ * @param cfg race configuration, copied
+ */
+void race_init(const struct race_config *cfg)
+{
+	config = *cfg;
+	if (config.stagger_ms <= 0)
+		config.stagger_ms = RACE_DEFAULT_STAGGER;
+}
+
+/**
+ * @brief order the addresses of listp for trying, alternating between families from the one of the first address
+ *
+ * @param listp getaddrinfo result
+ * @param out set to the first RACE_MAX addresses in order
+ * @return int - number of addresses in out
+ */
+static int race_order(const struct addrinfo *listp, const struct addrinfo **out)
+{
+	const struct addrinfo *first[RACE_MAX], *other[RACE_MAX], *p;
+	int nfirst = 0, nother = 0, n = 0;
+
+	for (p = listp; p; p = p->ai_next)
+	{
+		if (p->ai_family == listp->ai_family)
+		{
+			if (nfirst < RACE_MAX)
+				first[nfirst++] = p;
+		}
+		else if (nother < RACE_MAX)
+		{
+			other[nother++] = p;
+		}
+	}
+	for (int i = 0; n < RACE_MAX && (i < nfirst || i < nother); i++)
+	{
+		if (i < nfirst)
+			out[n++] = first[i];
+		if (i < nother && n < RACE_MAX)
+			out[n++] = other[i];
+	}
+	return n;
+}
+
+/**
+ * @brief close every socket, the epoll instance and the timerfd of a race, nothing if it is over already
+ *
+ * @param r race
+ */
+void race_cancel(struct connect_race *r)
+{
+	if (r->epfd < 0)
+		return;
+	for (int i = 0; i < r->started; i++)
+	{
+		if (r->fds[i] >= 0)
+			close(r->fds[i]);
+	}
+	if (r->tfd >= 0)
+		close(r->tfd);
+	close(r->epfd);
+	r->epfd = -1;
+}
+
+/**
+ * @brief end the race with attempt i as the winner
+ *
+ * @param r race
+ * @param i attempt whose socket connected
+ * @return int - its socket, owned by the caller and still non-blocking
+ */
+static int race_win(struct connect_race *r, int i)
+{
+	int fd = r->fds[i];
+
+	r->fds[i] = -1;
+	race_cancel(r);
+	atomic_fetch_add_explicit(i == 0 ? &stats.first : &stats.fallback, 1, memory_order_relaxed);
+	return fd;
+}
+
+/**
+ * @brief give up on attempt i and have the next one start at once
+ *
+ * @param r race
+ * @param i attempt
+ * @param err why it failed
+ * @param now current time
+ */
+static void race_lose(struct connect_race *r, int i, int err, uint64_t now)
+{
+	close(r->fds[i]);
+	r->fds[i] = -1;
+	r->running--;
+	r->error = err;
+	r->next_ms = now;
+}
+
+/**
+ * @brief start connecting to the next address
+ *
+ * @param r race with addresses left to try
+ * @param now current time
+ * @return bool - true if the socket connected right away, it is then r->fds[r->started - 1]
+ */
+static bool race_launch(struct connect_race *r, uint64_t now)
+{
+	int i = r->started++;
+	const struct addrinfo *p = r->addrs[i];
+	struct epoll_event ev = {.events = EPOLLOUT, .data.u32 = i};
+
+	if ((r->fds[i] = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol)) < 0)
+	{
+		r->error = errno;
+		return false;
+	}
+	atomic_fetch_add_explicit(&stats.attempts, 1, memory_order_relaxed);
+	if (connect(r->fds[i], p->ai_addr, p->ai_addrlen) == 0)
+		return true;
+	if (errno != EINPROGRESS || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->fds[i], &ev) < 0)
+	{
+		r->error = errno;
+		close(r->fds[i]);
+		r->fds[i] = -1;
+		return false;
+	}
+	r->running++;
+	r->next_ms = now + config.stagger_ms;
+	return false;
+}
+
+/**
+ * @brief start a race to the addresses of listp
+ *
+ * @param r race to initialize
+ * @param listp server addresses, kept until the race is over
+ * @return int - as race_step
+ */
+int race_start(struct connect_race *r, const struct addrinfo *listp)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.u32 = RACE_MAX};
+	uint64_t now = timer_now_ms();
+
+	atomic_fetch_add_explicit(&stats.races, 1, memory_order_relaxed);
+	r->naddrs = race_order(listp, r->addrs);
+	r->started = r->running = 0;
+	r->deadline = timer_after(now, config.timeout_ms);
+	r->next_ms = now;
+	r->error = EHOSTUNREACH; // no address at all
+	r->tfd = -1;
+	if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+	if ((r->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->tfd, &ev) < 0)
+	{
+		r->error = errno;
+		race_cancel(r);
+		errno = r->error;
+		return -1;
+	}
+	return race_step(r);
+}
+
+/**
+ * @brief collect the attempts that finished, start those that are due and arm the timerfd for the next step
+ *
+ * @param r race whose epfd was readable, or that just started
+ * @return int - connected socket, -1 with errno set (ETIMEDOUT past the deadline) if every attempt failed, or RACE_PENDING
+ */
+int race_step(struct connect_race *r)
+{
+	struct epoll_event events[RACE_MAX + 1];
+	struct itimerspec its = {0};
+	uint64_t now = timer_now_ms(), due, expirations;
+	socklen_t len;
+	int n, i, err;
+
+	if ((n = epoll_wait(r->epfd, events, RACE_MAX + 1, 0)) < 0)
+		n = 0;
+	for (int k = 0; k < n; k++)
+	{
+		if ((i = events[k].data.u32) == RACE_MAX) // the timer fired, what is due is done below
+		{
+			read(r->tfd, &expirations, sizeof(expirations));
+			continue;
+		}
+		len = sizeof(err);
+		if (getsockopt(r->fds[i], SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+		if (err == 0)
+			return race_win(r, i);
+		race_lose(r, i, err, now);
+	}
+	while (r->started < r->naddrs && (r->running == 0 || now >= r->next_ms))
+	{
+		if (race_launch(r, now))
+			return race_win(r, r->started - 1);
+	}
+	if (r->running == 0 || (r->deadline && now >= r->deadline))
+	{
+		err = r->running == 0 ? r->error : ETIMEDOUT;
+		atomic_fetch_add_explicit(r->running == 0 ? &stats.failed : &stats.timeouts, 1, memory_order_relaxed);
+		race_cancel(r);
+		errno = err;
+		return -1;
+	}
+	due = timer_min(r->deadline, r->started < r->naddrs ? r->next_ms : 0);
+	its.it_value.tv_sec = due / 1000;
+	its.it_value.tv_nsec = due % 1000 * 1000000L;
+	timerfd_settime(r->tfd, TFD_TIMER_ABSTIME, &its, NULL); // 0 disarms it
+	return RACE_PENDING;
+}
+
+/**
+ * @brief race to the addresses of listp, waiting through rio_poll
+ *
+ * @param listp server addresses
+ * @return int - connected socket, non-blocking only if the thread has a rio_wait; -1 with errno set on failure
+ */
+int race_connect(const struct addrinfo *listp)
+{
+	struct connect_race r;
+	struct pollfd pfd = {.events = POLLIN};
+	int fd = race_start(&r, listp);
+
+	while (fd == RACE_PENDING)
+	{
+		pfd.fd = r.epfd;
+		if (rio_poll(&pfd, 1, -1) < 0)
+		{
+			race_cancel(&r);
+			return -1;
+		}
+		fd = race_step(&r);
+	}
+	if (fd >= 0 && !rio_getwait())
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	return fd;
+}
+
+/**
+ * @brief dump connect race counters
+ *
+ * @param fp output stream
+ */
+void race_print_stats(FILE *fp)
+{
+	fprintf(fp, "connect: %lu races, %lu attempts, won by the first address %lu, by a later one %lu, timed out %lu, failed %lu\n",
+			atomic_load(&stats.races), atomic_load(&stats.attempts), atomic_load(&stats.first), atomic_load(&stats.fallback),
+			atomic_load(&stats.timeouts), atomic_load(&stats.failed));
+}
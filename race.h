@@ -0,0 +1,50 @@
+#ifndef __RACE_H__
+#define __RACE_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/*
+ * Happy Eyeballs (RFC 8305) connect to a server with several addresses. The
+ * addresses are tried in the order getaddrinfo() gave them with the address
+ * families interleaved, so a broken IPv6 route costs one stagger rather than
+ * every IPv6 address in turn. A new attempt starts each stagger_ms, or as
+ * soon as the running ones failed, while the earlier ones keep going; the
+ * first connection to complete wins and the others are closed. timeout_ms
+ * bounds the whole race.
+ *
+ * A race never blocks. Its sockets and a timerfd for its next step sit in an
+ * epoll instance of its own, so epfd becomes readable whenever race_step()
+ * has work to do: event engines wait for it like for any socket, and
+ * race_connect() waits for it with rio_poll().
+ */
+
+#define RACE_DEFAULT_STAGGER 250 // ms between attempts, the Connection Attempt Delay of RFC 8305
+#define RACE_DEFAULT_TIMEOUT 10	 // seconds to connect to a server, 0 for no limit
+#define RACE_MAX 8				 // addresses tried
+#define RACE_PENDING -2			 // from race_start and race_step: wait for epfd to be readable
+
+struct race_config
+{
+	int stagger_ms;
+	int timeout_ms;
+};
+struct connect_race
+{
+	int epfd; // -1 once the race is over
+	int tfd;  // timerfd of the next attempt or the deadline
+	const struct addrinfo *addrs[RACE_MAX]; // in the order they are tried
+	int fds[RACE_MAX];						// socket of each started attempt, -1 once it failed
+	int naddrs, started, running;
+	uint64_t deadline, next_ms; // next_ms: when the next attempt is due
+	int error;					// errno of the last failed attempt
+};
+
+void race_init(const struct race_config *);
+int race_start(struct connect_race *, const struct addrinfo *listp);
+int race_step(struct connect_race *);
+void race_cancel(struct connect_race *);
+int race_connect(const struct addrinfo *listp);
+void race_print_stats(FILE *);
+
+#endif /* __RACE_H__ */
@@ -0,0 +1,207 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+static size_t scan_line_scalar(const char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		unsigned char c = p[i];
+		if ((c < 0x20 && c != '\t') || c == 0x7f)
+			break;
+	}
+	return i;
+}
+
+static size_t scan_name_scalar(const char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		unsigned char c = p[i];
+		if (c <= ' ' || c >= 0x7f || c == ':')
+			break;
+	}
+	return i;
+}
+
+#ifdef SCAN_X86
+/* bytes <= 0x1f but HT, and DEL; unsigned, so obs-text (>= 0x80) passes */
+static inline __m128i line_stops_sse2(__m128i v)
+{
+	__m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+
+	ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), ctl);
+	return _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+}
+
+/* ':' and bytes outside 0x21..0x7e; signed compares reject >= 0x80 too */
+static inline __m128i name_stops_sse2(__m128i v)
+{
+	__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(' ')), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+
+	return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_xor_si128(ok, _mm_set1_epi8(-1)));
+}
+
+static size_t scan_line_sse2(const char *p, size_t n)
+{
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		if ((mask = _mm_movemask_epi8(line_stops_sse2(_mm_loadu_si128((const __m128i *)(p + i))))) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_line_scalar(p + i, n - i);
+}
+
+static size_t scan_name_sse2(const char *p, size_t n)
+{
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		if ((mask = _mm_movemask_epi8(name_stops_sse2(_mm_loadu_si128((const __m128i *)(p + i))))) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_name_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t scan_line_avx2(const char *p, size_t n)
+{
+	__m256i v, ctl;
+	size_t i;
+	unsigned mask;
+
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+		ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), ctl);
+		ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+		if ((mask = _mm256_movemask_epi8(ctl)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	_mm256_zeroupper(); // the SSE2 tail would pay for dirty upper halves on every instruction
+	return i + scan_line_sse2(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t scan_name_avx2(const char *p, size_t n)
+{
+	__m256i v, ok, stop;
+	size_t i;
+	unsigned mask;
+
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v));
+		stop = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')), _mm256_xor_si256(ok, _mm256_set1_epi8(-1)));
+		if ((mask = _mm256_movemask_epi8(stop)) != 0)
+			return i + __builtin_ctz(mask);
+	}
+	_mm256_zeroupper();
+	return i + scan_name_sse2(p + i, n - i);
+}
+#endif
+
+struct scan_kernels
+{
+	const char *name;
+	size_t (*line)(const char *, size_t);
+	size_t (*name_end)(const char *, size_t);
+};
+static const struct scan_kernels kernels[] = {
+#ifdef SCAN_X86
+	{"avx2", scan_line_avx2, scan_name_avx2},
+	{"sse2", scan_line_sse2, scan_name_sse2},
+#endif
+	{"scalar", scan_line_scalar, scan_name_scalar},
+}; // best first
+static const struct scan_kernels *current;
+
+static bool scan_supported(const struct scan_kernels *k)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (strcmp(k->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(k->name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return true;
+}
+
+static void scan_use(const struct scan_kernels *k)
+{
+	current = k;
+	scan_line = k->line;
+	scan_name = k->name_end;
+}
+
+/* first call of a kernel picks the best supported set, every thread picks the same */
+static void scan_resolve(void)
+{
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if (scan_supported(&kernels[i]))
+		{
+			scan_use(&kernels[i]);
+			return;
+		}
+	}
+}
+
+static size_t scan_line_resolve(const char *p, size_t n)
+{
+	scan_resolve();
+	return scan_line(p, n);
+}
+
+static size_t scan_name_resolve(const char *p, size_t n)
+{
+	scan_resolve();
+	return scan_name(p, n);
+}
+
+size_t (*scan_line)(const char *, size_t) = scan_line_resolve;
+size_t (*scan_name)(const char *, size_t) = scan_name_resolve;
+
+/**
+ * @brief use the kernels named impl instead of the best ones
+ *
+ * @param impl "avx2", "sse2" or "scalar"
+ * @return int - 0 on success, -1 if unknown or not supported by the CPU
+ */
+int scan_select(const char *impl)
+{
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if (strcmp(kernels[i].name, impl) == 0 && scan_supported(&kernels[i]))
+		{
+			scan_use(&kernels[i]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief name of the kernels in use
+ *
+ * @return const char*
+ */
+const char *scan_impl(void)
+{
+	if (current == NULL)
+		scan_resolve();
+	return current->name;
+}
@@ -0,0 +1,59 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Byte scanning kernels of the HTTP head parsers. Each exists as AVX2, SSE2
+ * and scalar code; the best one the CPU supports is picked on first use,
+ * or by scan_select.
+ */
+
+/* index of the first '\r', '\n' or other control byte but HT in p[0..n), n if none */
+extern size_t (*scan_line)(const char *p, size_t n);
+/* index of the first ':' or byte that cannot be part of a field name in p[0..n), n if none */
+extern size_t (*scan_name)(const char *p, size_t n);
+
+int scan_select(const char *impl);
+const char *scan_impl(void);
+
+/**
+ * @brief compare a field name case-insensitively, a word at a time
+ *
+ * Setting bit 0x20 of every byte lowercases letters and keeps digits and '-'
+ * as they are; no other character scan_name lets into a name maps onto them.
+ *
+ * @param name field name as delimited by scan_name
+ * @param len length of name
+ * @param lower name to match, lowercase letters, digits and '-'
+ * @param lower_len length of lower
+ * @return bool
+ */
+static inline bool scan_name_eq(const char *name, size_t len, const char *lower, size_t lower_len)
+{
+	uint64_t a, b;
+
+	if (len != lower_len)
+		return false;
+	for (; len >= 8; name += 8, lower += 8, len -= 8)
+	{
+		memcpy(&a, name, 8);
+		memcpy(&b, lower, 8);
+		if ((a | 0x2020202020202020ULL) != b)
+			return false;
+	}
+	for (; len > 0; name++, lower++, len--)
+	{
+		if ((*name | 0x20) != *lower)
+			return false;
+	}
+	return true;
+}
+
+/* scan_name_eq against a string literal */
+#define SCAN_NAME_IS(name, len, literal) scan_name_eq(name, len, literal, sizeof(literal) - 1)
+
+#endif /* __SCAN_H__ */
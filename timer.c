@@ -0,0 +1,289 @@
+#include "timer.h"
+#include <limits.h>
+#include <time.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_REACH ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void list_init(struct timer *head)
+{
+	head->next = head->prev = head;
+}
+
+static void list_append(struct timer *head, struct timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/**
+ * @brief move every timer of list from to the end of list to
+ *
+ * @param to list head
+ * @param from list head, left empty
+ */
+static void list_splice(struct timer *to, struct timer *from)
+{
+	if (from->next == from)
+		return;
+	from->next->prev = to->prev;
+	from->prev->next = to;
+	to->prev->next = from->next;
+	to->prev = from->prev;
+	list_init(from);
+}
+
+static uint64_t rotate_right(uint64_t x, int r)
+{
+	return r ? x >> r | x << (64 - r) : x;
+}
+
+/**
+ * @brief take t off the list it is on, clearing the bit of its slot if that empties it
+ *
+ * @param w wheel
+ * @param t armed timer
+ */
+static void timer_unlink(struct timer_wheel *w, struct timer *t)
+{
+	struct timer *head = t->next == t->prev ? t->next : NULL; // t alone on the list of head
+	ptrdiff_t i;
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	if (head && head != &w->expired)
+	{
+		i = head - &w->slots[0][0];
+		w->occupied[i / TIMER_WHEEL_SIZE] &= ~(1ULL << (i % TIMER_WHEEL_SIZE));
+	}
+}
+
+/**
+ * @brief put t in the slot of the lowest level its distance from the current tick fits in
+ *
+ * @param w wheel
+ * @param t timer, not on any list
+ */
+static void wheel_insert(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t expires = t->expires, delta;
+	int level = 0, slot;
+
+	if (expires < w->tick) // already due, goes with the next tick
+		expires = w->tick;
+	if ((delta = expires - w->tick) >= TIMER_WHEEL_REACH) // placed again when the last level comes round
+		delta = (expires = w->tick + TIMER_WHEEL_REACH - 1) - w->tick;
+	while (delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))
+		level++;
+	slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	list_append(&w->slots[level][slot], t);
+	w->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * @brief move the timers of the current slot of level down, the level below has just wrapped around
+ *
+ * Higher levels go first, so what they move down lands before the slots
+ * below it are taken apart.
+ *
+ * @param w wheel at a tick that is a multiple of the slot width of level
+ * @param level 1 or higher
+ */
+static void wheel_cascade(struct timer_wheel *w, int level)
+{
+	int slot = (w->tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	struct timer list, *t;
+
+	if (slot == 0 && level + 1 < TIMER_WHEEL_LEVELS)
+		wheel_cascade(w, level + 1);
+	if (!(w->occupied[level] & (1ULL << slot)))
+		return;
+	list_init(&list);
+	list_splice(&list, &w->slots[level][slot]);
+	w->occupied[level] &= ~(1ULL << slot);
+	while ((t = list.next) != &list)
+	{
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		wheel_insert(w, t);
+	}
+}
+
+static bool wheel_empty(const struct timer_wheel *w)
+{
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		if (w->occupied[level])
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @brief run the wheel up to now, moving the timers due to the expired list
+ *
+ * Empty level 0 slots are skipped with the bitmap, so this stops at most
+ * once per TIMER_WHEEL_SIZE ticks, and not at all once the wheel is empty.
+ *
+ * @param w wheel
+ * @param now current time
+ */
+static void wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+	uint64_t bits, next;
+	int slot;
+
+	while (w->tick <= now)
+	{
+		if (wheel_empty(w))
+		{
+			w->tick = now + 1;
+			return;
+		}
+		slot = w->tick & TIMER_WHEEL_MASK;
+		if (slot == 0)
+			wheel_cascade(w, 1);
+		if (w->occupied[0] & (1ULL << slot))
+		{
+			list_splice(&w->expired, &w->slots[0][slot]);
+			w->occupied[0] &= ~(1ULL << slot);
+		}
+		bits = slot == TIMER_WHEEL_MASK ? 0 : w->occupied[0] >> (slot + 1);
+		next = bits ? w->tick + 1 + __builtin_ctzll(bits) : (w->tick | TIMER_WHEEL_MASK) + 1; // next busy slot or next wrap
+		w->tick = next <= now ? next : now + 1;
+	}
+}
+
+/**
+ * @brief read the clock timers are set against
+ *
+ * @return uint64_t - CLOCK_MONOTONIC in milliseconds
+ */
+uint64_t timer_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief make an empty wheel
+ *
+ * @param w wheel
+ * @param now current time
+ */
+void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+	w->tick = now;
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		w->occupied[level] = 0;
+		for (int slot = 0; slot < TIMER_WHEEL_SIZE; slot++)
+			list_init(&w->slots[level][slot]);
+	}
+	list_init(&w->expired);
+}
+
+void timer_init(struct timer *t)
+{
+	t->next = t->prev = NULL;
+	t->expires = 0;
+}
+
+/**
+ * @brief return true if t is on a wheel, waiting or expired but not handed out yet
+ *
+ * @param t timer
+ * @return bool
+ */
+bool timer_armed(const struct timer *t)
+{
+	return t->next != NULL;
+}
+
+/**
+ * @brief arm t to expire at expires, moving it if it is armed already
+ *
+ * @param w wheel
+ * @param t timer
+ * @param expires time it is due, it is handed out by the first timer_expired at or after it
+ */
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires)
+{
+	if (timer_armed(t))
+		timer_unlink(w, t);
+	t->expires = expires;
+	wheel_insert(w, t);
+}
+
+/**
+ * @brief disarm t, nothing happens if it is not armed
+ *
+ * @param w wheel t was added to
+ * @param t timer
+ */
+void timer_del(struct timer_wheel *w, struct timer *t)
+{
+	if (timer_armed(t))
+		timer_unlink(w, t);
+}
+
+/**
+ * @brief hand out one timer that is due, disarmed
+ *
+ * Callers loop until it returns NULL; timers may be added and removed in
+ * between.
+ *
+ * @param w wheel
+ * @param now current time
+ * @return struct timer* - NULL once no timer is due
+ */
+struct timer *timer_expired(struct timer_wheel *w, uint64_t now)
+{
+	struct timer *t;
+
+	if (w->expired.next == &w->expired)
+		wheel_advance(w, now);
+	if ((t = w->expired.next) == &w->expired)
+		return NULL;
+	timer_unlink(w, t);
+	return t;
+}
+
+/**
+ * @brief return how long to sleep before timer_expired may have something
+ *
+ * It is exact for timers due within TIMER_WHEEL_SIZE ticks; further ones
+ * wake the caller when their slot moves down a level.
+ *
+ * @param w wheel
+ * @param now current time
+ * @return int - milliseconds, 0 if timers are due, -1 if none is armed
+ */
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now)
+{
+	uint64_t next = UINT64_MAX, at, base;
+	int shift;
+
+	if (w->expired.next != &w->expired)
+		return 0;
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		if (!w->occupied[level])
+			continue;
+		shift = TIMER_WHEEL_BITS * level;
+		base = (w->tick + ((uint64_t)1 << shift) - 1) >> shift; // first slot not run or moved down yet, the current tick's included
+		at = (base + __builtin_ctzll(rotate_right(w->occupied[level], base & TIMER_WHEEL_MASK))) << shift;
+		if (at < next)
+			next = at;
+	}
+	if (next == UINT64_MAX)
+		return -1;
+	if (next <= now)
+		return 0;
+	return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
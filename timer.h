@@ -0,0 +1,62 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel with 1 ms ticks, owned by one thread (a loop).
+ * Level l has TIMER_WHEEL_SIZE slots of TIMER_WHEEL_SIZE^l ticks each; a
+ * timer goes to the lowest level its distance fits in, and the slots of a
+ * level are moved down a level each time the one below wraps around. Adding
+ * and removing a timer is O(1), and so is finding the next slot to look at,
+ * through a bitmap of the non-empty slots of each level. Timers further out
+ * than the wheel reaches wait in the last level and are placed again when
+ * it comes round.
+ *
+ * Times are CLOCK_MONOTONIC milliseconds, see timer_now_ms().
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 // reach 2^24 ms, about 4.6 hours
+
+struct timer
+{
+	struct timer *next, *prev; // NULL while not armed
+	uint64_t expires;
+};
+struct timer_wheel
+{
+	uint64_t tick;								// next tick whose slot is due
+	uint64_t occupied[TIMER_WHEEL_LEVELS];		// bit s set if slots[l][s] is not empty
+	struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE]; // list heads
+	struct timer expired;						// list head of timers due, handed out by timer_expired
+};
+
+/* the struct of type holding timer t as member */
+#define timer_entry(t, type, member) ((type *)((char *)(t) - offsetof(type, member)))
+
+/* start + ms as a deadline, 0 (none) if ms is not positive */
+static inline uint64_t timer_after(uint64_t start, int ms)
+{
+	return ms > 0 ? start + ms : 0;
+}
+
+/* the earlier of two deadlines, 0 standing for none */
+static inline uint64_t timer_min(uint64_t a, uint64_t b)
+{
+	return a == 0 || (b != 0 && b < a) ? b : a;
+}
+
+uint64_t timer_now_ms(void);
+void timer_wheel_init(struct timer_wheel *, uint64_t now);
+void timer_init(struct timer *);
+bool timer_armed(const struct timer *);
+void timer_add(struct timer_wheel *, struct timer *, uint64_t expires);
+void timer_del(struct timer_wheel *, struct timer *);
+struct timer *timer_expired(struct timer_wheel *, uint64_t now);
+int timer_wheel_timeout(const struct timer_wheel *, uint64_t now);
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE /* splice, pipe2 */
+#include "tunnel.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct tunnel_dir
+{
+	int from, to;
+	int pipe[2];
+	size_t queued;		 // bytes in pipe, not written to to yet
+	bool eof;			 // from will send nothing more
+	bool shut;			 // eof passed on to to
+	unsigned long bytes; // written to to
+}; // one direction of a tunnel
+struct tunnel_stats
+{
+	atomic_ulong tunnels, active, idle_timeouts, errors;
+	atomic_ulong bytes_up, bytes_down; // client to server, server to client
+};
+
+static struct tunnel_stats stats;
+
+/**
+ * @brief move what d can move without blocking: drain its pipe, then refill it once
+ *
+ * @param d direction
+ * @return int - 1 if bytes moved or eof was seen, 0 if it has to wait, -1 on error
+ */
+static int dir_pump(struct tunnel_dir *d)
+{
+	int progress = 0;
+	ssize_t n;
+
+	while (d->queued > 0)
+	{
+		if ((n = splice(d->pipe[0], NULL, d->to, NULL, d->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0)
+		{
+			if (errno == EAGAIN)
+				return progress;
+			return errno == EINTR ? 1 : -1;
+		}
+		d->queued -= n;
+		d->bytes += n;
+		progress = 1;
+	}
+	if (d->eof)
+	{
+		if (!d->shut) // the peer sees the close once everything before it arrived
+		{
+			shutdown(d->to, SHUT_WR);
+			d->shut = true;
+			progress = 1;
+		}
+		return progress;
+	}
+	if ((n = splice(d->from, NULL, d->pipe[1], NULL, TUNNEL_SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0)
+	{
+		if (errno == EAGAIN)
+			return progress;
+		return errno == EINTR ? 1 : -1;
+	}
+	if (n == 0)
+		d->eof = true;
+	d->queued += n;
+	return 1;
+}
+
+/**
+ * @brief relay bytes both ways between client and server until both are done or the tunnel is idle
+ *
+ * Bytes the client sent after its CONNECT head and that were read with it
+ * are written to server first.
+ *
+ * @param rio_client client rio_t, positioned after the CONNECT head
+ * @param serverfd connected server fd
+ * @param idle_ms close the tunnel when nothing moved for this long
+ */
+void tunnel_run(rio_t *rio_client, int serverfd, int idle_ms)
+{
+	struct tunnel_dir up = {.from = rio_client->rio_fd, .to = serverfd}, down = {.from = serverfd, .to = rio_client->rio_fd};
+	struct pollfd fds[2];
+	int rc_up = 0, rc_down = 0, rc, nfds;
+	short events;
+
+	atomic_fetch_add_explicit(&stats.tunnels, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats.active, 1, memory_order_relaxed);
+	if (rio_client->rio_cnt > 0)
+	{
+		if (rio_writen(serverfd, rio_client->rio_bufptr, rio_client->rio_cnt) < 0)
+			goto out;
+		up.bytes = rio_client->rio_cnt;
+		rio_client->rio_cnt = 0;
+	}
+	if (pipe2(up.pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		goto out;
+	if (pipe2(down.pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		goto close_up;
+	fcntl(up.from, F_SETFL, fcntl(up.from, F_GETFL) | O_NONBLOCK); // waiting is done by rio_poll only
+	fcntl(up.to, F_SETFL, fcntl(up.to, F_GETFL) | O_NONBLOCK);
+
+	while (!(up.shut && up.queued == 0 && down.shut && down.queued == 0))
+	{
+		if ((rc_up = dir_pump(&up)) < 0 || (rc_down = dir_pump(&down)) < 0)
+		{
+			atomic_fetch_add_explicit(&stats.errors, 1, memory_order_relaxed);
+			break;
+		}
+		if (rc_up || rc_down)
+			continue;
+		nfds = 0;
+		if ((events = (down.queued ? POLLOUT : 0) | (up.queued || up.eof ? 0 : POLLIN)) != 0)
+			fds[nfds++] = (struct pollfd){.fd = rio_client->rio_fd, .events = events};
+		if ((events = (up.queued ? POLLOUT : 0) | (down.queued || down.eof ? 0 : POLLIN)) != 0)
+			fds[nfds++] = (struct pollfd){.fd = serverfd, .events = events};
+		if ((rc = rio_poll(fds, nfds, idle_ms)) == 0)
+		{
+			atomic_fetch_add_explicit(&stats.idle_timeouts, 1, memory_order_relaxed);
+			break;
+		}
+		if (rc < 0)
+			break;
+	}
+	Close(down.pipe[0]);
+	Close(down.pipe[1]);
+close_up:
+	Close(up.pipe[0]);
+	Close(up.pipe[1]);
+out:
+	atomic_fetch_add_explicit(&stats.bytes_up, up.bytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats.bytes_down, down.bytes, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&stats.active, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief dump tunnel counters
+ *
+ * @param fp output stream
+ */
+void tunnel_print_stats(FILE *fp)
+{
+	fprintf(fp, "tunnel: %lu opened, %lu active, %lu idle timeouts, %lu errors, %lu bytes up, %lu bytes down\n",
+			atomic_load(&stats.tunnels), atomic_load(&stats.active), atomic_load(&stats.idle_timeouts),
+			atomic_load(&stats.errors), atomic_load(&stats.bytes_up), atomic_load(&stats.bytes_down));
+}
@@ -0,0 +1,22 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include "csapp.h"
+
+/*
+ * Byte relay of a CONNECT request once the server is connected. Each
+ * direction moves socket -> pipe -> socket with splice(), so the payload
+ * (usually TLS) never enters user space. The tunnel ends when both sides
+ * have closed their half, on an error, or when neither side sent anything
+ * for the idle timeout.
+ *
+ * It waits through rio_poll, so it runs on a worker thread or a coroutine.
+ */
+
+#define TUNNEL_DEFAULT_IDLE_TIMEOUT 300 // seconds
+#define TUNNEL_SPLICE_MAX (64 * 1024)	// bytes per splice, the default pipe capacity
+
+void tunnel_run(rio_t *rio_client, int serverfd, int idle_ms);
+void tunnel_print_stats(FILE *);
+
+#endif /* __TUNNEL_H__ */
@@ -0,0 +1,408 @@
+#include "csapp.h"
+#include "upstream.h"
+#include "timer.h"
+#include <stdatomic.h>
+
+struct upstream_idle
+{
+	int fd;
+	uint64_t since; // when it was put back
+};
+struct upstream_host
+{
+	struct upstream_host *next;
+	char *key;	   // host:port
+	uint64_t used; // last take or put, a host unused for the idle timeout is freed
+	int nidle;
+	struct upstream_idle idle[]; // oldest first, max_per_host entries
+};
+struct upstream_shard
+{
+	sem_t sem;
+	uint64_t swept; // last time connections past the idle timeout were closed
+	struct upstream_host *buckets[UPSTREAM_BUCKETS];
+};
+struct upstream_stats
+{
+	atomic_long idle;
+	atomic_ulong hits, misses, stale, retries; // stale: closed or dirty when taken, retries: failed after a hit
+	atomic_ulong puts, full, expired;		   // full: closed because the pool or its host had no room
+	atomic_ulong timeouts[UPSTREAM_DEADLINES];
+};
+struct upstream_origin
+{
+	char *key; // host:port
+	unsigned long timeouts[UPSTREAM_DEADLINES], total;
+	uint64_t last; // when it last timed out
+};
+struct upstream_origins
+{
+	sem_t sem;
+	int n;
+	struct upstream_origin origins[UPSTREAM_ORIGINS];
+	unsigned long other[UPSTREAM_DEADLINES]; // of the origins that did not fit
+};
+
+static struct upstream_config config;
+static struct upstream_shard shards[UPSTREAM_SHARDS];
+static struct upstream_stats stats;
+static struct upstream_origins origins;
+
+/**
+ * @brief apply the configuration, fill in defaults
+ *
+ * @param cfg pool configuration, copied; max_idle 0 disables pooling
+ */
+void upstream_init(const struct upstream_config *cfg)
+{
+	config = *cfg;
+	if (config.max_per_host <= 0)
+		config.max_per_host = UPSTREAM_DEFAULT_MAX_PER_HOST;
+	if (config.idle_timeout_ms <= 0)
+		config.idle_timeout_ms = UPSTREAM_DEFAULT_IDLE_TIMEOUT * 1000;
+	for (int i = 0; i < UPSTREAM_SHARDS; i++)
+		Sem_init(&shards[i].sem, 0, 1);
+	Sem_init(&origins.sem, 0, 1);
+}
+
+/**
+ * @brief return true if server connections are to be kept alive and pooled
+ *
+ * @return bool
+ */
+bool upstream_enabled(void)
+{
+	return config.max_idle > 0;
+}
+
+/**
+ * @brief hash host:port to its shard and bucket
+ *
+ * @param host server host
+ * @param port server port
+ * @param bucket set to the bucket of host:port in the returned shard
+ * @return struct upstream_shard*
+ */
+static struct upstream_shard *upstream_shard(const char *host, const char *port, struct upstream_host ***bucket)
+{
+	unsigned long hash = 2166136261UL; // FNV-1a
+	struct upstream_shard *shard;
+
+	for (const char *s = host; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619UL;
+	hash = (hash ^ ':') * 16777619UL;
+	for (const char *s = port; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 16777619UL;
+	shard = &shards[hash % UPSTREAM_SHARDS];
+	*bucket = &shard->buckets[hash / UPSTREAM_SHARDS % UPSTREAM_BUCKETS];
+	return shard;
+}
+
+/**
+ * @brief find the entry of host:port in its bucket, creating it if asked to
+ *
+ * @param bucket bucket of a locked shard
+ * @param host server host
+ * @param port server port
+ * @param create allocate a missing entry
+ * @return struct upstream_host* - NULL if missing and not created
+ */
+static struct upstream_host *upstream_host(struct upstream_host **bucket, const char *host, const char *port, bool create)
+{
+	size_t host_len = strlen(host);
+	struct upstream_host *h;
+
+	for (h = *bucket; h; h = h->next)
+	{
+		if (strncmp(h->key, host, host_len) == 0 && h->key[host_len] == ':' && strcmp(h->key + host_len + 1, port) == 0)
+			return h;
+	}
+	if (!create)
+		return NULL;
+	h = Malloc(sizeof(*h) + config.max_per_host * sizeof(h->idle[0]));
+	h->key = Malloc(host_len + strlen(port) + 2);
+	sprintf(h->key, "%s:%s", host, port);
+	h->nidle = 0;
+	h->next = *bucket;
+	*bucket = h;
+	return h;
+}
+
+/**
+ * @brief close the oldest n idle connections of h
+ *
+ * @param h host entry, locked
+ * @param n how many
+ */
+static void upstream_drop(struct upstream_host *h, int n)
+{
+	for (int i = 0; i < n; i++)
+		close(h->idle[i].fd);
+	memmove(h->idle, h->idle + n, (h->nidle - n) * sizeof(h->idle[0]));
+	h->nidle -= n;
+	atomic_fetch_sub(&stats.idle, n);
+}
+
+/**
+ * @brief close the connections of h idle for longer than the timeout
+ *
+ * @param h host entry, locked
+ * @param now current time
+ */
+static void upstream_expire(struct upstream_host *h, uint64_t now)
+{
+	int n = 0;
+
+	while (n < h->nidle && h->idle[n].since + config.idle_timeout_ms <= now)
+		n++;
+	if (n > 0)
+	{
+		upstream_drop(h, n);
+		atomic_fetch_add_explicit(&stats.expired, n, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief expire the connections of every host of shard, at most once a second, and free hosts unused for the idle timeout
+ *
+ * Servers close idle connections on their own, this keeps the pool from
+ * holding on to their fds when nothing else goes to them.
+ *
+ * @param shard locked shard
+ * @param now current time
+ */
+static void upstream_sweep(struct upstream_shard *shard, uint64_t now)
+{
+	struct upstream_host *h, **link;
+
+	if (now < shard->swept + 1000)
+		return;
+	shard->swept = now;
+	for (int i = 0; i < UPSTREAM_BUCKETS; i++)
+	{
+		for (link = &shard->buckets[i]; (h = *link) != NULL;)
+		{
+			upstream_expire(h, now);
+			if (h->nidle == 0 && h->used + config.idle_timeout_ms <= now)
+			{
+				*link = h->next;
+				free(h->key);
+				free(h);
+				continue;
+			}
+			link = &h->next;
+		}
+	}
+}
+
+/**
+ * @brief return true if the server has neither closed fd nor sent anything on it
+ *
+ * @param fd idle server connection
+ * @return bool
+ */
+static bool upstream_alive(int fd)
+{
+	char c;
+
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * @brief take the most recently used idle connection to host:port that is still open
+ *
+ * @param host server host
+ * @param port server port
+ * @return int - connected fd owned by the caller, -1 if there is none
+ */
+int upstream_take(const char *host, const char *port)
+{
+	struct upstream_host **bucket, *h;
+	struct upstream_shard *shard;
+	uint64_t now;
+	int fd;
+
+	if (!upstream_enabled())
+		return -1;
+	shard = upstream_shard(host, port, &bucket);
+	now = timer_now_ms();
+	while (1)
+	{
+		fd = -1;
+		P(&shard->sem);
+		if ((h = upstream_host(bucket, host, port, false)) != NULL)
+		{
+			upstream_expire(h, now);
+			if (h->nidle > 0)
+			{
+				fd = h->idle[--h->nidle].fd;
+				atomic_fetch_sub(&stats.idle, 1);
+			}
+			h->used = now;
+		}
+		V(&shard->sem);
+		if (fd < 0)
+		{
+			atomic_fetch_add_explicit(&stats.misses, 1, memory_order_relaxed);
+			return -1;
+		}
+		if (upstream_alive(fd)) // outside the lock, it is a system call
+		{
+			atomic_fetch_add_explicit(&stats.hits, 1, memory_order_relaxed);
+			return fd;
+		}
+		close(fd);
+		atomic_fetch_add_explicit(&stats.stale, 1, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief keep fd for the next request to host:port, or close it if there is no room
+ *
+ * The oldest idle connection to the same host makes room for it.
+ *
+ * @param host server host
+ * @param port server port
+ * @param fd server connection whose last response was read to its end, owned by the pool
+ */
+void upstream_put(const char *host, const char *port, int fd)
+{
+	struct upstream_host **bucket, *h;
+	struct upstream_shard *shard;
+	uint64_t now;
+
+	if (!upstream_enabled())
+	{
+		close(fd);
+		return;
+	}
+	if (atomic_fetch_add(&stats.idle, 1) >= config.max_idle)
+	{
+		atomic_fetch_sub(&stats.idle, 1);
+		atomic_fetch_add_explicit(&stats.full, 1, memory_order_relaxed);
+		close(fd);
+		return;
+	}
+	atomic_fetch_add_explicit(&stats.puts, 1, memory_order_relaxed);
+	shard = upstream_shard(host, port, &bucket);
+	now = timer_now_ms();
+	P(&shard->sem);
+	upstream_sweep(shard, now);
+	h = upstream_host(bucket, host, port, true);
+	if (h->nidle == config.max_per_host)
+	{
+		upstream_drop(h, 1);
+		atomic_fetch_add_explicit(&stats.full, 1, memory_order_relaxed);
+	}
+	h->idle[h->nidle++] = (struct upstream_idle){.fd = fd, .since = now};
+	h->used = now;
+	V(&shard->sem);
+}
+
+/**
+ * @brief close a connection from upstream_take that failed before its response started
+ *
+ * @param fd server connection
+ */
+void upstream_discard(int fd)
+{
+	close(fd);
+	atomic_fetch_add_explicit(&stats.retries, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief count a deadline missed by host:port
+ *
+ * @param host server host
+ * @param port server port
+ * @param kind which deadline
+ */
+void upstream_timed_out(const char *host, const char *port, enum upstream_deadline kind)
+{
+	size_t host_len = strlen(host);
+	struct upstream_origin *o = NULL;
+
+	atomic_fetch_add_explicit(&stats.timeouts[kind], 1, memory_order_relaxed);
+	P(&origins.sem);
+	for (int i = 0; i < origins.n && o == NULL; i++)
+	{
+		if (strncmp(origins.origins[i].key, host, host_len) == 0 && origins.origins[i].key[host_len] == ':' &&
+			strcmp(origins.origins[i].key + host_len + 1, port) == 0)
+			o = &origins.origins[i];
+	}
+	if (o == NULL && origins.n < UPSTREAM_ORIGINS)
+	{
+		o = &origins.origins[origins.n++];
+		o->key = Malloc(host_len + strlen(port) + 2);
+		sprintf(o->key, "%s:%s", host, port);
+	}
+	if (o)
+	{
+		o->timeouts[kind]++;
+		o->total++;
+		o->last = timer_now_ms();
+	}
+	else
+		origins.other[kind]++;
+	V(&origins.sem);
+}
+
+static int origin_compare(const void *a, const void *b)
+{
+	const struct upstream_origin *x = a, *y = b;
+
+	return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+/**
+ * @brief dump the origins with the most timeouts
+ *
+ * @param fp output stream
+ */
+static void upstream_print_origins(FILE *fp)
+{
+	struct upstream_origin top[UPSTREAM_ORIGINS];
+	unsigned long other[UPSTREAM_DEADLINES];
+	uint64_t now = timer_now_ms();
+	int n;
+
+	P(&origins.sem);
+	n = origins.n;
+	memcpy(top, origins.origins, n * sizeof(top[0]));
+	memcpy(other, origins.other, sizeof(other));
+	V(&origins.sem);
+	qsort(top, n, sizeof(top[0]), origin_compare);
+	for (int i = 0; i < n && i < UPSTREAM_ORIGINS_SHOWN; i++)
+		fprintf(fp, "upstream:   %s: connect %lu, first byte %lu, read %lu, last %.1fs ago\n", top[i].key, top[i].timeouts[UPSTREAM_CONNECT],
+				top[i].timeouts[UPSTREAM_FIRST_BYTE], top[i].timeouts[UPSTREAM_READ], (now - top[i].last) / 1000.0);
+	if (n > UPSTREAM_ORIGINS_SHOWN)
+		fprintf(fp, "upstream:   %d more origins\n", n - UPSTREAM_ORIGINS_SHOWN);
+	if (other[UPSTREAM_CONNECT] + other[UPSTREAM_FIRST_BYTE] + other[UPSTREAM_READ] > 0)
+		fprintf(fp, "upstream:   others: connect %lu, first byte %lu, read %lu\n",
+				other[UPSTREAM_CONNECT], other[UPSTREAM_FIRST_BYTE], other[UPSTREAM_READ]);
+}
+
+/**
+ * @brief dump pool and server timeout counters
+ *
+ * @param fp output stream
+ */
+void upstream_print_stats(FILE *fp)
+{
+	unsigned long hits = atomic_load(&stats.hits), misses = atomic_load(&stats.misses);
+
+	if (!upstream_enabled())
+		fprintf(fp, "upstream: pooling off\n");
+	else
+	{
+		fprintf(fp, "upstream: idle %ld (limit %d, %d per host), hits %lu, misses %lu (%.1f%% reused), stale %lu, retried %lu\n",
+				atomic_load(&stats.idle), config.max_idle, config.max_per_host, hits, misses,
+				hits + misses ? 100.0 * hits / (hits + misses) : 0.0, atomic_load(&stats.stale), atomic_load(&stats.retries));
+		fprintf(fp, "upstream: %lu put back, %lu closed for room, %lu closed idle\n",
+				atomic_load(&stats.puts), atomic_load(&stats.full), atomic_load(&stats.expired));
+	}
+	fprintf(fp, "upstream: servers timed out connecting %lu, before the first byte %lu, between reads %lu\n",
+			atomic_load(&stats.timeouts[UPSTREAM_CONNECT]), atomic_load(&stats.timeouts[UPSTREAM_FIRST_BYTE]),
+			atomic_load(&stats.timeouts[UPSTREAM_READ]));
+	upstream_print_origins(fp);
+}
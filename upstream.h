@@ -0,0 +1,57 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/*
+ * Idle HTTP/1.1 connections to origin servers, kept per host:port so that a
+ * cache miss to a server we talked to recently skips the DNS lookup and the
+ * TCP handshake. A connection goes back to the pool only once its response
+ * was read to the end of its framing and the server did not ask to close.
+ *
+ * A connection is checked before it is handed out again: the server must
+ * not have closed it or sent anything since. That still races with a
+ * server closing it at the same moment, so callers send a request that has
+ * no body again on a fresh connection when a pooled one fails before any
+ * byte of the response.
+ *
+ * The pool is shared by every thread and loop, in shards with a lock each.
+ *
+ * Servers that miss a deadline are reported with upstream_timed_out(): the
+ * first UPSTREAM_ORIGINS host:port to do so are counted one by one, so the
+ * statistics name the origins that are stuck, and the others together.
+ */
+
+#define UPSTREAM_DEFAULT_MAX_IDLE 128	 // idle connections in the pool, 0 disables pooling
+#define UPSTREAM_DEFAULT_MAX_PER_HOST 8	 // idle connections to one host:port
+#define UPSTREAM_DEFAULT_IDLE_TIMEOUT 15 // seconds, below the keep-alive timeout of common servers
+#define UPSTREAM_SHARDS 16
+#define UPSTREAM_BUCKETS 64 // hash buckets of a shard
+#define UPSTREAM_ORIGINS 64 // origins whose timeouts are counted one by one
+#define UPSTREAM_ORIGINS_SHOWN 8 // in the statistics, those with the most timeouts
+
+enum upstream_deadline
+{
+	UPSTREAM_CONNECT,	 // no address of the server connected in time
+	UPSTREAM_FIRST_BYTE, // the server sent nothing in time after the request
+	UPSTREAM_READ,		 // the response stalled between two reads
+	UPSTREAM_DEADLINES
+};
+
+struct upstream_config
+{
+	int max_idle;
+	int max_per_host;
+	int idle_timeout_ms;
+};
+
+void upstream_init(const struct upstream_config *);
+bool upstream_enabled(void);
+int upstream_take(const char *host, const char *port);
+void upstream_put(const char *host, const char *port, int fd);
+void upstream_discard(int fd);
+void upstream_timed_out(const char *host, const char *port, enum upstream_deadline);
+void upstream_print_stats(FILE *);
+
+#endif /* __UPSTREAM_H__ */
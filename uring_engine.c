@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include "conn.h"
+#include "engine.h"
+#include "admission.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <stdatomic.h>
+
+/*
+ * Completion based twin of epoll_engine.c. Every connection has at most one
+ * SQE in flight whose user_data is the connection itself; user_data 0 is the
+ * multishot accept on the listen fd. SQEs produced while handling a batch of
+ * CQEs are submitted together by the next io_uring_enter.
+ *
+ * Client deadlines are on a timer wheel per loop, whose next expiry bounds
+ * the wait of io_uring_enter. When the timer of a connection fires its SQE
+ * is cancelled, and the connection expires once that SQE completes, so it
+ * is never freed under an operation in flight. A connection waiting for a
+ * server name has no SQE; it expires at once, but is only freed once its
+ * lookup is answered.
+ *
+ * Answered lookups are handed back on the dns queue of the loop, watched
+ * with an IORING_OP_POLL_ADD on its eventfd that is renewed each time it
+ * completes.
+ *
+ * liburing is not required: the rings are mapped with the raw syscalls.
+ */
+
+struct uring
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned pending; // SQEs queued since the last io_uring_enter
+	bool ext_arg;	  // io_uring_enter takes a timeout (5.11)
+	atomic_ulong submitted, enters; // counters, written only by the owning loop
+};
+struct uring_stats
+{
+	atomic_ulong cqes, fixed_ops, slot_misses;
+}; // written only by the owning loop
+struct uring_loop
+{
+	const struct engine_config *cfg;
+	int index;
+	struct uring_stats stats;
+	struct uring ring;
+	int listenfd;
+	bool multishot_accept;
+	char *buffers; // URING_BUFFER_SLOTS slots of in + relay, registered as fixed buffer 0
+	int *free_slots, nfree;
+	struct timer_wheel timers;
+	struct dns_queue dns; // answered lookups of connections in CONN_RESOLVE
+	struct __kernel_timespec tick; // of the IORING_OP_TIMEOUT in flight without ext_arg
+	bool tick_pending;
+};
+
+static struct uring_loop *loops;
+static int nloops;
+
+#define URING_SLOT_SIZE (CONN_REQUEST_MAX + CONN_RELAY_SIZE)
+#define URING_TICK 1   // user_data of the IORING_OP_TIMEOUT waking a loop on kernels without ext_arg
+#define URING_CANCEL 2 // user_data of IORING_OP_ASYNC_CANCEL
+#define URING_DNS 3	   // user_data of the IORING_OP_POLL_ADD on the eventfd of the dns queue
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief create a ring and map its queues
+ *
+ * @param ring ring to initialize
+ * @param entries submission queue size
+ * @return int - 0 on success, -1 with errno set if io_uring is unavailable
+ */
+static int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *sq_ptr, *cq_ptr;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = sys_io_uring_setup(entries, &p)) < 0)
+		return -1;
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) // both rings live in one mapping
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		goto fail;
+	cq_ptr = sq_ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+	ring->pending = 0;
+	ring->ext_arg = p.features & IORING_FEAT_EXT_ARG;
+	return 0;
+
+fail:
+	close(ring->fd);
+	return -1;
+}
+
+/**
+ * @brief submit queued SQEs and optionally wait for completions
+ *
+ * @param ring ring
+ * @param wait minimum number of completions to wait for
+ * @param timeout_ms stop waiting after this long, < 0 for never; ignored without ext_arg
+ */
+static void uring_submit(struct uring *ring, unsigned wait, int timeout_ms)
+{
+	struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = timeout_ms % 1000 * 1000000L};
+	struct io_uring_getevents_arg arg = {.ts = (unsigned long)&ts};
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	int rc;
+
+	if (wait && timeout_ms >= 0 && ring->ext_arg)
+		flags |= IORING_ENTER_EXT_ARG;
+	while ((rc = sys_io_uring_enter(ring->fd, ring->pending, wait, flags, flags & IORING_ENTER_EXT_ARG ? &arg : NULL,
+									flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0)) < 0)
+	{
+		if (errno == ETIME) // nothing submitted and nothing completed in time
+			return;
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			unix_error("uring_submit: io_uring_enter error");
+		if (errno != EINTR) // completion queue is backed up, drain it before retrying
+			return;
+	}
+	STAT_ADD(ring->enters, 1);
+	STAT_ADD(ring->submitted, rc);
+	ring->pending -= rc;
+}
+
+/**
+ * @brief take a zeroed SQE, flushing the queue first if it is full
+ *
+ * @param ring ring
+ * @return struct io_uring_sqe*
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned tail = *ring->sq_tail, index;
+	struct io_uring_sqe *sqe;
+
+	while (tail - atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire) >= ring->sq_entries)
+		uring_submit(ring, 0, -1);
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	return sqe;
+}
+
+static void uring_queue_sqe(struct uring *ring)
+{
+	atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, *ring->sq_tail + 1, memory_order_release);
+	ring->pending++;
+}
+
+static void uring_prep_accept(struct uring_loop *loop)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = loop->listenfd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->ioprio = loop->multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+	sqe->user_data = 0;
+	uring_queue_sqe(&loop->ring);
+}
+
+static void uring_prep_dns(struct uring_loop *loop)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->dns.efd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_DNS;
+	uring_queue_sqe(&loop->ring);
+}
+
+/**
+ * @brief register one region holding the in and relay buffers of every slot
+ *
+ * @param loop event loop
+ * @param slots number of connections that can use fixed buffers at once
+ */
+static void uring_init_buffers(struct uring_loop *loop, int slots)
+{
+	struct iovec iov;
+
+	loop->buffers = mmap(NULL, (size_t)slots * URING_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (loop->buffers == MAP_FAILED)
+		unix_error("uring_init_buffers: mmap error");
+	iov.iov_base = loop->buffers;
+	iov.iov_len = (size_t)slots * URING_SLOT_SIZE;
+	if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+	{
+		fprintf(stderr, "io_uring: cannot register buffers (%s), using plain recv/send\n", strerror(errno));
+		munmap(loop->buffers, iov.iov_len);
+		loop->buffers = NULL;
+		loop->nfree = 0;
+		return;
+	}
+	loop->free_slots = Malloc(slots * sizeof(*loop->free_slots));
+	for (loop->nfree = 0; loop->nfree < slots; loop->nfree++)
+		loop->free_slots[loop->nfree] = slots - 1 - loop->nfree;
+}
+
+static bool uring_is_fixed(struct uring_loop *loop, const char *buf)
+{
+	return loop->buffers && buf >= loop->buffers && buf < loop->buffers + (size_t)URING_BUFFER_SLOTS * URING_SLOT_SIZE;
+}
+
+/**
+ * @brief queue the next operation of c, or release it if it is finished
+ *
+ * @param loop event loop
+ * @param c connection
+ */
+static void uring_drive(struct uring_loop *loop, struct conn *c)
+{
+	struct io_uring_sqe *sqe;
+	struct conn_io io;
+
+	conn_next(c, &io);
+	if (io.op == CONN_OP_CLOSE)
+	{
+		if (uring_is_fixed(loop, c->in))
+			loop->free_slots[loop->nfree++] = (c->in - loop->buffers) / URING_SLOT_SIZE;
+		conn_free(c);
+		return;
+	}
+	if (io.op == CONN_OP_WAIT) // uring_resolved drives it again
+		return;
+
+	sqe = uring_get_sqe(&loop->ring);
+	sqe->fd = io.fd;
+	sqe->user_data = (unsigned long)c;
+	switch (io.op)
+	{
+	case CONN_OP_READ_CLIENT:
+	case CONN_OP_READ_SERVER:
+	case CONN_OP_WRITE_CLIENT:
+	case CONN_OP_WRITE_SERVER:
+		sqe->addr = (unsigned long)io.buf;
+		sqe->len = io.len;
+		if (uring_is_fixed(loop, io.buf))
+		{
+			sqe->opcode = (io.op == CONN_OP_READ_CLIENT || io.op == CONN_OP_READ_SERVER) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->off = -1; // sockets have no file position
+			sqe->buf_index = 0;
+			STAT_ADD(loop->stats.fixed_ops, 1);
+		}
+		else if (io.op == CONN_OP_READ_CLIENT || io.op == CONN_OP_READ_SERVER)
+		{
+			sqe->opcode = IORING_OP_RECV;
+		}
+		else
+		{
+			sqe->opcode = IORING_OP_SEND;
+			sqe->msg_flags = MSG_NOSIGNAL;
+		}
+		break;
+
+	case CONN_OP_POLL:
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		break;
+
+	default:
+		break;
+	}
+	uring_queue_sqe(&loop->ring);
+}
+
+static void uring_accepted(struct uring_loop *loop, int connfd)
+{
+	char *in = NULL, *relay = NULL;
+	int slot;
+
+	if (!admission_accept())
+	{
+		admission_reject(connfd);
+		close(connfd);
+		return;
+	}
+	if (loop->nfree > 0)
+	{
+		slot = loop->free_slots[--loop->nfree];
+		in = loop->buffers + (size_t)slot * URING_SLOT_SIZE;
+		relay = in + CONN_REQUEST_MAX;
+	}
+	else if (loop->buffers)
+	{
+		STAT_ADD(loop->stats.slot_misses, 1);
+	}
+	uring_drive(loop, conn_new(connfd, in, relay, &loop->timers, &loop->dns));
+}
+
+static void uring_resolved(struct uring_loop *loop)
+{
+	struct dns_waiter *w, *next;
+
+	for (w = dns_queue_take(&loop->dns); w; w = next)
+	{
+		next = w->next; // w is part of the connection, which may be freed
+		conn_resolved(w->data);
+		uring_drive(loop, w->data);
+	}
+	uring_prep_dns(loop);
+}
+
+/**
+ * @brief cancel the operation of the connections whose deadline has passed, and return how long until the next one may
+ *
+ * Without ext_arg an IORING_OP_TIMEOUT wakes the loop instead, at most
+ * URING_TICK_MAX_MS later than the deadline.
+ *
+ * @param loop event loop
+ * @return int - timeout for io_uring_enter in ms, -1 if no connection has a deadline
+ */
+static int uring_expire(struct uring_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+	struct timer *t;
+	struct conn *c;
+	uint64_t now = timer_now_ms();
+	int timeout;
+
+	while ((t = timer_expired(&loop->timers, now)) != NULL)
+	{
+		c = timer_entry(t, struct conn, timer);
+		if (c->state == CONN_RESOLVE) // no SQE to cancel
+		{
+			conn_expire(c);
+			continue;
+		}
+		c->expired = true;
+		sqe = uring_get_sqe(&loop->ring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long)c;
+		sqe->user_data = URING_CANCEL;
+		uring_queue_sqe(&loop->ring);
+	}
+	if ((timeout = timer_wheel_timeout(&loop->timers, now)) >= 0 && !loop->ring.ext_arg && !loop->tick_pending)
+	{
+		if (timeout > URING_TICK_MAX_MS)
+			timeout = URING_TICK_MAX_MS;
+		loop->tick.tv_sec = timeout / 1000;
+		loop->tick.tv_nsec = timeout % 1000 * 1000000L;
+		sqe = uring_get_sqe(&loop->ring);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (unsigned long)&loop->tick;
+		sqe->len = 1;
+		sqe->user_data = URING_TICK;
+		uring_queue_sqe(&loop->ring);
+		loop->tick_pending = true;
+	}
+	return timeout;
+}
+
+static void *uring_loop_run(void *arg)
+{
+	struct uring_loop *loop = arg;
+	struct uring *ring = &loop->ring;
+	struct io_uring_cqe *cqe;
+	struct conn *c;
+	unsigned head, tail;
+	int timeout = -1;
+
+	engine_loop_setup(loop->cfg, loop->index);
+	uring_prep_accept(loop);
+	uring_prep_dns(loop);
+	while (1)
+	{
+		uring_submit(ring, 1, timeout);
+		head = *ring->cq_head;
+		tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire);
+		for (; head != tail; head++)
+		{
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			STAT_ADD(loop->stats.cqes, 1);
+			if (cqe->user_data == 0) // accept
+			{
+				if (cqe->res >= 0)
+					uring_accepted(loop, cqe->res);
+				else if (cqe->res == -EINVAL && loop->multishot_accept) // kernel older than 5.19
+					loop->multishot_accept = false;
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					uring_prep_accept(loop);
+				continue;
+			}
+			if (cqe->user_data == URING_DNS)
+			{
+				uring_resolved(loop);
+				continue;
+			}
+			if (cqe->user_data == URING_TICK || cqe->user_data == URING_CANCEL)
+			{
+				if (cqe->user_data == URING_TICK)
+					loop->tick_pending = false;
+				continue;
+			}
+			c = (struct conn *)cqe->user_data;
+			if (c->expired) // cancelled or not, the result is not wanted any more
+			{
+				c->expired = false;
+				conn_expire(c);
+			}
+			else
+			{
+				conn_complete(c, cqe->res);
+			}
+			uring_drive(loop, c);
+		}
+		atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head, memory_order_release);
+		timeout = uring_expire(loop);
+	}
+	return NULL;
+}
+
+/**
+ * @brief serve connections with cfg->nloops io_uring loops, each with its own ring
+ *
+ * @param cfg engine configuration
+ * @return int - -1 if io_uring is not available, otherwise does not return
+ */
+int uring_engine_run(const struct engine_config *cfg)
+{
+	pthread_t tid;
+
+	loops = Calloc(cfg->nloops, sizeof(*loops));
+	for (int i = 0; i < cfg->nloops; i++)
+	{
+		if (uring_init(&loops[i].ring, URING_ENTRIES) < 0)
+		{
+			fprintf(stderr, "io_uring: setup failed: %s\n", strerror(errno));
+			return -1;
+		}
+		loops[i].cfg = cfg;
+		loops[i].index = i;
+		loops[i].listenfd = engine_listenfd(cfg, i);
+		loops[i].multishot_accept = true;
+		timer_wheel_init(&loops[i].timers, timer_now_ms());
+		dns_queue_init(&loops[i].dns);
+		uring_init_buffers(&loops[i], URING_BUFFER_SLOTS);
+	}
+	nloops = cfg->nloops;
+	for (int i = 1; i < cfg->nloops; i++)
+		Pthread_create(&tid, NULL, uring_loop_run, &loops[i]);
+	uring_loop_run(&loops[0]);
+	return 0;
+}
+
+/**
+ * @brief dump submission counters of the io_uring engine
+ *
+ * @param fp output stream
+ */
+void uring_print_stats(FILE *fp)
+{
+	unsigned long sqes = 0, enters = 0, cqes = 0, fixed_ops = 0, slot_misses = 0;
+
+	for (int i = 0; i < nloops; i++)
+	{
+		sqes += atomic_load_explicit(&loops[i].ring.submitted, memory_order_relaxed);
+		enters += atomic_load_explicit(&loops[i].ring.enters, memory_order_relaxed);
+		cqes += atomic_load_explicit(&loops[i].stats.cqes, memory_order_relaxed);
+		fixed_ops += atomic_load_explicit(&loops[i].stats.fixed_ops, memory_order_relaxed);
+		slot_misses += atomic_load_explicit(&loops[i].stats.slot_misses, memory_order_relaxed);
+	}
+	fprintf(fp, "uring: sqes %lu, io_uring_enter %lu (%.2f sqes per call), cqes %lu\n",
+			sqes, enters, enters ? (double)sqes / enters : 0.0, cqes);
+	fprintf(fp, "uring: fixed buffer ops %lu, connections without a buffer slot %lu\n", fixed_ops, slot_misses);
+}